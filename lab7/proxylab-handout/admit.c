@@ -0,0 +1,234 @@
+/**
+ * This file implements per-client admission control.
+ * 
+ * Every client IP owns a token bucket, refilled at opt.rate
+ * tokens per second up to opt.burst, and a count of the
+ * connections being served for it. A new connection takes
+ * a token and a connection slot, or gets rejected.
+ * 
+ * Clients are kept in a hash table split into ADMIT_SHARDS
+ * shards with their own locks, so accepting connections
+ * from different clients rarely contends. Clients with no
+ * active connections and a full bucket carry no state and
+ * are dropped lazily whenever their shard is visited.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "admit.h"
+#include "debug.h"
+#include "util.h"
+
+/*
+ * Extract the client address bytes of a socket address.
+ * Return the number of bytes, 0 for unknown families.
+ */
+static int addr_bytes(struct sockaddr *sa, unsigned char *out) {
+    if (sa->sa_family == AF_INET) {
+        memcpy(out, &((struct sockaddr_in *) sa)->sin_addr, 4);
+        return 4;
+    }
+    if (sa->sa_family == AF_INET6) {
+        memcpy(out, &((struct sockaddr_in6 *) sa)->sin6_addr, 16);
+        return 16;
+    }
+    return 0;
+}
+
+/*
+ * Refill the bucket of a client for the time passed.
+ */
+static inline void refill(admit_t *adm, a_node_t *n, long now) {
+    n->tokens += adm->opt.rate * (now - n->last) / 1000.0;
+    if (n->tokens > adm->opt.burst) {
+        n->tokens = adm->opt.burst;
+    }
+    n->last = now;
+}
+
+/*
+ * Whether a client can be forgotten.
+ */
+static inline int idle(admit_t *adm, a_node_t *n, long now) {
+    refill(adm, n, now);
+    return n->active == 0 && n->tokens >= adm->opt.burst;
+}
+
+/*
+ * Find the node of a client in a row, dropping idle
+ * clients on the way. Create the node if create is set.
+ * Must be called with the shard lock held.
+ */
+static a_node_t *lookup(admit_t *adm, a_node_t **row, int family,
+                        unsigned char *addr, int len, int create, long now) {
+    a_node_t **link = row;
+    a_node_t *cur;
+    a_node_t *found = NULL;
+    
+    while ((cur = *link)) {
+        if (cur->family == family && !memcmp(cur->addr, addr, len)) {
+            found = cur;
+            link = &cur->next;
+        }
+        else if (idle(adm, cur, now)) {
+            *link = cur->next;
+            free(cur);
+        }
+        else {
+            link = &cur->next;
+        }
+    }
+    
+    if (!found && create && (found = malloc(sizeof(a_node_t)))) {
+        found->family = family;
+        memcpy(found->addr, addr, len);
+        found->tokens = adm->opt.burst;
+        found->last = now;
+        found->active = 0;
+        found->next = *row;
+        *row = found;
+    }
+    return found;
+}
+
+/*
+ * Init an admission table instance.
+ */
+admit_t *init_admit(admit_opt_t *opt) {
+    admit_t *adm = (admit_t *) calloc(1, sizeof(admit_t));
+    int i;
+    
+    if (!adm) {
+        perror("Init admit - malloc");
+        return NULL;
+    }
+    adm->opt = *opt;
+    /* by default a client may burst one second worth of tokens */
+    if (adm->opt.burst < 1) {
+        adm->opt.burst = adm->opt.rate > 1 ? adm->opt.rate : 1;
+    }
+    for (i = 0; i < ADMIT_SHARDS; i++) {
+        if (sem_init(&adm->shards[i].lock, 0, 1) < 0) {
+            perror("Init admit - lock");
+            free(adm);
+            return NULL;
+        }
+    }
+    return adm;
+}
+
+/*
+ * Free an admission table instance.
+ */
+void free_admit(admit_t *adm) {
+    a_node_t *cur;
+    a_node_t *tmp;
+    int i;
+    int j;
+    
+    if (!adm) {
+        return;
+    }
+    for (i = 0; i < ADMIT_SHARDS; i++) {
+        for (j = 0; j < ADMIT_ROWS; j++) {
+            cur = adm->shards[i].rows[j];
+            while (cur) {
+                tmp = cur->next;
+                free(cur);
+                cur = tmp;
+            }
+        }
+        sem_destroy(&adm->shards[i].lock);
+    }
+    free(adm);
+}
+
+/*
+ * Decide whether a new connection from the client at sa
+ * is let in. Return ADMIT_OK, ADMIT_RATE or ADMIT_CONN.
+ * Every ADMIT_OK must be paired with an admit_release.
+ */
+int admit_acquire(admit_t *adm, struct sockaddr *sa) {
+    unsigned char addr[16];
+    int len = addr_bytes(sa, addr);
+    unsigned h;
+    a_shard_t *shard;
+    a_node_t *n;
+    int verdict = ADMIT_OK;
+    long now = now_ms();
+    
+    /* no limits, or nothing to tell clients apart with */
+    if ((adm->opt.rate <= 0 && adm->opt.maxconn <= 0) || len == 0) {
+        return ADMIT_OK;
+    }
+    
+    h = fnv_hash(addr, len);
+    shard = &adm->shards[h % ADMIT_SHARDS];
+    if (sem_p(&shard->lock) < 0) {
+        perror("Admit - lock");
+        return ADMIT_OK;
+    }
+    
+    n = lookup(adm, &shard->rows[(h / ADMIT_SHARDS) % ADMIT_ROWS],
+               sa->sa_family, addr, len, 1, now);
+    if (n) {
+        if (adm->opt.maxconn > 0 && n->active >= adm->opt.maxconn) {
+            verdict = ADMIT_CONN;
+        }
+        else if (adm->opt.rate > 0) {
+            refill(adm, n, now);
+            if (n->tokens < 1) {
+                verdict = ADMIT_RATE;
+            }
+            else {
+                n->tokens -= 1;
+            }
+        }
+        if (verdict == ADMIT_OK) {
+            n->active++;
+        }
+    }
+    
+    if (sem_v(&shard->lock) < 0) {
+        perror("Admit - unlock");
+    }
+    return verdict;
+}
+
+/*
+ * Give back the connection slot taken by admit_acquire.
+ */
+void admit_release(admit_t *adm, struct sockaddr *sa) {
+    unsigned char addr[16];
+    int len = addr_bytes(sa, addr);
+    unsigned h;
+    a_shard_t *shard;
+    a_node_t *n;
+    
+    if ((adm->opt.rate <= 0 && adm->opt.maxconn <= 0) || len == 0) {
+        return;
+    }
+    
+    h = fnv_hash(addr, len);
+    shard = &adm->shards[h % ADMIT_SHARDS];
+    if (sem_p(&shard->lock) < 0) {
+        perror("Admit release - lock");
+        return;
+    }
+    
+    n = lookup(adm, &shard->rows[(h / ADMIT_SHARDS) % ADMIT_ROWS],
+               sa->sa_family, addr, len, 0, now_ms());
+    if (n && n->active > 0) {
+        n->active--;
+    }
+    
+    if (sem_v(&shard->lock) < 0) {
+        perror("Admit release - unlock");
+    }
+}
@@ -0,0 +1,56 @@
+/**
+ * Header file for admit.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include <semaphore.h>
+#include <sys/socket.h>
+
+#define ADMIT_SHARDS 64         /* number of independently locked shards */
+#define ADMIT_ROWS 64           /* hash table rows per shard */
+
+/* Verdicts */
+#define ADMIT_OK 0              /* let the connection in */
+#define ADMIT_RATE 1            /* out of tokens, answer 429 */
+#define ADMIT_CONN 2            /* too many connections, answer 503 */
+
+/* The admission options struct. 0 disables a limit */
+typedef struct {
+    double rate;                /* connections per second per client */
+    double burst;               /* token bucket size */
+    int maxconn;                /* concurrent connections per client */
+} admit_opt_t;
+
+/* The per-client state struct */
+typedef struct a_node {
+    struct a_node *next;        /* hash table next */
+    int family;                 /* address family of the client */
+    unsigned char addr[16];     /* client address, v4 uses 4 bytes */
+    double tokens;              /* tokens left in the bucket */
+    long last;                  /* last refill, in milliseconds */
+    int active;                 /* connections being served */
+} a_node_t;
+
+/* The shard struct */
+typedef struct {
+    a_node_t *rows[ADMIT_ROWS]; /* hash table */
+    sem_t lock;                 /* guards the shard */
+} a_shard_t;
+
+/* The admission table struct */
+typedef struct {
+    admit_opt_t opt;            /* limits */
+    a_shard_t shards[ADMIT_SHARDS];
+} admit_t;
+
+admit_t *init_admit(admit_opt_t *);
+void free_admit(admit_t *);
+int admit_acquire(admit_t *, struct sockaddr *);
+void admit_release(admit_t *, struct sockaddr *);
+
+#endif /* __ADMIT_H__ */
@@ -1,145 +1,1607 @@
 /**
- * This file implements a LRU cache.
- * The implementation is doubly linked hash table,
- * i.e. hash table is used to quickly put and get
- * the cached objects, and all objects in the cache
- * form a doubly linked list, where the objects are
- * ordered by access time descentantly.
+ * This file implements the object cache: a hash table to
+ * put and get the cached objects quickly, with the objects
+ * also kept in doubly linked queues, in the order they are
+ * to be evicted. The eviction policy is picked at init_cache
+ * among LRU, CLOCK, SLRU, ARC, S3-FIFO, W-TinyLFU and GDSF,
+ * described below.
  * 
- * The put and get operations are thread safe.
- * Put and put, put and get, are mutually exclusive,
- * while get and get can happen together.
+ * The cache is split into shards, picked by the hash of the
+ * key. Each shard is a cache of its own, with its own lock,
+ * hash table, eviction queues, key index and a slice of the
+ * capacity, so requests for keys of different shards don't
+ * wait for each other.
+ * 
+ * Entries are split into a per-key part (the response headers)
+ * and a body. Bodies are stored once per distinct content,
+ * found by content hash and shared with reference counts,
+ * so byte-identical bodies under different keys only take
+ * up capacity once. The body table is shared by all shards
+ * and guarded by lock stripes, each row by one of them.
+ * A body is charged to the shard that cached it first, so
+ * the size of a shard may include bodies entries of other
+ * shards hold too. Once the last entry of that shard holding
+ * it is gone, the charge moves to the shard of another one.
+ * 
+ * A get pins the entry it returns, so it can be written out
+ * straight from cache memory: evicting or replacing it only
+ * unlinks it, and it is freed when the last pin is dropped.
+ * 
+ * Keys are also kept in order in a crit-bit tree (a binary
+ * radix tree), so purging all keys under a prefix only
+ * visits the keys that match.
+ * 
+ * The hash tables use open addressing: entries are kept in
+ * a slot array along with their key hash, and each slot has
+ * a one byte tag holding 7 bits of the hash, or marking it
+ * empty or deleted. Probes go a group of 16 slots at a time,
+ * comparing all their tags in one SSE2 instruction, and only
+ * look at slots whose tag and hash match, so a lookup mostly
+ * touches a tag line, a slot line and the node it finds.
+ * 
+ * A shard's hash table is replaced once MAX_LOAD eighths of
+ * its slots are taken, by one twice as large (or as large,
+ * if mostly deleted slots). The old table is migrated a few
+ * groups per put, while lookups look in both, so no put pays
+ * for the whole table.
+ * 
+ * The capacity can be changed while the cache is in use.
+ * Shrinking it evicts a few entries at a time so that readers
+ * are not held off for long. The number of shards stays, so
+ * entries over the new slice (cache_max_entry) are turned
+ * away by put from then on.
+ * 
+ * Instead of LRU, a cache may evict by CLOCK (second chance):
+ * a hit only marks the entry, and the eviction scan moves
+ * marked entries back to the head of the list, clearing the
+ * mark, until it finds an unmarked one. Hits then don't write
+ * to the list, so they take no lock at all: writers publish
+ * nodes and tables with atomic stores, readers follow them
+ * with atomic loads, and unlinked nodes, bodies and tables
+ * are freed through epoch based reclamation (epoch.c) once
+ * no reader can still be on them. Until then, their bytes
+ * count against the capacity. Under policies whose hits
+ * move entries, readers take the shard lock, so a node is
+ * freed as soon as the last handle on it is released.
+ * 
+ * Other eviction policies keep entries in up to three queues
+ * per shard, chosen at init_cache:
+ * - SLRU puts new entries on probation and protects those
+ *   hit there, up to SLRU_HOT percent of the shard, so a scan
+ *   of keys asked for once only goes through probation.
+ * - ARC keeps entries seen once and seen again apart, with
+ *   ghosts of the keys evicted from each. A miss on a ghost
+ *   moves the target size of the first queue its way.
+ * - S3-FIFO queues new entries in a small FIFO; those hit
+ *   there move on to the main FIFO, the others are evicted
+ *   and remembered in a ghost, so they skip it next time.
+ *   The main FIFO is a CLOCK counting up to S3_MAXFREQ hits.
+ *   Hits only mark, so they take no lock either.
+ * - W-TinyLFU queues new entries in a small LRU window and
+ *   keeps the rest in SLRU. An entry leaving the window only
+ *   stays if a frequency sketch of the gets (sketch.c) says
+ *   it is asked for more often than the SLRU victim.
+ * - GDSF (GreedyDual-Size-Frequency) gives each entry a
+ *   priority, its gets times the cost of missing it over its
+ *   size, plus an inflation that rises to the priority of
+ *   each victim, and evicts the lowest from a binary heap.
+ *   The cost is 1 to aim at object hit ratio, favouring small
+ *   entries, or the size to aim at byte hit ratio.
+ * 
+ * Any of them can be put behind a TinyLFU admission filter
+ * (CACHE_ADMIT): gets are counted in a sketch, and a new key
+ * that doesn't fit is only put if it is asked for more often
+ * than each entry evicting would take out, so a large object
+ * asked for once can't push out many small popular ones.
+ * The sketch has a doorkeeper, a bloom filter keys go through
+ * before being counted, so keys seen once take no counters.
+ * 
+ * All the operations are thread safe. Locks are taken in
+ * the order: shard, body stripe. A get moving the entry in
+ * its queue locks the shard exclusively.
  * 
  * 
  * Liruoyang YU
  * liruoyay
  */
 
-#include "cache.h"
+#include <stdint.h>
+#include <fnmatch.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "cache.h"
+#include "epoch.h"
+#include "util.h"
+
+#define WY_P0 0xa0761d6478bd642fUL     /* for hashing (wyhash) */
+#define WY_P1 0xe7037ed1a0b428dbUL
+#define WY_P2 0x8ebc6af09c88c6e3UL
+#define WY_P3 0x589965cc75374cc3UL
+#define EVICT_BATCH 16  /* evictions per shard lock hold when shrinking */
+#define MAX_LOAD 7      /* eighths of the slots taken before a table grows */
+#define MIGRATE_GROUPS 2    /* old groups migrated per put while growing */
+#define SLRU_HOT 80     /* percent of a shard protected, SLRU and W-TinyLFU */
+#define S3_SMALL 10     /* percent of a shard in the S3-FIFO small queue */
+#define S3_MAXFREQ 3    /* S3-FIFO hits counted per entry */
+#define WINDOW_SHARE 1  /* percent of a shard in the W-TinyLFU window */
+#define HEAP_MIN 64     /* GDSF heap room of a shard at first */
+
+/* eviction queues, what they hold depends on the policy */
+#define Q_NEW 0         /* probation, ARC T1, S3-FIFO small; LRU, CLOCK */
+#define Q_HOT 1         /* protected, ARC T2, S3-FIFO main */
+#define Q_WINDOW 2      /* W-TinyLFU window */
+
+/* hash table tags, full slots hold 7 bits of the key hash */
+#define CTRL_EMPTY 0x80 /* free, ends probes */
+#define CTRL_DEAD 0xfe  /* deleted, probes go on past it */
+
+/* key index pointers: inner nodes are tagged, leaves are c_node_t */
+#define IS_CRIT(p) ((uintptr_t)(p) & 1)
+#define TO_CRIT(p) ((c_crit_t *)((uintptr_t)(p) - 1))
+
+/* shard sizes are charged from other shards too */
+#define SIZE_ADD(sh, n) __atomic_add_fetch(&(sh)->size, (n), __ATOMIC_RELAXED)
+#define SIZE_SUB(sh, n) __atomic_sub_fetch(&(sh)->size, (n), __ATOMIC_RELAXED)
+#define SIZE_OF(sh) __atomic_load_n(&(sh)->size, __ATOMIC_RELAXED)
+/* and capacities are changed without the shard lock */
+#define CAP_OF(sh) __atomic_load_n(&(sh)->cap, __ATOMIC_RELAXED)
+/* and retired bytes are freed by whichever thread reclaims */
+#define RETIRED_OF(sh) __atomic_load_n(&(sh)->retired, __ATOMIC_RELAXED)
+
+/*
+ * Lock a shard exclusively.
+ */
+static inline int write_lock(c_shard_t *sh) {
+    return pthread_rwlock_wrlock(&sh->lock);
+}
+
+/*
+ * Lock a shard shared with other readers.
+ */
+static inline int read_lock(c_shard_t *sh) {
+    return pthread_rwlock_rdlock(&sh->lock);
+}
+
+/*
+ * Unlock a shard locked either way.
+ */
+static inline int unlock_shard(c_shard_t *sh) {
+    return pthread_rwlock_unlock(&sh->lock);
+}
+
+/*
+ * Load a pointer published by a writer.
+ */
+#define LOAD_PTR(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/*
+ * Publish a pointer to lock-free readers.
+ */
+#define STORE_PTR(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/*
+ * Multiply into 128 bits and fold the halves.
+ */
+static inline unsigned long mum(unsigned long a, unsigned long b) {
+    __uint128_t r = (__uint128_t) a * b;
+    return (unsigned long) r ^ (unsigned long) (r >> 64);
+}
+
+/*
+ * Read 8 bytes, unaligned.
+ */
+static inline unsigned long read8(unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+/*
+ * Read 4 bytes, unaligned.
+ */
+static inline unsigned long read4(unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/*
+ * Compute the 64 bit hash of size bytes (wyhash).
+ * Long inputs go 48 bytes a round, in three independent
+ * lanes of multiplies that the CPU runs side by side.
+ */
+static unsigned long hash_bytes(unsigned char *p, size_t size) {
+    unsigned long seed = mum(WY_P0, WY_P1);
+    unsigned long see1, see2;
+    unsigned long a, b;
+    __uint128_t r;
+    size_t i = size;
+    
+    if (size <= 16) {
+        if (size >= 4) {
+            a = (read4(p) << 32) | read4(p + ((size >> 3) << 2));
+            b = (read4(p + size - 4) << 32) | 
+                read4(p + size - 4 - ((size >> 3) << 2));
+        }
+        else if (size > 0) {
+            a = ((unsigned long) p[0] << 16) | 
+                ((unsigned long) p[size >> 1] << 8) | p[size - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        if (i > 48) {
+            see1 = see2 = seed;
+            do {
+                seed = mum(read8(p) ^ WY_P1, read8(p + 8) ^ seed);
+                see1 = mum(read8(p + 16) ^ WY_P2, read8(p + 24) ^ see1);
+                see2 = mum(read8(p + 32) ^ WY_P3, read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mum(read8(p) ^ WY_P1, read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read8(p + i - 16);
+        b = read8(p + i - 8);
+    }
+    r = (__uint128_t) (a ^ WY_P1) * (b ^ seed);
+    return mum((unsigned long) r ^ WY_P0 ^ size, 
+               (unsigned long) (r >> 64) ^ WY_P1);
+}
+
+/*
+ * The tag of a key hash, kept per slot. The low bits of
+ * the hash pick the shard, the middle ones the group, 
+ * the top 7 the tag.
+ */
+static inline unsigned char hash_tag(unsigned long h) {
+    return h >> 57;
+}
+
+/*
+ * The group a probe for hash h starts at.
+ */
+static inline int first_group(c_table_t *t, unsigned long h) {
+    return (h >> 32) & (t->nslots / CACHE_GROUP - 1);
+}
+
+#ifdef __SSE2__
+/*
+ * Bit i set if tag i of a group is c, all compared at once.
+ * Groups are loaded unaligned: nothing aligns the tags of a
+ * table to 16 bytes, and the load costs the same if they are.
+ */
+static inline unsigned group_match(unsigned char *g, unsigned char c) {
+    __m128i ctrl = _mm_loadu_si128((__m128i *) g);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) c)));
+}
+
+/*
+ * Bit i set if slot i of a group is free (empty or dead),
+ * the only tags with the high bit set.
+ */
+static inline unsigned group_free(unsigned char *g) {
+    return _mm_movemask_epi8(_mm_loadu_si128((__m128i *) g));
+}
+#else
+/*
+ * Bit i set if tag i of a group is c.
+ */
+static inline unsigned group_match(unsigned char *g, unsigned char c) {
+    unsigned m = 0;
+    int i;
+    
+    for (i = 0; i < CACHE_GROUP; i++) {
+        m |= (unsigned) (__atomic_load_n(&g[i], __ATOMIC_RELAXED) == c) << i;
+    }
+    return m;
+}
+
+/*
+ * Bit i set if slot i of a group is free (empty or dead).
+ */
+static inline unsigned group_free(unsigned char *g) {
+    unsigned m = 0;
+    int i;
+    
+    for (i = 0; i < CACHE_GROUP; i++) {
+        m |= (unsigned) (__atomic_load_n(&g[i], __ATOMIC_RELAXED) >> 7) << i;
+    }
+    return m;
+}
+#endif
+
+/*
+ * Find the shard of a key hash.
+ */
+static inline c_shard_t *find_shard(cache_t *csh, unsigned long h) {
+    return &csh->shards[h % csh->nshards];
+}
+
+/*
+ * The lock stripe guarding the body table row of hash h.
+ * Rows are a multiple of the stripes, so the stripe of
+ * a body doesn't change when the table grows.
+ */
+static inline sem_t *body_lock(cache_t *csh, unsigned long h) {
+    return &csh->bodylocks[h % BODY_LOCKS];
+}
+
+/*
+ * Find a body with the given content.
+ * Must be called with its lock stripe held.
+ */
+static c_body_t *find_body(cache_t *csh, unsigned long h, 
+                           void *data, size_t size) {
+    c_body_t *cur = csh->bodies[h % csh->bodyrows];
+    while (cur) {
+        if (cur->hash == h && cur->size == size && 
+            !memcmp(cur->data, data, size)) {
+            return cur;
+        }
+        cur = cur->next;
+    }
+    return NULL;
+}
+
+/*
+ * Add an entry to the holders of its body.
+ * Must be called with the lock stripe of the body held.
+ */
+static void hold_body(c_node_t *e) {
+    c_body_t *b = e->body;
+    
+    e->share_prev = NULL;
+    e->share_next = b->holders;
+    if (b->holders) {
+        b->holders->share_prev = e;
+    }
+    b->holders = e;
+}
+
+/*
+ * The shard the body of an entry taken out of shard i is to
+ * be charged to: still i if another entry of it holds the
+ * body, else the shard of any other holder.
+ * Must be called with the lock stripe of the body held.
+ */
+static int charge_shard(cache_t *csh, c_body_t *b, int i) {
+    c_node_t *h;
+    
+    for (h = b->holders; h; h = h->share_next) {
+        if (find_shard(csh, h->hash) == &csh->shards[i]) {
+            return i;
+        }
+    }
+    return find_shard(csh, b->holders->hash) - csh->shards;
+}
+
+/*
+ * Drop the cached reference of entry e to its body, taking
+ * the body out of the body table and the shard size with
+ * the last one. It is freed along with the last node
+ * pointing at it.
+ */
+static void unref_body(cache_t *csh, c_node_t *e) {
+    c_body_t *b = e->body;
+    sem_t *lock = body_lock(csh, b->hash);
+    c_shard_t *from;
+    c_shard_t *to;
+    c_body_t **link;
+    
+    sem_p(lock);
+    /* the charge moves under the stripe */
+    from = to = &csh->shards[b->shard];
+    
+    /* no longer a holder */
+    if (e->share_prev) {
+        e->share_prev->share_next = e->share_next;
+    }
+    else {
+        b->holders = e->share_next;
+    }
+    if (e->share_next) {
+        e->share_next->share_prev = e->share_prev;
+    }
+    
+    if (--b->refcnt == 0) {
+        /* remove from the body table */
+        link = &csh->bodies[b->hash % csh->bodyrows];
+        while (*link != b) {
+            link = &(*link)->next;
+        }
+        *link = b->next;
+        to = NULL;
+    }
+    else if (find_shard(csh, e->hash) == from) {
+        /* the charged shard may hold it no more */
+        b->shard = charge_shard(csh, b, b->shard);
+        to = &csh->shards[b->shard];
+    }
+    sem_v(lock);
+    
+    if (to != from) {
+        SIZE_SUB(from, b->size);
+    }
+    if (to && to != from) {
+        SIZE_ADD(to, b->size);
+    }
+}
+
+/*
+ * Bytes of an entry, with its body even if shared.
+ */
+static inline size_t node_bytes(c_node_t *e) {
+    return e->size + (e->body ? e->body->size : 0);
+}
+
+/*
+ * Insert a node at the first position of queue i of a shard.
+ */
+static inline void insert_lru(c_shard_t *sh, int i, c_node_t *new) {
+    c_queue_t *q = &sh->queues[i];
+    q->head->lru_next->lru_prev = new;
+    new->lru_next = q->head->lru_next;
+    q->head->lru_next = new;
+    new->lru_prev = q->head;
+    new->queue = i;
+    q->size += node_bytes(new);
+}
+
+/*
+ * Remove a node from its queue.
+ */
+static inline void remove_lru(c_shard_t *sh, c_node_t *r) {
+    r->lru_prev->lru_next = r->lru_next;
+    r->lru_next->lru_prev = r->lru_prev;
+    sh->queues[r->queue].size -= node_bytes(r);
+}
+
+/*
+ * Move a node to the first position of queue i.
+ */
+static inline void move_lru(c_shard_t *sh, int i, c_node_t *e) {
+    remove_lru(sh, e);
+    insert_lru(sh, i, e);
+}
+
+/*
+ * The node at the last position of queue i, NULL if empty.
+ */
+static inline c_node_t *lru_last(c_shard_t *sh, int i) {
+    c_queue_t *q = &sh->queues[i];
+    return q->tail->lru_prev != q->head ? q->tail->lru_prev : NULL;
+}
+
+/*
+ * Remember the key hash of an evicted entry.
+ */
+static void ghost_add(c_ghost_t *g, unsigned long h) {
+    unsigned long *slot = &g->hashes[(h >> 32) & (g->nslots - 1)];
+    if (!*slot) {
+        g->count++;
+    }
+    *slot = h;
+}
+
+/*
+ * Forget a key hash. Return 1 if it was remembered.
+ */
+static int ghost_take(c_ghost_t *g, unsigned long h) {
+    unsigned long *slot = &g->hashes[(h >> 32) & (g->nslots - 1)];
+    if (*slot != h) {
+        return 0;
+    }
+    *slot = 0;
+    g->count--;
+    return 1;
+}
+
+/*
+ * Put a node at position i of the heap of a shard.
+ */
+static inline void heap_set(c_shard_t *sh, int i, c_node_t *e) {
+    sh->heap[i] = e;
+    e->heap = i;
+}
+
+/*
+ * Move the node at position i of the heap up to its place.
+ */
+static void heap_up(c_shard_t *sh, int i) {
+    c_node_t *e = sh->heap[i];
+    int parent;
+    
+    while (i > 0 && sh->heap[parent = (i - 1) / 2]->prio > e->prio) {
+        heap_set(sh, i, sh->heap[parent]);
+        i = parent;
+    }
+    heap_set(sh, i, e);
+}
+
+/*
+ * Move the node at position i of the heap down to its place.
+ */
+static void heap_down(c_shard_t *sh, int i) {
+    c_node_t *e = sh->heap[i];
+    int child;
+    
+    while ((child = 2 * i + 1) < sh->heaplen) {
+        if (child + 1 < sh->heaplen && 
+            sh->heap[child + 1]->prio < sh->heap[child]->prio) {
+            child++;
+        }
+        if (sh->heap[child]->prio >= e->prio) {
+            break;
+        }
+        heap_set(sh, i, sh->heap[child]);
+        i = child;
+    }
+    heap_set(sh, i, e);
+}
+
+/*
+ * Make room for one more node in the heap of a shard,
+ * doubling it if full. Return 0 if out of memory.
+ */
+static int heap_room(c_shard_t *sh) {
+    int cap = sh->heapcap ? sh->heapcap * 2 : HEAP_MIN;
+    c_node_t **heap;
+    
+    if (sh->heaplen < sh->heapcap) {
+        return 1;
+    }
+    if ((heap = realloc(sh->heap, cap * sizeof(c_node_t *))) == NULL) {
+        perror("Grow heap - malloc");
+        return 0;
+    }
+    sh->heap = heap;
+    sh->heapcap = cap;
+    return 1;
+}
+
+/*
+ * Add a node to the heap of a shard, which has room for it.
+ */
+static void heap_push(c_shard_t *sh, c_node_t *e) {
+    heap_set(sh, sh->heaplen++, e);
+    heap_up(sh, e->heap);
+}
+
+/*
+ * Take a node out of the heap of a shard.
+ */
+static void heap_remove(c_shard_t *sh, c_node_t *e) {
+    c_node_t *last = sh->heap[--sh->heaplen];
+    int i = e->heap;
+    
+    if (last == e) {
+        return;
+    }
+    /* the last node fills the hole, either way from there */
+    heap_set(sh, i, last);
+    heap_up(sh, i);
+    heap_down(sh, last->heap);
+}
+
+/*
+ * Direction to take at an inner node of the key index.
+ */
+static inline int crit_dir(c_crit_t *q, char *key, size_t len) {
+    unsigned char c = q->byte < len ? (unsigned char) key[q->byte] : 0;
+    return (1 + (q->otherbits | c)) >> 8;
+}
+
+/*
+ * Find the node whose key shares the longest prefix
+ * with key among the indexed ones. The index must not
+ * be empty.
+ */
+static c_node_t *index_best(c_shard_t *sh, char *key, size_t len) {
+    void *p = sh->index;
+    while (IS_CRIT(p)) {
+        p = TO_CRIT(p)->child[crit_dir(TO_CRIT(p), key, len)];
+    }
+    return (c_node_t *) p;
+}
+
+/*
+ * Add a node to the key index, using crit as the new
+ * inner node. Its key must not be indexed yet.
+ * Return 1 if crit was used.
+ */
+static int index_insert(c_shard_t *sh, c_node_t *new, c_crit_t *crit) {
+    char *key = new->key;
+    size_t len = strlen(key);
+    unsigned char *best;
+    unsigned otherbits = 0;
+    size_t byte;
+    int dir;
+    void **wherep = &sh->index;
+    c_crit_t *q;
+    
+    if (!sh->index) {
+        sh->index = new;
+        return 0;
+    }
+    
+    /* where the key leaves the tree */
+    best = (unsigned char *) index_best(sh, key, len)->key;
+    for (byte = 0; byte < len; byte++) {
+        if ((otherbits = best[byte] ^ (unsigned char) key[byte])) {
+            break;
+        }
+    }
+    if (byte == len) {
+        otherbits = best[byte];
+    }
+    /* keep the highest differing bit only */
+    otherbits |= otherbits >> 1;
+    otherbits |= otherbits >> 2;
+    otherbits |= otherbits >> 4;
+    otherbits = (otherbits & ~(otherbits >> 1)) ^ 255;
+    dir = (1 + (otherbits | best[byte])) >> 8;
+    
+    crit->byte = byte;
+    crit->otherbits = otherbits;
+    crit->child[1 - dir] = new;
+    
+    /* hang it above the first node deciding at a later bit */
+    while (IS_CRIT(*wherep)) {
+        q = TO_CRIT(*wherep);
+        if (q->byte > byte || (q->byte == byte && q->otherbits > otherbits)) {
+            break;
+        }
+        wherep = &q->child[crit_dir(q, key, len)];
+    }
+    crit->child[dir] = *wherep;
+    *wherep = (char *) crit + 1;
+    return 1;
+}
+
+/*
+ * Take a node out of the key index.
+ */
+static void index_remove(c_shard_t *sh, c_node_t *node) {
+    size_t len = strlen(node->key);
+    void **wherep = &sh->index;
+    void **whereq = NULL;
+    c_crit_t *q = NULL;
+    int dir = 0;
+    
+    while (IS_CRIT(*wherep)) {
+        whereq = wherep;
+        q = TO_CRIT(*wherep);
+        dir = crit_dir(q, node->key, len);
+        wherep = &q->child[dir];
+    }
+    if (*wherep != node) {
+        return;
+    }
+    if (!whereq) {
+        sh->index = NULL;
+        return;
+    }
+    /* the sibling takes the place of the parent */
+    *whereq = q->child[1 - dir];
+    free(q);
+}
+
+/*
+ * Free the inner nodes of a key index subtree.
+ */
+static void free_index(void *p) {
+    if (IS_CRIT(p)) {
+        free_index(TO_CRIT(p)->child[0]);
+        free_index(TO_CRIT(p)->child[1]);
+        free(TO_CRIT(p));
+    }
+}
+
+/*
+ * Allocate an empty hash table of nslots slots, a power of
+ * two, in one block. The tags come last, aligned so that
+ * a group is loaded at once.
+ */
+static c_table_t *new_table(int nslots) {
+    c_table_t *t = (c_table_t *) malloc(sizeof(c_table_t) + 
+                                        (size_t) nslots * 
+                                        (sizeof(c_slot_t) + 1));
+    if (t) {
+        t->nslots = nslots;
+        t->used = 0;
+        t->dead = 0;
+        t->slots = (c_slot_t *) (t + 1);
+        t->ctrl = (unsigned char *) (t->slots + nslots);
+        memset(t->ctrl, CTRL_EMPTY, (size_t) nslots);
+    }
+    return t;
+}
+
+/*
+ * Find the slot of key in a table, or of the node *e if not
+ * NULL, setting *e to the node found. The tags rule out most
+ * slots a group at a time and the hash in the slot nearly
+ * all the rest, so few nodes are looked at.
+ * Return the slot, -1 if not there.
+ * Must be called in a read section or with the shard lock held.
+ */
+static int probe(c_table_t *t, char *key, unsigned long h, c_node_t **e) {
+    int mask = t->nslots / CACHE_GROUP - 1;
+    int g = first_group(t, h);
+    unsigned char tag = hash_tag(h);
+    unsigned char *ctrl;
+    c_node_t *cur;
+    unsigned m;
+    int step, i;
+    
+    /* growing steps visit every group once */
+    for (step = 1; step <= mask + 1; step++) {
+        ctrl = t->ctrl + g * CACHE_GROUP;
+        m = group_match(ctrl, tag);
+        /* slots are filled in before their tag is set */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        for (; m; m &= m - 1) {
+            i = g * CACHE_GROUP + __builtin_ctz(m);
+            if (__atomic_load_n(&t->slots[i].hash, __ATOMIC_RELAXED) != h) {
+                continue;
+            }
+            cur = LOAD_PTR(t->slots[i].node);
+            /* the slot may be taken again meanwhile, 
+             * so the node is checked, not the slot */
+            if (*e ? cur == *e : 
+                cur && cur->hash == h && !strcmp(cur->key, key)) {
+                *e = cur;
+                return i;
+            }
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) {
+            return -1;
+        }
+        g = (g + step) & mask;
+    }
+    return -1;
+}
+
+/*
+ * Put a node into the first free slot along its probe,
+ * publishing the tag once the slot is filled in.
+ * The table must have a free slot.
+ * Must be called with the shard lock held.
+ */
+static void table_insert(c_table_t *t, unsigned long h, c_node_t *e) {
+    int mask = t->nslots / CACHE_GROUP - 1;
+    int g = first_group(t, h);
+    unsigned m;
+    int step, i;
+    
+    for (step = 1; !(m = group_free(t->ctrl + g * CACHE_GROUP)); step++) {
+        g = (g + step) & mask;
+    }
+    i = g * CACHE_GROUP + __builtin_ctz(m);
+    if (t->ctrl[i] == CTRL_DEAD) {
+        t->dead--;
+    }
+    __atomic_store_n(&t->slots[i].hash, h, __ATOMIC_RELAXED);
+    STORE_PTR(t->slots[i].node, e);
+    __atomic_store_n(&t->ctrl[i], hash_tag(h), __ATOMIC_RELEASE);
+    t->used++;
+}
+
+/*
+ * Free slot i of a table. Probes reaching a group with an
+ * empty slot end there anyway, so the slot is emptied if
+ * its group has one, else marked dead for probes to go on.
+ * Must be called with the shard lock held.
+ */
+static void table_remove(c_table_t *t, int i) {
+    unsigned char *g = t->ctrl + i / CACHE_GROUP * CACHE_GROUP;
+    
+    if (group_match(g, CTRL_EMPTY)) {
+        __atomic_store_n(&t->ctrl[i], CTRL_EMPTY, __ATOMIC_RELEASE);
+    }
+    else {
+        __atomic_store_n(&t->ctrl[i], CTRL_DEAD, __ATOMIC_RELEASE);
+        t->dead++;
+    }
+    t->used--;
+}
+
+/*
+ * Free a node once no reader can see it and no handle
+ * pins it, with its body if no other node points at it.
+ */
+static void free_node(void *arg) {
+    c_node_t *e = (c_node_t *) arg;
+    if (e->retbytes) {
+        __atomic_sub_fetch(e->retired, e->retbytes, __ATOMIC_RELAXED);
+    }
+    if (e->body && __atomic_sub_fetch(&e->body->nodes, 1, 
+                                      __ATOMIC_ACQ_REL) == 0) {
+        free(e->body->data);
+        free(e->body);
+    }
+    free(e->key);
+    free(e->val);
+    free(e);
+}
+
+/*
+ * Pin a node found in a read section, unless it is being
+ * freed already. Return 0 on success, -1 otherwise.
+ */
+static int pin_node(c_node_t *e) {
+    int pins = __atomic_load_n(&e->pins, __ATOMIC_RELAXED);
+    do {
+        if (pins == 0) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&e->pins, &pins, pins + 1, 1, 
+                                          __ATOMIC_ACQUIRE, 
+                                          __ATOMIC_RELAXED));
+    return 0;
+}
+
+/*
+ * Drop a pin of a node, freeing it with the last one: at
+ * once if readers only find nodes under the shard lock, 
+ * else once the readers inside have left.
+ */
+static void unpin_node(c_node_t *e) {
+    size_t bytes;
+    
+    if (__atomic_sub_fetch(&e->pins, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    if (!e->deferred) {
+        free_node(e);
+        return;
+    }
+    /* the body too, unless others point at it */
+    bytes = e->size;
+    if (e->body && __atomic_load_n(&e->body->nodes, __ATOMIC_RELAXED) == 1) {
+        bytes += e->body->size;
+    }
+    e->retbytes = bytes;
+    __atomic_add_fetch(e->retired, bytes, __ATOMIC_RELAXED);
+    epoch_retire(free_node, e, bytes);
+}
+
+/*
+ * Take a node out of its shard and drop the pin of the
+ * cache, it is freed once no handle pins it either.
+ * Readers on it may still find it until it is freed.
+ * Must be called with the shard lock held.
+ */
+static void remove_node(cache_t *csh, c_shard_t *sh, c_node_t *e) {
+    c_node_t *found = e;
+    int slot;
+    
+    /* remove from its queue */
+    remove_lru(sh, e);
+    if (csh->policy == CACHE_GDSF) {
+        heap_remove(sh, e);
+    }
+    
+    /* remove from the hash table it is in */
+    if ((slot = probe(sh->table, e->key, e->hash, &found)) >= 0) {
+        table_remove(sh->table, slot);
+    }
+    else if (sh->old && 
+             (slot = probe(sh->old, e->key, e->hash, &found)) >= 0) {
+        table_remove(sh->old, slot);
+    }
+    
+    index_remove(sh, e);
+    
+    /* clean up */
+    SIZE_SUB(sh, e->size);
+    if (e->body) {
+        unref_body(csh, e);
+    }
+    unpin_node(e);
+}
+
+/*
+ * The queues of a shard are all empty.
+ */
+static inline int lru_empty(c_shard_t *sh) {
+    int i;
+    
+    for (i = 0; i < CACHE_QUEUES; i++) {
+        if (lru_last(sh, i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * The hits of a node, read without locks.
+ */
+static inline unsigned char hits_of(c_node_t *e) {
+    return __atomic_load_n(&e->ref, __ATOMIC_RELAXED);
+}
+
+/*
+ * Set the hits of a node, racing readers that mark it.
+ */
+static inline void set_hits(c_node_t *e, unsigned char n) {
+    __atomic_store_n(&e->ref, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Move nodes over the protected share of a shard
+ * back to probation.
+ */
+static void demote(c_shard_t *sh) {
+    size_t hot = CAP_OF(sh) / 100 * SLRU_HOT;
+    
+    while (sh->queues[Q_HOT].size > hot) {
+        move_lru(sh, Q_NEW, lru_last(sh, Q_HOT));
+    }
+}
+
+/*
+ * GDSF priority of a node: the inflation (the priority of
+ * the last victim), plus its gets times the cost of missing
+ * it over its size. Aiming at hits the cost is 1, so of two
+ * entries asked for as often the smaller one stays; aiming
+ * at byte hits the cost is the size, which leaves the gets.
+ * Entries not asked for lately fall behind the inflation.
+ */
+static inline double gdsf_prio(cache_t *csh, c_shard_t *sh, c_node_t *e) {
+    if (csh->bytes) {
+        return sh->inflation + e->freq;
+    }
+    return sh->inflation + (double) e->freq / node_bytes(e);
+}
+
+/*
+ * Account a hit on a node as the policy of the cache says.
+ * CLOCK and S3-FIFO only mark it and may be called in a
+ * read section, the others move it and must be called
+ * with the shard locked exclusively.
+ */
+static void hit_node(cache_t *csh, c_shard_t *sh, c_node_t *e) {
+    unsigned char hits = hits_of(e);
+    
+    switch (csh->policy) {
+    case CACHE_CLOCK:
+        /* readers race here, any of them may mark it; 
+         * skip the store if marked to keep the line clean */
+        if (!hits) {
+            set_hits(e, 1);
+        }
+        break;
+    case CACHE_S3FIFO:
+        if (hits < S3_MAXFREQ) {
+            set_hits(e, hits + 1);
+        }
+        break;
+    case CACHE_SLRU:
+    case CACHE_WTINYLFU:
+        /* hit again on probation: protect it */
+        move_lru(sh, e->queue == Q_WINDOW ? Q_WINDOW : Q_HOT, e);
+        demote(sh);
+        break;
+    case CACHE_ARC:
+        move_lru(sh, Q_HOT, e);
+        break;
+    case CACHE_GDSF:
+        /* only goes up, the inflation never goes down */
+        e->freq++;
+        e->prio = gdsf_prio(csh, sh, e);
+        heap_down(sh, e->heap);
+        break;
+    default:
+        move_lru(sh, Q_NEW, e);
+    }
+}
+
+/*
+ * Move the last nodes of the window over its share to 
+ * probation, all but the new node e. Room was made for them
+ * already; e competes for its place when next evicting.
+ */
+static void spill(c_shard_t *sh, c_node_t *e) {
+    size_t window = CAP_OF(sh) / 100 * WINDOW_SHARE;
+    c_node_t *last;
+    
+    while (sh->queues[Q_WINDOW].size > window && 
+           (last = lru_last(sh, Q_WINDOW)) != e) {
+        move_lru(sh, Q_NEW, last);
+    }
+}
+
+/*
+ * Queue a new node as the policy of the cache says. Keys
+ * evicted lately go to the queue of those seen again under
+ * ARC and S3-FIFO, and ARC gives more room to the queue it
+ * was evicted from.
+ * Must be called with the shard locked exclusively.
+ */
+static void queue_node(cache_t *csh, c_shard_t *sh, c_node_t *e) {
+    size_t b1 = sh->ghosts[0].count;
+    size_t b2 = sh->ghosts[1].count;
+    size_t n = node_bytes(e);
+    
+    switch (csh->policy) {
+    case CACHE_ARC:
+        if (ghost_take(&sh->ghosts[0], e->hash)) {
+            n = b2 > b1 ? n * b2 / b1 : n;
+            sh->target = sh->target + n < CAP_OF(sh) ? 
+                         sh->target + n : CAP_OF(sh);
+            insert_lru(sh, Q_HOT, e);
+        }
+        else if (ghost_take(&sh->ghosts[1], e->hash)) {
+            n = b1 > b2 ? n * b1 / b2 : n;
+            sh->target = sh->target > n ? sh->target - n : 0;
+            insert_lru(sh, Q_HOT, e);
+        }
+        else {
+            insert_lru(sh, Q_NEW, e);
+        }
+        break;
+    case CACHE_S3FIFO:
+        insert_lru(sh, ghost_take(&sh->ghosts[0], e->hash) ? Q_HOT : Q_NEW, 
+                   e);
+        break;
+    case CACHE_WTINYLFU:
+        insert_lru(sh, Q_WINDOW, e);
+        spill(sh, e);
+        break;
+    case CACHE_GDSF:
+        /* the queue only keeps it for walks */
+        e->freq = 1;
+        e->prio = gdsf_prio(csh, sh, e);
+        insert_lru(sh, Q_NEW, e);
+        heap_push(sh, e);
+        break;
+    default:
+        insert_lru(sh, Q_NEW, e);
+    }
+}
+
+/*
+ * LRU and SLRU victim: the last node on probation,
+ * else the last protected one.
+ */
+static c_node_t *lru_victim(c_shard_t *sh) {
+    c_node_t *e = lru_last(sh, Q_NEW);
+    return e ? e : lru_last(sh, Q_HOT);
+}
+
+/*
+ * CLOCK victim: the last node not hit since it was last
+ * looked at, giving those hit a second chance at the head.
+ */
+static c_node_t *clock_victim(c_shard_t *sh) {
+    c_node_t *e = lru_last(sh, Q_NEW);
+    
+    /* ends once all marks are cleared at the latest */
+    while (hits_of(e)) {
+        set_hits(e, 0);
+        move_lru(sh, Q_NEW, e);
+        e = lru_last(sh, Q_NEW);
+    }
+    return e;
+}
+
+/*
+ * ARC victim: the last node seen once if that queue is
+ * over its target, else the last node seen again. Its key
+ * is remembered in the ghost of its queue.
+ */
+static c_node_t *arc_victim(c_shard_t *sh) {
+    c_node_t *e = lru_last(sh, Q_NEW);
+    
+    if (e && (sh->queues[Q_NEW].size > sh->target || !lru_last(sh, Q_HOT))) {
+        ghost_add(&sh->ghosts[0], e->hash);
+        return e;
+    }
+    e = lru_last(sh, Q_HOT);
+    ghost_add(&sh->ghosts[1], e->hash);
+    return e;
+}
+
+/*
+ * S3-FIFO victim: from the small queue while over its share,
+ * moving nodes hit there to the main queue and remembering
+ * the keys of the others, else from the main queue, giving
+ * nodes hit there another round per hit.
+ */
+static c_node_t *s3fifo_victim(c_shard_t *sh) {
+    size_t small = CAP_OF(sh) / 100 * S3_SMALL;
+    c_node_t *e;
+    
+    while (1) {
+        e = lru_last(sh, Q_NEW);
+        if (e && (sh->queues[Q_NEW].size > small || !lru_last(sh, Q_HOT))) {
+            if (!hits_of(e)) {
+                ghost_add(&sh->ghosts[0], e->hash);
+                return e;
+            }
+            set_hits(e, 0);
+            move_lru(sh, Q_HOT, e);
+        }
+        else {
+            e = lru_last(sh, Q_HOT);
+            if (!hits_of(e)) {
+                return e;
+            }
+            set_hits(e, hits_of(e) - 1);
+            move_lru(sh, Q_HOT, e);
+        }
+    }
+}
+
+/*
+ * W-TinyLFU victim: while the window is over its share, its
+ * last node competes with the SLRU victim, the one less
+ * often asked for by the sketch losing; else the SLRU victim.
+ * Before SLRU has a victim the window spills into it.
+ */
+static c_node_t *wtinylfu_victim(c_shard_t *sh) {
+    size_t window = CAP_OF(sh) / 100 * WINDOW_SHARE;
+    c_node_t *cand;
+    c_node_t *e;
+    
+    while ((cand = lru_last(sh, Q_WINDOW)) && 
+           sh->queues[Q_WINDOW].size > window) {
+        e = lru_victim(sh);
+        if (e && sketch_estimate(&sh->sketch, cand->hash) <= 
+                 sketch_estimate(&sh->sketch, e->hash)) {
+            return cand;
+        }
+        /* admitted, on probation */
+        move_lru(sh, Q_NEW, cand);
+        if (e) {
+            return e;
+        }
+    }
+    e = lru_victim(sh);
+    return e ? e : lru_last(sh, Q_WINDOW);
+}
+
+/*
+ * GDSF victim: the node of the lowest priority, which
+ * becomes the inflation.
+ */
+static c_node_t *gdsf_victim(c_shard_t *sh) {
+    c_node_t *e = sh->heap[0];
+    sh->inflation = e->prio;
+    return e;
+}
+
+/*
+ * Evict a node of a shard as the policy of the cache says.
+ * The shard must not be empty.
+ * Must be called with the shard locked exclusively.
+ */
+static void evict(cache_t *csh, c_shard_t *sh) {
+    c_node_t *e;
+    
+    switch (csh->policy) {
+    case CACHE_CLOCK:
+        e = clock_victim(sh);
+        break;
+    case CACHE_ARC:
+        e = arc_victim(sh);
+        break;
+    case CACHE_S3FIFO:
+        e = s3fifo_victim(sh);
+        break;
+    case CACHE_WTINYLFU:
+        e = wtinylfu_victim(sh);
+        break;
+    case CACHE_GDSF:
+        e = gdsf_victim(sh);
+        break;
+    default:
+        e = lru_victim(sh);
+    }
+    remove_node(csh, sh, e);
+}
+
+/*
+ * Gets of the cache are counted in the shard sketches.
+ */
+static inline int counts_gets(cache_t *csh) {
+    return csh->admit || csh->policy == CACHE_WTINYLFU;
+}
+
+/*
+ * Hits of the cache only mark entries, so gets take no lock.
+ */
+static inline int marks_hits(cache_t *csh) {
+    return csh->policy == CACHE_CLOCK || csh->policy == CACHE_S3FIFO;
+}
+
+/*
+ * Bytes counted against the capacity of a shard: those of
+ * its entries, and if gets take no lock, those of its
+ * entries gone but not freed yet. When over, those the
+ * readers are done with are freed first, without waiting
+ * for the others: see put for that.
+ */
+static inline size_t shard_held(cache_t *csh, c_shard_t *sh) {
+    if (!marks_hits(csh)) {
+        return SIZE_OF(sh);
+    }
+    if (RETIRED_OF(sh) && SIZE_OF(sh) + RETIRED_OF(sh) > CAP_OF(sh)) {
+        epoch_collect();
+    }
+    return SIZE_OF(sh) + RETIRED_OF(sh);
+}
+
+/*
+ * Whether to admit a new entry of size bytes with key hash
+ * h into a full shard: it must be asked for more often than
+ * every entry evicting would take out to make room, as the
+ * sketch says, so a large entry asked for once doesn't
+ * push out many small popular ones. The victims are looked
+ * at from the tails of the queues, second chances aside,
+ * or down the heap under GDSF.
+ * Must be called with the shard locked exclusively.
+ */
+static int admit(cache_t *csh, c_shard_t *sh, unsigned long h, size_t size) {
+    static const int order[CACHE_QUEUES] = {Q_NEW, Q_HOT, Q_WINDOW};
+    size_t need = shard_held(csh, sh) + size;
+    size_t freed = 0;
+    int freq;
+    c_node_t *e;
+    int i;
+    
+    if (need <= CAP_OF(sh)) {
+        return 1;
+    }
+    need -= CAP_OF(sh);
+    freq = sketch_estimate(&sh->sketch, h);
+    if (csh->policy == CACHE_GDSF) {
+        /* level by level, about in priority order */
+        for (i = 0; i < sh->heaplen && freed < need; i++) {
+            if (sketch_estimate(&sh->sketch, sh->heap[i]->hash) >= freq) {
+                return 0;
+            }
+            freed += node_bytes(sh->heap[i]);
+        }
+        return 1;
+    }
+    for (i = 0; i < CACHE_QUEUES && freed < need; i++) {
+        for (e = sh->queues[order[i]].tail->lru_prev; 
+             e != sh->queues[order[i]].head && freed < need; 
+             e = e->lru_prev) {
+            if (sketch_estimate(&sh->sketch, e->hash) >= freq) {
+                return 0;
+            }
+            freed += node_bytes(e);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Move a group of the old table of a shard into the new one.
+ * Readers on the group may miss entries meanwhile.
+ * Must be called with the shard lock held.
+ */
+static void migrate_group(c_shard_t *sh, int g) {
+    c_table_t *old = sh->old;
+    unsigned m = ~group_free(old->ctrl + g * CACHE_GROUP) & 
+                 ((1u << CACHE_GROUP) - 1);
+    int i;
+    
+    for (; m; m &= m - 1) {
+        i = g * CACHE_GROUP + __builtin_ctz(m);
+        table_insert(sh->table, old->slots[i].hash, old->slots[i].node);
+        __atomic_store_n(&old->ctrl[i], CTRL_DEAD, __ATOMIC_RELEASE);
+        old->used--;
+    }
+}
+
+/*
+ * Migrate up to groups groups of the old table of a shard,
+ * dropping the old table once empty.
+ * Must be called with the shard lock held.
+ */
+static void migrate(c_shard_t *sh, int groups) {
+    c_table_t *old = sh->old;
+    
+    if (!old) {
+        return;
+    }
+    while (groups-- > 0 && sh->migrated < old->nslots / CACHE_GROUP) {
+        migrate_group(sh, sh->migrated++);
+    }
+    if (sh->migrated == old->nslots / CACHE_GROUP) {
+        STORE_PTR(sh->old, NULL);
+        epoch_retire(free, old, (size_t) old->nslots * 
+                     (sizeof(c_slot_t) + 1));
+    }
+}
 
-#define HASH_PRIME 31   /* for hashing */
+/*
+ * Start moving the hash table of a shard to a new one once
+ * MAX_LOAD eighths of its slots are taken, live or dead: 
+ * twice as large if half of them are live, else as large,
+ * to get rid of the dead ones. A move still going on is
+ * finished first. A failed allocation only leaves longer
+ * probes until the next put.
+ * Must be called with the shard lock held.
+ */
+static void grow(c_shard_t *sh) {
+    c_table_t *t = sh->table;
+    c_table_t *table;
+    
+    if (t->used + t->dead < t->nslots / 8 * MAX_LOAD) {
+        return;
+    }
+    if (sh->old) {
+        migrate(sh, sh->old->nslots / CACHE_GROUP);
+    }
+    table = new_table(t->used < t->nslots / 2 ? t->nslots : t->nslots * 2);
+    if (!table) {
+        perror("Grow cache - malloc");
+        return;
+    }
+    sh->migrated = 0;
+    /* readers load the table first, then the old one */
+    STORE_PTR(sh->old, t);
+    STORE_PTR(sh->table, table);
+}
 
 /*
- * P operation
+ * Find the node of key in a table, without locks.
+ * Must be called in a read section or with the shard lock held.
  */
-static inline int P(sem_t *sem) {
-    return sem_wait(sem);
+static c_node_t *lookup(c_table_t *t, char *key, unsigned long h) {
+    c_node_t *e = NULL;
+    probe(t, key, h, &e);
+    return e;
 }
 
 /*
- * V operation
+ * Find the node of key in a shard, without locks.
+ * Must be called in a read section or with the shard lock held.
  */
-static inline int V(sem_t *sem) {
-    return sem_post(sem);
+static c_node_t *find_node(c_shard_t *sh, char *key, unsigned long h) {
+    c_node_t *e = lookup(LOAD_PTR(sh->table), key, h);
+    c_table_t *old;
+    
+    /* not migrated yet */
+    if (!e && (old = LOAD_PTR(sh->old))) {
+        e = lookup(old, key, h);
+    }
+    return e;
 }
 
 /*
- * Compute hashcode.
+ * Move all bodies into a table of rows rows, a multiple
+ * of the lock stripes. Takes all the stripes.
  */
-static inline int hash(char *s) {
-    int len = strlen(s);
-    int p = HASH_PRIME;
-    int res = 0;
+static int rehash_bodies(cache_t *csh, int rows) {
+    c_body_t **bodies = (c_body_t **) calloc((size_t)rows, sizeof(c_body_t *));
+    c_body_t *b, *bnext;
     int i;
-    for (i = 0; i < len; i++) {
-        res += p * s[i];
-        p *= p;
+    
+    if (!bodies) {
+        perror("Rehash bodies - malloc");
+        return -1;
+    }
+    
+    for (i = 0; i < BODY_LOCKS; i++) {
+        sem_p(&csh->bodylocks[i]);
+    }
+    for (i = 0; i < csh->bodyrows; i++) {
+        for (b = csh->bodies[i]; b; b = bnext) {
+            bnext = b->next;
+            b->next = bodies[b->hash % rows];
+            bodies[b->hash % rows] = b;
+        }
     }
-    /* can be negtive when overflowing */
-    if (res < 0) {
-        res *= -1;
+    free(csh->bodies);
+    csh->bodies = bodies;
+    csh->bodyrows = rows;
+    for (i = BODY_LOCKS - 1; i >= 0; i--) {
+        sem_v(&csh->bodylocks[i]);
     }
-    return res;
+    return 0;
 }
 
 /*
- * Find the hash table slot give the key and the 
- * hash table row number.
+ * Hash table rows for a capacity.
  */
-static inline int find_slot(char *key, int rowlen) {
-    /* hashcode of the key */
-    int hashcode = hash(key);
-    /* the slot to put the cache */
-    return hashcode % rowlen;
+static inline int cap_rows(size_t cap) {
+    int rows = (cap + 1023) / 1024;
+    return rows > 0 ? rows : 1;
 }
 
 /*
- * Insert a node at the first position of the lru list.
+ * Hash table slots for a capacity, a power of two
+ * and at least a group.
  */
-static inline void insert_lru(cache_t *csh, c_node_t *new) {
-    csh->lru_h->lru_next->lru_prev = new;
-    new->lru_next = csh->lru_h->lru_next;
-    csh->lru_h->lru_next = new;
-    new->lru_prev = csh->lru_h;
+static inline int cap_slots(size_t cap) {
+    int slots = CACHE_GROUP;
+    while (slots < cap_rows(cap)) {
+        slots *= 2;
+    }
+    return slots;
 }
 
 /*
- * Remove a node from the lru list.
+ * Body table rows for a capacity, a multiple of the stripes.
  */
-static inline void remove_lru(c_node_t *r) {
-    r->lru_prev->lru_next = r->lru_next;
-    r->lru_next->lru_prev = r->lru_prev;
+static inline int body_rows(size_t cap) {
+    return (cap_rows(cap) + BODY_LOCKS - 1) / BODY_LOCKS * BODY_LOCKS;
 }
 
 /*
- * Evict a node from the last position of the lru list.
+ * Allocate the ghost of a shard with a capacity slice of cap.
  */
-static inline void evict(cache_t *csh) {
-    c_node_t *e = csh->lru_t->lru_prev;
-    int slot;
+static int init_ghost(c_ghost_t *g, size_t cap) {
+    g->nslots = cap_slots(cap);
+    g->count = 0;
+    g->hashes = (unsigned long *) calloc((size_t) g->nslots, 
+                                         sizeof(unsigned long));
+    return g->hashes ? 0 : -1;
+}
+
+/*
+ * Init a shard of a cache with a capacity slice of cap.
+ * Ghosts and sketch are sized for this capacity.
+ */
+static int init_shard(cache_t *csh, c_shard_t *sh, size_t cap) {
+    int policy = csh->policy;
+    int failed = 0;
+    int i;
     
-    /* remove from lru list */
-    remove_lru(e);
+    sh->cap = cap;
+    sh->size = 0;
+    sh->retired = 0;
+    for (i = 0; i < CACHE_QUEUES; i++) {
+        sh->queues[i].head = (c_node_t *) calloc(1, sizeof(c_node_t));
+        sh->queues[i].tail = (c_node_t *) calloc(1, sizeof(c_node_t));
+        sh->queues[i].size = 0;
+        if (!sh->queues[i].head || !sh->queues[i].tail) {
+            failed = 1;
+            continue;
+        }
+        /* init queue head and tail */
+        sh->queues[i].head->lru_next = sh->queues[i].tail;
+        sh->queues[i].tail->lru_prev = sh->queues[i].head;
+    }
+    sh->target = 0;
+    if ((policy == CACHE_ARC || policy == CACHE_S3FIFO) && 
+        init_ghost(&sh->ghosts[0], cap) < 0) {
+        failed = 1;
+    }
+    if (policy == CACHE_ARC && init_ghost(&sh->ghosts[1], cap) < 0) {
+        failed = 1;
+    }
+    sh->heap = NULL;
+    sh->heaplen = 0;
+    sh->heapcap = 0;
+    sh->inflation = 0;
+    /* never full when empty, so puts can always make room */
+    if (policy == CACHE_GDSF && !heap_room(sh)) {
+        failed = 1;
+    }
+    if ((policy == CACHE_WTINYLFU || csh->admit) && 
+        init_sketch(&sh->sketch, (unsigned long) cap_slots(cap)) < 0) {
+        failed = 1;
+    }
+    sh->table = new_table(cap_slots(cap));
+    sh->index = NULL;
     
-    /* remove from the hash table */
-    if (e->prev) {
-        e->prev->next = e->next;
-        e->next->prev = e->prev;
+    /* malloc failded */
+    if (failed || !sh->table) {
+        perror("Malloc");
+        return -1;
     }
-    else {
-        slot = find_slot(e->key, csh->rowlen);
-        csh->cache[slot] = e->next;
-        e->next->prev = NULL;
+    
+    /* init shard lock */
+    if (pthread_rwlock_init(&sh->lock, NULL) != 0) {
+        perror("Init shard lock");
+        return -1;
     }
+    return 0;
+}
+
+/*
+ * Free the entries of a shard and the shard itself.
+ * Bodies are left to the body table.
+ */
+static void free_shard(c_shard_t *sh) {
+    c_node_t *cur;
+    c_node_t *tmp;
+    int i;
     
-    /* clean up */
-    csh->size -= e->size;
-    free(e->key);
-    free(e->val);
-    free(e);
+    /* free all the cache nodes, whatever table they are in */
+    for (i = 0; i < CACHE_QUEUES; i++) {
+        if (sh->queues[i].head && sh->queues[i].tail) {
+            cur = sh->queues[i].head->lru_next;
+            while (cur != sh->queues[i].tail) {
+                tmp = cur->lru_next;
+                free(cur->key);
+                free(cur->val);
+                free(cur);
+                cur = tmp;
+            }
+        }
+        free(sh->queues[i].head);
+        free(sh->queues[i].tail);
+    }
+    free(sh->ghosts[0].hashes);
+    free(sh->ghosts[1].hashes);
+    free_sketch(&sh->sketch);
+    free(sh->heap);
+    free(sh->table);
+    free(sh->old);
+    free_index(sh->index);
 }
 
 /*
- * Init a cache instance.
+ * Init a cache instance of nshards shards, evicting
+ * by policy (CACHE_LRU, CACHE_CLOCK, CACHE_SLRU, CACHE_ARC,
+ * CACHE_S3FIFO, CACHE_WTINYLFU or CACHE_GDSF), or'ed with
+ * CACHE_ADMIT to filter what is put by frequency, and with
+ * CACHE_BYTES for GDSF to aim at byte hit ratio.
  */
-cache_t *init_cache(int cap) {
+cache_t *init_cache(size_t cap, int nshards, int policy) {
+    cache_t *csh = (cache_t *) calloc(1, sizeof(cache_t));
     int failed = 0;
+    int i;
     
-    cache_t *csh = (cache_t *) malloc(sizeof(cache_t));
+    if (!csh) {
+        perror("Malloc");
+        return NULL;
+    }
+    if (nshards < 1) {
+        nshards = 1;
+    }
     csh->cap = cap;
-    csh->size = 0;
-    csh->rowlen = (cap + 1023) / 1024;
-    csh->lru_h = (c_node_t *) malloc(sizeof(c_node_t));
-    csh->lru_t = (c_node_t *) malloc(sizeof(c_node_t));
-    csh->cache = (c_node_t **) calloc((size_t)csh->rowlen, sizeof(c_node_t *));
-    csh->readcnt = 0;
+    csh->policy = policy & ~(CACHE_ADMIT | CACHE_BYTES);
+    csh->admit = (policy & CACHE_ADMIT) != 0;
+    csh->bytes = (policy & CACHE_BYTES) != 0;
+    csh->bodyrows = body_rows(cap);
+    csh->bodies = (c_body_t **) calloc((size_t)csh->bodyrows, 
+                                       sizeof(c_body_t *));
+    csh->shards = (c_shard_t *) calloc((size_t)nshards, sizeof(c_shard_t));
     
     /* malloc failded */
-    if (!csh || !csh->lru_h || !csh->lru_t || !csh->cache) {
+    if (!csh->bodies || !csh->shards) {
         perror("Malloc");
-        failed = 1;
+        free(csh->bodies);
+        free(csh->shards);
+        free(csh);
+        return NULL;
     }
     
-    /* init mutex */
-    if (sem_init(&csh->mutex, 0, 1) < 0) {
-        perror("Init mutex");
-        failed = 1;
+    /* init the body lock stripes */
+    for (i = 0; i < BODY_LOCKS; i++) {
+        if (sem_init(&csh->bodylocks[i], 0, 1) < 0) {
+            perror("Init body lock");
+            failed = 1;
+        }
     }
     
-    /* init write lock */
-    if (sem_init(&csh->wlock, 0, 1) < 0) {
-        perror("Init wlock");
-        failed = 1;
+    /* init the shards, counting those to clean up */
+    for (i = 0; i < nshards; i++) {
+        csh->nshards++;
+        if (init_shard(csh, &csh->shards[i], cap / nshards) < 0) {
+            failed = 1;
+            break;
+        }
     }
     
     /* abort */
@@ -149,23 +1611,6 @@ cache_t *init_cache(int cap) {
         return NULL;
     }
     
-    /* init lru head */
-    csh->lru_h->next = NULL;
-    csh->lru_h->prev = NULL;
-    csh->lru_h->lru_next = csh->lru_t;
-    csh->lru_h->lru_prev = NULL;
-    csh->lru_h->key = NULL;
-    csh->lru_h->val = NULL;
-    csh->lru_h->size = 0;
-    /* init lru tail */
-    csh->lru_t->next = NULL;
-    csh->lru_t->prev = NULL;
-    csh->lru_t->lru_next = NULL;
-    csh->lru_t->lru_prev = csh->lru_h;
-    csh->lru_t->key = NULL;
-    csh->lru_t->val = NULL;
-    csh->lru_t->size = 0;
-    
     return csh;
 }
 
@@ -173,55 +1618,80 @@ cache_t *init_cache(int cap) {
  * Free a cache instance.
  */
 void free_cache(cache_t * csh) {
-    if (csh) {
-        if (csh->lru_h) {
-            free(csh->lru_h);
-        }
-        if (csh->lru_t) {
-            free(csh->lru_t);
-        }
-        /* free all the cache nodes */
-        if (csh->cache) {
-            c_node_t *cur;
-            c_node_t *tmp;
-            int len = csh->rowlen;
-            int i;
-            
-            for (i = 0; i < len; i++) {
-                cur = csh->cache[i];
-                while (cur) {
-                    tmp = cur->next;
-                    free(cur->key);
-                    free(cur->val);
-                    free(cur);
-                    cur = tmp;
-                }
+    c_body_t *cur;
+    c_body_t *tmp;
+    int i;
+    
+    if (!csh) {
+        return;
+    }
+    /* nodes waiting to be freed may point at bodies */
+    epoch_barrier();
+    for (i = 0; i < csh->nshards; i++) {
+        free_shard(&csh->shards[i]);
+        pthread_rwlock_destroy(&csh->shards[i].lock);
+    }
+    free(csh->shards);
+    /* free all the bodies */
+    if (csh->bodies) {
+        for (i = 0; i < csh->bodyrows; i++) {
+            cur = csh->bodies[i];
+            while (cur) {
+                tmp = cur->next;
+                free(cur->data);
+                free(cur);
+                cur = tmp;
             }
-            free(csh->cache);
-        }
-        /* destroy semaphores */
-        if (sem_destroy(&csh->mutex) < 0) {
-            perror("Destroy mutex");
-        }
-        if (sem_destroy(&csh->wlock) < 0) {
-            perror("Destroy wlock");
         }
-        
-        free(csh);
+        free(csh->bodies);
     }
+    /* destroy semaphores */
+    for (i = 0; i < BODY_LOCKS; i++) {
+        sem_destroy(&csh->bodylocks[i]);
+    }
+    free(csh);
+}
+
+/*
+ * Compute the hash of a key, for the _hashed operations.
+ */
+unsigned long cache_hash(char *key) {
+    return hash_bytes((unsigned char *) key, strlen(key));
+}
+
+/*
+ * Put a cache entry key:val into the cache *csh,
+ * replacing the entry of the key if any.
+ * val should be malloced. Its first hdrlen bytes belong to
+ * the key, the rest is the body, shared with other keys
+ * whose body is the same. On success val belongs to the
+ * cache, on failure it is left to the caller (contents
+ * may have been moved around). With CACHE_ADMIT, a new
+ * key the admission filter turns away fails too.
+ */
+int put(cache_t *csh, char *key, void *val, size_t size, size_t hdrlen) {
+    return put_hashed(csh, key, cache_hash(key), val, size, hdrlen);
 }
 
 /*
- * Put a cache entry key:val into the cache *csh.
- * val should be malloced.
+ * Same as put, with keyhash the cache_hash of key.
  */
-int put(cache_t *csh, char *key, void *val, size_t size) {
-    if (size > csh->cap) {
+int put_hashed(cache_t *csh, char *key, unsigned long keyhash, 
+               void *val, size_t size, size_t hdrlen) {
+    c_shard_t *sh = find_shard(csh, keyhash);
+    
+    if (size > CAP_OF(sh) || hdrlen > size) {
         return -1;
     }
     
-    int slot = find_slot(key, csh->rowlen);
-    c_node_t *first;
+    size_t bodylen = size - hdrlen;
+    unsigned long h = 0;
+    sem_t *block = NULL;        /* lock stripe of the body */
+    c_node_t *old;
+    c_body_t *body = NULL;
+    c_crit_t *crit;             /* key index node, if needed */
+    size_t charge = size;       /* bytes it adds to the shard */
+    int dup = 0;                /* the body is cached already */
     
     /* new node */
     c_node_t *new = (c_node_t *) malloc(sizeof(c_node_t));
@@ -229,140 +1699,561 @@ int put(cache_t *csh, char *key, void *val, size_t size) {
         perror("Put cache - malloc");
         return -1;
     }
-    new->prev = NULL;
     new->key = (char *) malloc(strlen(key) + 1);
+    new->val = malloc(hdrlen ? hdrlen : 1);
+    crit = (c_crit_t *) malloc(sizeof(c_crit_t));
+    if (!new->key || !new->val || !crit ||
+        (bodylen && !(body = (c_body_t *) malloc(sizeof(c_body_t))))) {
+        perror("Put cache - malloc");
+        free(new->key);
+        free(new->val);
+        free(new);
+        free(crit);
+        return -1;
+    }
     strcpy(new->key, key);
+    new->hash = keyhash;
     dbg_printf("Putting key: %s\n", new->key);
-    new->val = val;
-    new->size = size;
+    new->size = hdrlen;
+    new->body = NULL;
+    new->ref = 0;
+    new->deferred = marks_hits(csh);
+    new->retired = &sh->retired;
+    new->retbytes = 0;
+    new->pins = 1;
+    new->freq = 0;
+    new->heap = -1;
+    new->prio = 0;
+    
+    /* split val into the per-key part and the body, 
+     * and hash the body, all before taking the locks */
+    memcpy(new->val, val, hdrlen);
+    if (bodylen) {
+        memmove(val, (char *) val + hdrlen, bodylen);
+        h = hash_bytes((unsigned char *) val, bodylen);
+        block = body_lock(csh, h);
+    }
     
-    /* acquire the write lock */
-    if (P(&csh->wlock) < 0) {
+    /* acquire the shard lock */
+    if (write_lock(sh) != 0) {
         perror("Put cache - lock");
+        free(new->key);
+        free(new->val);
+        free(new);
+        free(body);
+        free(crit);
         return -1;
     }
     
     /************************* 
      * start critical section 
      *************************/
+    /* a new key must be more popular than what it displaces,
+     * for the room it takes: none for a body cached already */
+    if (csh->admit && !find_node(sh, key, keyhash)) {
+        if (bodylen) {
+            sem_p(block);
+            if (find_body(csh, h, val, bodylen)) {
+                charge = hdrlen;
+            }
+            sem_v(block);
+        }
+        if (!admit(csh, sh, keyhash, charge)) {
+            dbg_printf("Not admitting key: %s\n", key);
+            if (unlock_shard(sh) != 0) {
+                perror("Put cache - unlock");
+            }
+            free(new->key);
+            free(new->val);
+            free(new);
+            free(body);
+            free(crit);
+            return -1;
+        }
+    }
+    
+    /* share the body if the content is cached already,
+     * holding a reference so that evicting can't free it */
+    if (bodylen) {
+        sem_p(block);
+        if ((new->body = find_body(csh, h, val, bodylen))) {
+            new->body->refcnt++;
+            __atomic_add_fetch(&new->body->nodes, 1, __ATOMIC_RELAXED);
+            hold_body(new);
+            dup = 1;
+        }
+        else {
+            /* new content, charged to this shard */
+            body->hash = h;
+            /* give back the room the per-key part took */
+            if ((body->data = realloc(val, bodylen)) == NULL) {
+                body->data = val;
+            }
+            body->size = bodylen;
+            body->refcnt = 1;
+            body->nodes = 1;
+            body->shard = sh - csh->shards;
+            body->next = csh->bodies[h % csh->bodyrows];
+            csh->bodies[h % csh->bodyrows] = body;
+            SIZE_ADD(sh, bodylen);
+            body->holders = NULL;
+            new->body = body;
+            hold_body(new);
+            body = NULL;
+        }
+        sem_v(block);
+    }
+    SIZE_ADD(sh, hdrlen);
+    
+    /* replace the entry of the key */
+    if ((old = find_node(sh, key, keyhash))) {
+        remove_node(csh, sh, old);
+    }
+    
     /* check size */
-    while (csh->size + size > csh->cap) {
-        evict(csh);
+    while (shard_held(csh, sh) > CAP_OF(sh) && !lru_empty(sh)) {
+        evict(csh, sh);
     }
     
-    first = csh->cache[slot];
+    /* keep the probes short, a few groups at a time */
+    grow(sh);
+    migrate(sh, MIGRATE_GROUPS);
     
-    /* insert into hash table */
-    if (first) {
-        new->next = first;
-        first->prev = new;
+    /* could not grow, make room */
+    while (sh->table->used == sh->table->nslots && !lru_empty(sh)) {
+        evict(csh, sh);
     }
-    else {
-        new->next = NULL;
+    while (csh->policy == CACHE_GDSF && !heap_room(sh) && !lru_empty(sh)) {
+        evict(csh, sh);
     }
-    csh->cache[slot] = new;
     
-    /* maintain lru list */
-    insert_lru(csh, new);
+    /* insert into hash table, readers see it once complete */
+    table_insert(sh->table, keyhash, new);
+    
+    /* queue it for eviction */
+    queue_node(csh, sh, new);
+    
+    if (index_insert(sh, new, crit)) {
+        crit = NULL;
+    }
     
     /************************* 
      * end critical section 
      *************************/
      
-    /* release the write lock */
-    if (V(&csh->wlock) < 0) {
+    /* release the shard lock */
+    if (unlock_shard(sh) != 0) {
         perror("Put cache - unlock");
     }
     
+    /* over half the capacity still waits to be freed: readers
+     * are slow to leave (a preempted one holds the epoch), so
+     * wait for them, now that no get or put waits on us */
+    if (marks_hits(csh) && RETIRED_OF(sh) > CAP_OF(sh) / 2) {
+        epoch_barrier();
+    }
+    
+    /* the cached copy is used instead */
+    if (dup) {
+        dbg_printf("Deduplicated %lu bytes of key: %s\n", 
+                   (unsigned long) bodylen, key);
+        free(val);
+    }
+    /* no body, all of it was copied */
+    else if (!bodylen) {
+        free(val);
+    }
+    free(body);
+    free(crit);
+    
     return 0;
 }
 
 /*
  * Read a cache entry identified by key from the cache *csh.
+ * The entry is pinned: it stays in memory, even if evicted
+ * meanwhile, until the result is given to cache_release.
+ * With CLOCK and S3-FIFO no lock is taken: the table is 
+ * probed in a read section, and a hit only marks the entry.
  */
 c_res_t *get(cache_t * csh, char *key) {
-    c_res_t *res = NULL;
+    return get_hashed(csh, key, cache_hash(key));
+}
+
+/*
+ * Same as get, with keyhash the cache_hash of key.
+ */
+c_res_t *get_hashed(cache_t *csh, char *key, unsigned long keyhash) {
+    c_shard_t *sh = find_shard(csh, keyhash);
+    c_res_t *res = (c_res_t *) malloc(sizeof(c_res_t));
+    c_node_t *cur;
+    int marks = marks_hits(csh);
     dbg_printf("Getting key: %s\n", key);
     
-    /* acquire the readcnt lock */
-    if (P(&csh->mutex) < 0) {
-        perror("Get cache in - lock readcnt");
+    if (!res) {
+        perror("Get cache - malloc");
         return NULL;
     }
-    
-    /* first reader in */
-    if (csh->readcnt == 0) {
-        /* acquire the write lock */
-        if (P(&csh->wlock) < 0) {
-            perror("Get cache in - lock write");
-            return NULL;
-        }
+    if (marks) {
+        epoch_enter();
     }
-    
-    /* else: the write lock has been held by another reader */
-    
-    csh->readcnt++;
-    
-    /* release the readcnt lock */
-    if (V(&csh->mutex) < 0) {
-        perror("Get cache in - unlock readcnt");
+    else if (write_lock(sh) != 0) {
+        perror("Get cache - lock");
+        free(res);
         return NULL;
     }
     
     /*****************
      * start reading 
      *****************/
-    int slot = find_slot(key, csh->rowlen);
+    /* misses count too, they may be put next */
+    if (counts_gets(csh)) {
+        sketch_add(&sh->sketch, keyhash);
+    }
     
     /* find the cache node */
-    c_node_t *cur = csh->cache[slot];
-    while (cur) {
-        if (strcmp(cur->key, key)) {
-            cur = cur->next;
-            continue;
-        }
-        
+    if ((cur = find_node(sh, key, keyhash))) {
         /* hit */
-        /* maintain the lru list */
-        remove_lru(cur);
-        insert_lru(csh, cur);
-        if ((res = malloc(sizeof(c_res_t))) == NULL) {
-            return NULL;
+        if (marks) {
+            /* being freed, as good as gone */
+            if (pin_node(cur) < 0) {
+                cur = NULL;
+            }
+            else {
+                hit_node(csh, sh, cur);
+            }
+        }
+        else {
+            __atomic_add_fetch(&cur->pins, 1, __ATOMIC_RELAXED);
+            hit_node(csh, sh, cur);
         }
+    }
+    if (cur) {
         res->val = cur->val;
         res->size = cur->size;
-        
-        break;
+        res->body = cur->body ? cur->body->data : NULL;
+        res->bodysize = cur->body ? cur->body->size : 0;
+        res->handle = cur;
+    }
+    else {
+        free(res);
+        res = NULL;
     }
      
     /*****************
      * end reading 
      *****************/
     
-    /* acquire the readcnt lock */
-    if (P(&csh->mutex) < 0) {
-        perror("Get cache out - lock readcnt");
+    if (marks) {
+        epoch_exit();
+    }
+    else if (unlock_shard(sh) != 0) {
+        perror("Get cache - unlock");
+    }
+    
+    return res;
+}
+
+/*
+ * Give back a result of get, unpinning the entry.
+ * The result must not be used afterwards.
+ */
+void cache_release(c_res_t *res) {
+    if (res) {
+        unpin_node((c_node_t *) res->handle);
+        free(res);
+    }
+}
+
+/*
+ * Pin the entry of a result given to a cache_walk callback,
+ * so that it can still be used after the walk.
+ * Return a copy of the result, to give to cache_release,
+ * or NULL on errors.
+ */
+c_res_t *cache_hold(c_res_t *res) {
+    c_res_t *held = (c_res_t *) malloc(sizeof(c_res_t));
+    
+    if (!held) {
+        perror("Hold cache - malloc");
         return NULL;
     }
+    /* the walk holds the shard lock, so the cache still pins it */
+    __atomic_add_fetch(&((c_node_t *) res->handle)->pins, 1, 
+                       __ATOMIC_RELAXED);
+    *held = *res;
+    return held;
+}
+
+/*
+ * Whether key, of cache_hash keyhash, is in the cache *csh.
+ * Unlike get, this is not a use of the entry: no recency,
+ * frequency or mark is updated, so looking ahead for
+ * prefetches does not keep entries nobody asked for.
+ * Return 1 if it is, 0 if not, -1 on errors.
+ */
+int cache_contains(cache_t *csh, char *key, unsigned long keyhash) {
+    c_shard_t *sh = find_shard(csh, keyhash);
+    c_node_t *cur;
+    int found;
+    
+    if (marks_hits(csh)) {
+        epoch_enter();
+        /* being freed, as good as gone */
+        found = (cur = find_node(sh, key, keyhash)) != NULL &&
+                __atomic_load_n(&cur->pins, __ATOMIC_RELAXED) > 0;
+        epoch_exit();
+        return found;
+    }
+    
+    if (read_lock(sh) != 0) {
+        perror("Contains cache - lock");
+        return -1;
+    }
+    found = find_node(sh, key, keyhash) != NULL;
+    if (unlock_shard(sh) != 0) {
+        perror("Contains cache - unlock");
+    }
+    return found;
+}
+
+/*
+ * Call fn on every entry of the cache *csh, stopping
+ * early if fn returns non-zero. Shards are read locked one
+ * at a time meanwhile, so fn must not put into the cache.
+ * Return the last value returned by fn, or -1 on errors.
+ */
+int cache_walk(cache_t *csh, cache_walk_fn fn, void *arg) {
+    c_shard_t *sh;
+    c_queue_t *q;
+    c_node_t *cur;
+    c_res_t res;
+    int rc = 0;
+    int i, j;
+    
+    for (j = 0; j < csh->nshards && !rc; j++) {
+        sh = &csh->shards[j];
+        if (read_lock(sh) != 0) {
+            perror("Walk cache - lock");
+            return -1;
+        }
+        /* the queues have them all, whatever table they are in */
+        for (i = 0; i < CACHE_QUEUES && !rc; i++) {
+            q = &sh->queues[i];
+            for (cur = q->head->lru_next; cur != q->tail && !rc; 
+                 cur = cur->lru_next) {
+                res.val = cur->val;
+                res.size = cur->size;
+                res.body = cur->body ? cur->body->data : NULL;
+                res.bodysize = cur->body ? cur->body->size : 0;
+                res.handle = cur;
+                rc = fn(cur->key, &res, arg);
+            }
+        }
+        if (unlock_shard(sh) != 0) {
+            perror("Walk cache - unlock");
+            return -1;
+        }
+    }
+    return rc;
+}
+
+/*
+ * Change the capacity of the cache *csh, split evenly
+ * among the shards. The body table grows along with the
+ * capacity, the shard tables grow with their entries.
+ * Entries over the new capacity are evicted in batches,
+ * dropping the shard lock in between.
+ */
+int cache_set_cap(cache_t *csh, size_t cap) {
+    size_t slice = cap / csh->nshards;
+    c_shard_t *sh;
+    int n;
+    int i;
+    
+    csh->cap = cap;
+    for (i = 0; i < csh->nshards; i++) {
+        __atomic_store_n(&csh->shards[i].cap, slice, __ATOMIC_RELAXED);
+    }
+    if (body_rows(cap) > csh->bodyrows) {
+        rehash_bodies(csh, body_rows(cap));
+    }
     
-    /* last reader out */
-    if (csh->readcnt == 1) {
-        /* release the write lock */
-        if (V(&csh->wlock) < 0) {
-            perror("Get cache out - unlock write");
-            return NULL;
+    for (i = 0; i < csh->nshards; i++) {
+        sh = &csh->shards[i];
+        while (1) {
+            if (write_lock(sh) != 0) {
+                perror("Resize cache - lock");
+                return -1;
+            }
+            n = 0;
+            while (shard_held(csh, sh) > CAP_OF(sh) && n < EVICT_BATCH && 
+                   !lru_empty(sh)) {
+                evict(csh, sh);
+                n++;
+            }
+            if (unlock_shard(sh) != 0) {
+                perror("Resize cache - unlock");
+                return -1;
+            }
+            /* under the capacity, or nothing left to evict */
+            if (n < EVICT_BATCH) {
+                break;
+            }
         }
     }
+    return 0;
+}
+
+/*
+ * Largest entry the cache *csh takes now: an entry must fit
+ * the capacity slice of its shard, so once the capacity is
+ * shrunk, larger ones are not cached, however little of
+ * the cache is taken.
+ */
+size_t cache_max_entry(cache_t *csh) {
+    return CAP_OF(&csh->shards[0]);
+}
+
+/*
+ * The eviction policy called name (lru, clock, slru, arc,
+ * s3fifo, wtinylfu or gdsf), -1 if there is none.
+ */
+int cache_policy(char *name) {
+    static char *names[] = {"lru", "clock", "slru", "arc", 
+                            "s3fifo", "wtinylfu", "gdsf"};
+    int i;
     
-    /* else: the write lock has been held by another reader */
+    for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+        if (!strcmp(name, names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Bytes held by the cache *csh, with those of the entries
+ * gone but not freed yet if gets take no lock.
+ */
+size_t cache_size(cache_t *csh) {
+    size_t size = 0;
+    int i;
     
-    csh->readcnt--;
+    for (i = 0; i < csh->nshards; i++) {
+        size += SIZE_OF(&csh->shards[i]) + RETIRED_OF(&csh->shards[i]);
+    }
+    return size;
+}
+
+/*
+ * Collect the nodes of a key index subtree whose keys
+ * match pattern (all if NULL) into *hits.
+ * Return 0 on success, -1 on errors.
+ */
+static int collect(void *p, char *pattern, c_node_t ***hits, 
+                   int *n, int *cap) {
+    c_node_t **tmp;
     
-    /* release the readcnt lock */
-    if (V(&csh->mutex) < 0) {
-        perror("Get cache out - unlock readcnt");
-        return NULL;
+    if (IS_CRIT(p)) {
+        if (collect(TO_CRIT(p)->child[0], pattern, hits, n, cap) < 0) {
+            return -1;
+        }
+        return collect(TO_CRIT(p)->child[1], pattern, hits, n, cap);
     }
+    if (pattern && fnmatch(pattern, ((c_node_t *) p)->key, 0)) {
+        return 0;
+    }
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        if ((tmp = realloc(*hits, *cap * sizeof(c_node_t *))) == NULL) {
+            perror("Purge cache - malloc");
+            return -1;
+        }
+        *hits = tmp;
+    }
+    (*hits)[(*n)++] = (c_node_t *) p;
+    return 0;
+}
+
+/*
+ * Remove entries from a shard, as cache_purge does.
+ * Return the number of entries removed, -1 on errors.
+ */
+static int purge_shard(cache_t *csh, c_shard_t *sh, char *key, 
+                       size_t len, int mode) {
+    c_node_t **hits = NULL;
+    c_node_t *best;
+    void *p;
+    void *top;
+    int n = 0;
+    int cap = 0;
+    int rc = 0;
+    int i;
     
-    return res;
+    if (write_lock(sh) != 0) {
+        perror("Purge cache - lock");
+        return -1;
+    }
+    
+    if (sh->index) {
+        /* the subtree of the keys starting with key[0..len) */
+        p = top = sh->index;
+        while (IS_CRIT(p)) {
+            c_crit_t *q = TO_CRIT(p);
+            p = q->child[crit_dir(q, key, len)];
+            if (q->byte < len) {
+                top = p;
+            }
+        }
+        best = (c_node_t *) p;
+        
+        if (mode == PURGE_EXACT) {
+            if (!strcmp(best->key, key)) {
+                remove_node(csh, sh, best);
+                n = 1;
+            }
+        }
+        else if (!strncmp(best->key, key, len)) {
+            rc = collect(top, mode == PURGE_GLOB ? key : NULL, 
+                         &hits, &n, &cap);
+            for (i = 0; i < n; i++) {
+                remove_node(csh, sh, hits[i]);
+            }
+        }
+    }
+    
+    if (unlock_shard(sh) != 0) {
+        perror("Purge cache - unlock");
+    }
+    free(hits);
+    return rc < 0 ? -1 : n;
+}
+
+/*
+ * Remove entries from the cache *csh: the one of the key
+ * (PURGE_EXACT), those with keys starting with it
+ * (PURGE_PREFIX), or those with keys matching it as a
+ * shell pattern (PURGE_GLOB). Only the keys under the
+ * literal prefix of a pattern are looked at, in every
+ * shard unless the key is exact.
+ * Return the number of entries removed, -1 on errors.
+ */
+int cache_purge(cache_t *csh, char *key, int mode) {
+    size_t len = mode == PURGE_GLOB ? strcspn(key, "*?[\\") : strlen(key);
+    int total = 0;
+    int n;
+    int i;
+    
+    if (mode == PURGE_EXACT) {
+        return purge_shard(csh, find_shard(csh, cache_hash(key)), 
+                           key, len, mode);
+    }
+    for (i = 0; i < csh->nshards; i++) {
+        if ((n = purge_shard(csh, &csh->shards[i], key, len, mode)) < 0) {
+            return -1;
+        }
+        total += n;
+    }
+    return total;
 }
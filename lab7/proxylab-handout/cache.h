@@ -5,47 +5,188 @@
  * Liruoyang YU
  * liruoyay
  */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include <semaphore.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <semaphore.h>
+#ifdef CACHE_STANDALONE
+#define dbg_printf(...)         /* no debug.h outside the proxy */
+#else
 #include "debug.h"
+#endif
+#include "sketch.h"
+
+#define PURGE_EXACT 0           /* purge the key */
+#define PURGE_PREFIX 1          /* purge keys starting with it */
+#define PURGE_GLOB 2            /* purge keys matching the shell pattern */
+
+#define CACHE_LRU 0             /* evict the least recently used */
+#define CACHE_CLOCK 1           /* evict by second chance, hits only mark */
+#define CACHE_SLRU 2            /* segmented LRU: probation, protected */
+#define CACHE_ARC 3             /* adaptive replacement cache */
+#define CACHE_S3FIFO 4          /* small and main FIFOs, hits only mark */
+#define CACHE_WTINYLFU 5        /* LRU window, SLRU main, frequency sketch */
+#define CACHE_GDSF 6            /* GreedyDual-Size-Frequency, by priority */
+#define CACHE_ADMIT 0x100       /* or'ed in: admit by frequency (TinyLFU) */
+#define CACHE_BYTES 0x200       /* or'ed in: GDSF aims at byte hit ratio */
+
+#define CACHE_QUEUES 3          /* eviction queues per shard */
+
+#define CACHE_SHARDS 16         /* default number of shards */
+#define BODY_LOCKS 64           /* number of body table lock stripes */
+#define CACHE_GROUP 16          /* hash table slots probed at once */
 
 /* The cache result struct */
 typedef struct {
     void *val;                  /* pointer to the acutal cached value */
     size_t size;                /* size of the cache entry */
+    void *body;                 /* the body following val, may be shared */
+    size_t bodysize;            /* size of the body */
+    void *handle;               /* pins the entry, see cache_release */
 } c_res_t;
 
 
+/* The cache body struct, one per distinct content */
+typedef struct c_body {
+    struct c_body *next;        /* body table next */
+    unsigned long hash;         /* content hash */
+    void *data;                 /* the body bytes */
+    size_t size;                /* size of the body */
+    int refcnt;                 /* number of entries sharing it */
+    int nodes;                  /* nodes pointing at it, pinned ones too */
+    int shard;                  /* the shard its size is charged to */
+    struct c_node *holders;     /* the entries sharing it */
+} c_body_t;
+
+
 /* The cache node struct */
 typedef struct c_node {
-    struct c_node *next;        /* hash table next */
-    struct c_node *prev;        /* hash table prev */
     struct c_node *lru_next;    /* lru list next */
     struct c_node *lru_prev;    /* lru list prev */
     char *key;                  /* the cache key */
+    unsigned long hash;         /* hash of the key */
     void *val;                  /* pointer to the acutal cached value */
     size_t size;                /* size of the cache entry */
+    c_body_t *body;             /* shared body, NULL if empty */
+    struct c_node *share_next;  /* next entry sharing the body */
+    struct c_node *share_prev;  /* prev entry sharing the body */
+    unsigned char ref;          /* hit since the clock hand passed, or 
+                                   S3-FIFO hits, up to S3_MAXFREQ */
+    unsigned char queue;        /* eviction queue it is in */
+    unsigned char deferred;     /* freed through epoch reclamation, as
+                                   lock-free readers may be on it */
+    size_t *retired;            /* bytes retired of its shard */
+    size_t retbytes;            /* what it added to them once retired */
+    int pins;                   /* the cache's pin and handles out */
+    unsigned freq;              /* GDSF: gets of it, the put included */
+    int heap;                   /* GDSF: position in the shard heap */
+    double prio;                /* GDSF: priority, lowest evicted first */
 } c_node_t;
 
 
+/* The key index node struct, inner node of a crit-bit tree */
+typedef struct c_crit {
+    void *child[2];             /* subtrees, inner nodes are tagged with 1 */
+    size_t byte;                /* index of the byte keys differ at */
+    unsigned char otherbits;    /* all bits set but the one they differ at */
+} c_crit_t;
+
+
+/* The hash table slot struct */
+typedef struct {
+    unsigned long hash;         /* hash of the key, checked before the node */
+    c_node_t *node;             /* the entry */
+} c_slot_t;
+
+
+/* The hash table struct (open addressing), replaced as a whole 
+ * when growing. One block: the struct, the slots, the tags. */
+typedef struct {
+    int nslots;                 /* number of slots, a power of two */
+    int used;                   /* slots holding an entry */
+    int dead;                   /* slots deleted, until reused */
+    unsigned char *ctrl;        /* tag of each slot, in groups */
+    c_slot_t *slots;            /* the slots */
+} c_table_t;
+
+
+/* The eviction queue struct, a list of nodes by recency */
+typedef struct {
+    c_node_t *head;             /* head of the list */
+    c_node_t *tail;             /* tail of the list */
+    size_t size;                /* bytes of the entries in it */
+} c_queue_t;
+
+
+/* The ghost struct, hashes of keys evicted lately. A hash
+ * takes the place of the one in its slot, so it is lossy */
+typedef struct {
+    unsigned long *hashes;      /* 0 for free slots */
+    int nslots;                 /* number of slots, a power of two */
+    int count;                  /* hashes in it */
+} c_ghost_t;
+
+
+/* The cache shard struct */
+typedef struct {
+    size_t cap;                 /* capacity slice of the shard */
+    size_t size;                /* bytes charged to it, updated atomically */
+    size_t retired;             /* of its entries gone, bytes not freed yet */
+    c_queue_t queues[CACHE_QUEUES];     /* eviction queues, by policy */
+    c_ghost_t ghosts[2];        /* evicted keys, for ARC and S3-FIFO */
+    size_t target;              /* ARC: bytes the first queue aims at */
+    sketch_t sketch;            /* W-TinyLFU, admission: key frequencies */
+    c_node_t **heap;            /* GDSF: nodes by priority (binary heap) */
+    int heaplen;                /* GDSF: nodes in the heap */
+    int heapcap;                /* GDSF: room of the heap */
+    double inflation;           /* GDSF: priority of the last victim */
+    c_table_t *table;           /* actual cache (hash table) */
+    c_table_t *old;             /* table being migrated from, or NULL */
+    int migrated;               /* groups of the old table migrated */
+    void *index;                /* keys in order (crit-bit tree) */
+    pthread_rwlock_t lock;      /* shard lock, CLOCK hits take the read side */
+} c_shard_t;
+
+
 /* The cache struct */
 typedef struct {
     size_t cap;                 /* capacity of the cache */
-    volatile size_t size;       /* current size of the cache */
-    int rowlen;                 /* hash table row number */
-    c_node_t *lru_h;            /* head of the lru list */
-    c_node_t *lru_t;            /* tail of the lru list */
-    c_node_t **cache;           /* actual cache (hash table) */
-    sem_t mutex;                /* readcnt lock */
-    sem_t wlock;                /* write lock */
-    volatile int readcnt;       /* number of readers */
+    int policy;                 /* CACHE_LRU, CACHE_CLOCK, ... */
+    int admit;                  /* admission filter on, see CACHE_ADMIT */
+    int bytes;                  /* GDSF aims at byte hits, see CACHE_BYTES */
+    int nshards;                /* number of shards */
+    c_shard_t *shards;          /* the shards, picked by key hash */
+    int bodyrows;               /* body table row number */
+    c_body_t **bodies;          /* bodies by content (hash table) */
+    sem_t bodylocks[BODY_LOCKS];    /* body row i is guarded by 
+                                       lock i % BODY_LOCKS */
 } cache_t;
 
 
-cache_t *init_cache(int);
+/* Callback of cache_walk: key, entry, user argument */
+typedef int (*cache_walk_fn)(char *, c_res_t *, void *);
+
+
+cache_t *init_cache(size_t, int, int);
 void free_cache(cache_t *);
-int put(cache_t *, char *, void *, size_t);
+unsigned long cache_hash(char *);
+int put(cache_t *, char *, void *, size_t, size_t);
+int put_hashed(cache_t *, char *, unsigned long, void *, size_t, size_t);
 c_res_t *get(cache_t *, char *);
+c_res_t *get_hashed(cache_t *, char *, unsigned long);
+void cache_release(c_res_t *);
+int cache_contains(cache_t *, char *, unsigned long);
+int cache_walk(cache_t *, cache_walk_fn, void *);
+c_res_t *cache_hold(c_res_t *);
+int cache_set_cap(cache_t *, size_t);
+int cache_purge(cache_t *, char *, int);
+size_t cache_max_entry(cache_t *);
+size_t cache_size(cache_t *);
+int cache_policy(char *);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,429 @@
+/**
+ * This file benchmarks the cache on its own, without the
+ * proxy or any network in the way.
+ *
+ * Usage: cachebench [-s shards] [-p policy] [-n ops] mode
+ *
+ * scale: 1 to 64 threads doing gets, and a put on one op
+ *      out of ten, on keys picked at random; reports the
+ *      ops per second at each thread count, so one shard
+ *      (-s 1) against many shows what sharding buys.
+ * lookup: one thread getting random keys of 1000 to 1M
+ *      cached ones; reports the time a get takes at each
+ *      number of entries. The probes per get stay few as
+ *      the shard tables grow, but the time does not stay
+ *      flat: once the nodes and keys no longer fit in the
+ *      CPU caches, each get pays memory misses for them.
+ * probe: one thread getting keys cached and keys not, at
+ *      about 7/8 of the table slots taken, next to a chained
+ *      table at 1.75 entries a row doing the same lookups;
+ *      reports the time a hit and a miss take in each. Best
+ *      run with -s 1 -p clock, so a get only probes.
+ *
+ *
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "cache.h"
+#include "epoch.h"
+
+#define BENCH_KEYS 20000        /* distinct keys asked for */
+#define BENCH_OPS 200000        /* default ops per thread */
+#define BENCH_CAP (8 << 20)     /* cache capacity */
+#define BENCH_THREADS 64        /* most threads */
+#define LOOKUP_MIN 1000         /* fewest entries of the lookup benchmark */
+#define LOOKUP_MAX 1000000      /* most entries of it */
+#define LOOKUP_SIZE 200         /* cache capacity per entry */
+#define CHAIN_LOAD 7            /* quarters of an entry per chained row */
+#define PUT_SHARE 10            /* one op in this many is a put */
+#define HDR_LEN 16              /* per-key part of the values */
+
+/* The benchmark thread struct */
+typedef struct {
+    cache_t *csh;               /* the cache under test */
+    unsigned seed;              /* picks the keys and ops */
+    long ops;                   /* ops to do */
+} b_thread_t;
+
+/* The chained table node, what the probe benchmark compares to */
+typedef struct ch_node {
+    struct ch_node *next;       /* next in the row */
+    char *key;                  /* the key */
+    unsigned long hash;         /* hash of the key */
+    void *val;                  /* the per-key part of the value */
+    c_body_t *body;             /* the body */
+} ch_node_t;
+
+/*************************
+ * Start global variables
+ *************************/
+/* The keys and their hashes */
+static char **keys;
+static unsigned long *hashes;
+/*************************
+ * End global variables
+ *************************/
+
+/*
+ * Print the usage and exit.
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: cachebench [-s shards] [-p policy] "
+            "[-n ops] scale|lookup|probe\n");
+    fprintf(stderr, "  policy: lru, clock, slru, arc, s3fifo, wtinylfu "
+            "or gdsf\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Seconds on a monotonic clock.
+ */
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Next number of a xorshift generator.
+ */
+static inline unsigned next_rand(unsigned *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+/*
+ * Make n keys shaped like the proxy's, host and URI.
+ */
+static void make_keys(int n) {
+    char key[64];
+    int i;
+    
+    keys = (char **) malloc(n * sizeof(char *));
+    hashes = (unsigned long *) malloc(n * sizeof(unsigned long));
+    if (!keys || !hashes) {
+        perror("Make keys - malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n; i++) {
+        sprintf(key, "host%d.example.com/obj/%d", i % 97, i);
+        keys[i] = strdup(key);
+        hashes[i] = cache_hash(key);
+    }
+}
+
+/*
+ * Put a value of size bytes under key i.
+ */
+static void put_key(cache_t *csh, int i, size_t size) {
+    char *val = (char *) malloc(size);
+    
+    if (!val) {
+        return;
+    }
+    memset(val, 0, size);
+    memcpy(val + HDR_LEN, &i, sizeof(i));
+    if (put_hashed(csh, keys[i], hashes[i], val, size, HDR_LEN) < 0) {
+        free(val);
+    }
+}
+
+/*
+ * Thread routine of the scaling benchmark.
+ */
+static void *scale_thread(void *arg) {
+    b_thread_t *t = (b_thread_t *) arg;
+    c_res_t *res;
+    unsigned r;
+    long i;
+    int k;
+    
+    for (i = 0; i < t->ops; i++) {
+        r = next_rand(&t->seed);
+        k = r % BENCH_KEYS;
+        if ((r >> 16) % PUT_SHARE == 0) {
+            put_key(t->csh, k, HDR_LEN + 64 + (r >> 20) % 512);
+        }
+        else if ((res = get_hashed(t->csh, keys[k], hashes[k]))) {
+            cache_release(res);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run the scaling benchmark: the same ops per thread at
+ * 1, 2, 4, ... BENCH_THREADS threads, on a new cache each.
+ */
+static void bench_scale(int shards, int policy, long ops) {
+    pthread_t tids[BENCH_THREADS];
+    b_thread_t args[BENCH_THREADS];
+    double base = 0;
+    double start, secs, rate;
+    cache_t *csh;
+    int n, i;
+    
+    make_keys(BENCH_KEYS);
+    printf("%d shards, %ld ops per thread, 1 in %d a put\n",
+           shards, ops, PUT_SHARE);
+    printf("%8s %12s %8s\n", "threads", "Mops/s", "speedup");
+    for (n = 1; n <= BENCH_THREADS; n *= 2) {
+        if ((csh = init_cache(BENCH_CAP, shards, policy)) == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        /* warm: every key cached once */
+        for (i = 0; i < BENCH_KEYS; i++) {
+            put_key(csh, i, HDR_LEN + 64);
+        }
+    
+        start = now_sec();
+        for (i = 0; i < n; i++) {
+            args[i].csh = csh;
+            args[i].seed = 2463534242u + i * 7919;
+            args[i].ops = ops;
+            if (pthread_create(&tids[i], NULL, scale_thread, &args[i]) != 0) {
+                perror("Bench - pthread_create");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        secs = now_sec() - start;
+    
+        rate = n * ops / secs / 1e6;
+        if (n == 1) {
+            base = rate;
+        }
+        printf("%8d %12.2f %8.2f\n", n, rate, rate / base);
+        free_cache(csh);
+    }
+}
+
+/*
+ * Run the lookup benchmark: ops gets of random keys, all
+ * cached, by one thread, at LOOKUP_MIN, 10 times as many
+ * ... LOOKUP_MAX entries, on a new cache each.
+ */
+static void bench_lookup(int shards, int policy, long ops) {
+    double start, secs;
+    cache_t *csh;
+    c_res_t *res;
+    unsigned r = 2463534242u;
+    long hits;
+    long i;
+    int n, k;
+    
+    make_keys(LOOKUP_MAX);
+    printf("%d shards, %ld gets\n", shards, ops);
+    printf("%8s %8s %10s\n", "entries", "hits", "ns/get");
+    for (n = LOOKUP_MIN; n <= LOOKUP_MAX; n *= 10) {
+        if ((csh = init_cache((size_t) n * LOOKUP_SIZE, shards, 
+                              policy)) == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        for (k = 0; k < n; k++) {
+            put_key(csh, k, HDR_LEN + 64);
+        }
+        
+        hits = 0;
+        start = now_sec();
+        for (i = 0; i < ops; i++) {
+            k = next_rand(&r) % n;
+            /* hash the key too, as the proxy does */
+            if ((res = get(csh, keys[k]))) {
+                hits++;
+                cache_release(res);
+            }
+        }
+        secs = now_sec() - start;
+        
+        printf("%8d %8ld %10.0f\n", n, hits, secs * 1e9 / ops);
+        free_cache(csh);
+    }
+}
+
+/*
+ * Look up key k in a chained table of nrows rows the way
+ * a CLOCK get does in the cache: in a read section, the
+ * result allocated and filled, then given back.
+ * Return 1 if found, 0 otherwise.
+ */
+static int chain_get(ch_node_t **rows, int nrows, int k) {
+    c_res_t *res = (c_res_t *) malloc(sizeof(c_res_t));
+    ch_node_t *e;
+    
+    epoch_enter();
+    for (e = rows[hashes[k] & (nrows - 1)]; e; e = e->next) {
+        if (e->hash == hashes[k] && !strcmp(e->key, keys[k])) {
+            res->val = e->val;
+            res->body = e->body->data;
+            res->bodysize = e->body->size;
+            break;
+        }
+    }
+    epoch_exit();
+    free(res);
+    return e != NULL;
+}
+
+/*
+ * Free a chained table of nrows rows.
+ */
+static void chain_free(ch_node_t **rows, int nrows) {
+    ch_node_t *e;
+    int i;
+    
+    for (i = 0; i < nrows; i++) {
+        while ((e = rows[i])) {
+            rows[i] = e->next;
+            free(e->body->data);
+            free(e->body);
+            free(e->key);
+            free(e->val);
+            free(e);
+        }
+    }
+    free(rows);
+}
+
+/*
+ * Run the probe benchmark at three table sizes: ops gets of
+ * cached keys, then of keys not cached, in the cache and in
+ * a chained table holding the same keys.
+ */
+static void bench_probe(int shards, int policy, long ops) {
+    /* 7/8 of 16384, 262144 and 2097152 slots, at one shard */
+    static const int sizes[] = {14300, 229000, 1835000};
+    double start, hit, miss, chit, cmiss;
+    ch_node_t **rows;
+    ch_node_t *e;
+    cache_t *csh;
+    c_res_t *res;
+    unsigned r = 2463534242u;
+    long i;
+    int x, n, k, nrows;
+    
+    make_keys(2 * sizes[2]);
+    printf("%d shards, %ld gets of each kind (ns/get)\n", shards, ops);
+    printf("%8s %10s %10s %10s %10s\n", "entries", "chain hit", 
+           "chain miss", "hit", "miss");
+    for (x = 0; x < (int) (sizeof(sizes) / sizeof(sizes[0])); x++) {
+        n = sizes[x];
+        
+        /* the cache, keys 0 to n - 1 */
+        if ((csh = init_cache((size_t) n * LOOKUP_SIZE, shards, 
+                              policy)) == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        for (k = 0; k < n; k++) {
+            put_key(csh, k, HDR_LEN + 64);
+        }
+        start = now_sec();
+        for (i = 0; i < ops; i++) {
+            k = next_rand(&r) % n;
+            if ((res = get_hashed(csh, keys[k], hashes[k]))) {
+                cache_release(res);
+            }
+        }
+        hit = now_sec() - start;
+        start = now_sec();
+        for (i = 0; i < ops; i++) {
+            k = n + next_rand(&r) % n;
+            if ((res = get_hashed(csh, keys[k], hashes[k]))) {
+                cache_release(res);
+            }
+        }
+        miss = now_sec() - start;
+        free_cache(csh);
+        
+        /* the chained table, same keys */
+        for (nrows = 1; nrows * CHAIN_LOAD / 4 < n; nrows *= 2) {
+            ;
+        }
+        if ((rows = (ch_node_t **) calloc(nrows, sizeof(ch_node_t *))) 
+            == NULL) {
+            perror("Chained table - malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (k = 0; k < n; k++) {
+            /* allocated as in the cache */
+            if ((e = (ch_node_t *) malloc(sizeof(ch_node_t))) == NULL ||
+                (e->key = strdup(keys[k])) == NULL ||
+                (e->val = malloc(HDR_LEN)) == NULL ||
+                (e->body = (c_body_t *) malloc(sizeof(c_body_t))) == NULL ||
+                (e->body->data = malloc(64)) == NULL) {
+                perror("Chained table - malloc");
+                exit(EXIT_FAILURE);
+            }
+            e->hash = hashes[k];
+            e->body->size = 64;
+            e->next = rows[e->hash & (nrows - 1)];
+            rows[e->hash & (nrows - 1)] = e;
+        }
+        start = now_sec();
+        for (i = 0; i < ops; i++) {
+            chain_get(rows, nrows, next_rand(&r) % n);
+        }
+        chit = now_sec() - start;
+        start = now_sec();
+        for (i = 0; i < ops; i++) {
+            chain_get(rows, nrows, n + next_rand(&r) % n);
+        }
+        cmiss = now_sec() - start;
+        chain_free(rows, nrows);
+        
+        printf("%8d %10.0f %10.0f %10.0f %10.0f\n", n, chit * 1e9 / ops, 
+               cmiss * 1e9 / ops, hit * 1e9 / ops, miss * 1e9 / ops);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int shards = CACHE_SHARDS;
+    int policy = CACHE_LRU;
+    long ops = BENCH_OPS;
+    int c;
+    
+    while ((c = getopt(argc, argv, "s:p:n:")) != -1) {
+        switch (c) {
+        case 's':
+            shards = atoi(optarg);
+            break;
+        case 'p':
+            policy = cache_policy(optarg);
+            break;
+        case 'n':
+            ops = atol(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc || shards <= 0 || policy < 0 || ops <= 0) {
+        usage();
+    }
+    
+    if (!strcmp(argv[optind], "scale")) {
+        bench_scale(shards, policy, ops);
+    }
+    else if (!strcmp(argv[optind], "lookup")) {
+        bench_lookup(shards, policy, ops);
+    }
+    else if (!strcmp(argv[optind], "probe")) {
+        bench_probe(shards, policy, ops);
+    }
+    else {
+        usage();
+    }
+    return 0;
+}
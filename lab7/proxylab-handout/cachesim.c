@@ -0,0 +1,675 @@
+/**
+ * This file replays traces of gets against the cache to
+ * compare eviction policies by hit ratio. Each get that
+ * misses is followed by a put of the object, as the proxy
+ * does after fetching it.
+ *
+ * Usage: cachesim [-c MB] [-s shards] [-n gets] [-p policies] trace
+ *        cachesim -t
+ *
+ * policies: names given to init_cache, comma separated,
+ *      lru, slru, arc, s3fifo and wtinylfu by default. A
+ *      name ending in +admit also has the admission filter
+ *      (CACHE_ADMIT), as lru+admit; gdsf-bytes is gdsf
+ *      aiming at byte hit ratio (CACHE_BYTES).
+ * trace: a recorded trace, one get a line as "key size",
+ *      or one made up the same on every run:
+ *      zipf: objects asked for by a Zipf law (0.9).
+ *      scans: the same, with one block of gets in five
+ *          taken by a crawler asking for new URLs.
+ *      loop: half zipf, half a loop over LOOP_OBJS objects.
+ *      big1hit: the same as zipf, with one get in ten for
+ *          a new object of 100 KB to 400 KB.
+ * Made up objects have sizes following a log-normal law,
+ * from MIN_SIZE to MAX_SIZE. At most -n gets are replayed.
+ *
+ * For each policy, prints the object hit ratio and the
+ * byte hit ratio.
+ *
+ * -t checks the policies instead, on CHECK_GETS gets of
+ * each made up trace with the default cache: while
+ * replaying, that each put leaves the cache within its
+ * capacity with the object in it, and now and then that
+ * the shards account for what they hold (check_shards);
+ * then that the policies order by hit ratio as they should
+ * (orders). The traces are the same on every run, so are
+ * the ratios: an ordering that fails is a regression.
+ *
+ *
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "cache.h"
+#include "epoch.h"
+#include "check.h"
+
+#define SIM_CAP 8               /* default cache capacity, in MB */
+#define SIM_GETS 2000000        /* default gets of a made up trace */
+#define SIM_POLICIES "lru,slru,arc,s3fifo,wtinylfu"
+#define SIM_HDR 200             /* per-key part of the objects */
+#define NOBJ 200000             /* objects of a made up trace */
+#define ZIPF_ALPHA 0.9          /* skew of the Zipf law */
+#define SIZE_MU 7.5             /* log-normal sizes: mean of the log */
+#define SIZE_SIGMA 1.2          /* and its deviation */
+#define MIN_SIZE 200            /* smallest object */
+#define MAX_SIZE 102400         /* largest object */
+#define SCAN_BLOCK 20000        /* gets of a block of scans */
+#define LOOP_OBJS 3000          /* objects of the loop */
+#define SEED 88172645463325252UL
+#define SIM_LINE 1024           /* longest line of a recorded trace */
+#define SUFFIX_LEN 6            /* length of +admit and -bytes */
+#define CHECK_GETS 200000       /* gets of each trace checked by -t */
+#define CHECK_EVERY 10000       /* gets between checks of the shards */
+#define MAX_RUNS 32             /* replays remembered by -t */
+
+#define TRACE_FILE 0            /* recorded trace */
+#define TRACE_ZIPF 1            /* made up traces */
+#define TRACE_SCANS 2
+#define TRACE_LOOP 3
+#define TRACE_BIG1HIT 4
+
+/* The trace struct, where the gets come from */
+typedef struct {
+    int kind;                   /* one of TRACE_* */
+    FILE *fp;                   /* the recorded trace */
+    unsigned long rand;         /* state of the generator */
+    long gets;                  /* gets so far */
+    long scan;                  /* new objects so far */
+} trace_t;
+
+/* The outcome of a replay */
+typedef struct {
+    long gets;                  /* gets replayed */
+    double hits;                /* object hit ratio */
+    double bytes;               /* byte hit ratio */
+} sim_res_t;
+
+/* A hit ratio ordering checked by -t: on the trace, policy
+ * better beats policy worse by margin at least */
+typedef struct {
+    char *trace;                /* made up trace */
+    char *better;               /* names of -p */
+    char *worse;
+    int bytes;                  /* byte hit ratios, not object ones */
+    double margin;              /* least difference of the ratios */
+} order_t;
+
+/* A replay remembered by -t */
+typedef struct {
+    char *trace;                /* the trace */
+    char *pname;                /* the policy, as named by -p */
+    sim_res_t res;              /* its outcome */
+} run_t;
+
+/*************************
+ * Start global variables
+ *************************/
+/* The Zipf law, by object, and the object sizes */
+static double cdf[NOBJ];
+static size_t sizes[NOBJ];
+static int checking = 0;        /* -t: check invariants while replaying */
+/* Replays of -t so far */
+static run_t runs[MAX_RUNS];
+static int nruns = 0;
+/* Orderings checked by -t, each with a margin well under
+ * the difference seen on the traces */
+static order_t orders[] = {
+    /* marking hits costs no hits */
+    {"zipf", "clock", "lru", 0, 0},
+    /* frequency, or a second get, protects popular objects */
+    {"zipf", "slru", "lru", 0, 0.05},
+    {"zipf", "arc", "lru", 0, 0.05},
+    {"zipf", "s3fifo", "lru", 0, 0.05},
+    {"zipf", "wtinylfu", "lru", 0, 0.05},
+    {"zipf", "lru+admit", "lru", 0, 0.05},
+    /* GDSF keeps small objects for hits, big ones for bytes */
+    {"zipf", "gdsf", "lru", 0, 0.05},
+    {"zipf", "gdsf-bytes", "gdsf", 1, 0.02},
+    /* scans and loops do not flush them */
+    {"scans", "arc", "lru", 0, 0.03},
+    {"scans", "s3fifo", "lru", 0, 0.03},
+    {"scans", "wtinylfu", "lru", 0, 0.03},
+    {"loop", "slru", "lru", 0, 0.1},
+    {"loop", "arc", "lru", 0, 0.1},
+    {"loop", "gdsf", "lru", 0, 0.1},
+    /* admission keeps big objects asked for once out */
+    {"big1hit", "lru+admit", "lru", 0, 0.1},
+    {"big1hit", "gdsf+admit", "gdsf", 0, 0.05},
+    {"big1hit", "gdsf-bytes+admit", "gdsf-bytes", 1, 0.01},
+};
+/*************************
+ * End global variables
+ *************************/
+
+/*
+ * Print the usage and exit.
+ */
+static void usage(void) {
+    fprintf(stderr, "Usage: cachesim [-c MB] [-s shards] [-n gets] "
+            "[-p policies] trace\n");
+    fprintf(stderr, "       cachesim -t\n");
+    fprintf(stderr, "  trace: zipf, scans, loop, big1hit, or a file of "
+            "\"key size\" lines\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Next number of a xorshift generator.
+ */
+static inline unsigned long next_rand(unsigned long *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/*
+ * A number in [0, 1) from the generator.
+ */
+static inline double next_unit(unsigned long *s) {
+    return (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Set up the Zipf law and the object sizes of made up traces.
+ */
+static void make_objects(void) {
+    unsigned long r = SEED;
+    double sum = 0;
+    double c = 0;
+    double u, v, x;
+    int i;
+    
+    for (i = 0; i < NOBJ; i++) {
+        sum += pow(i + 1, -ZIPF_ALPHA);
+    }
+    for (i = 0; i < NOBJ; i++) {
+        c += pow(i + 1, -ZIPF_ALPHA) / sum;
+        cdf[i] = c;
+    }
+    
+    /* log-normal, by Box-Muller */
+    for (i = 0; i < NOBJ; i++) {
+        u = 1 - next_unit(&r);
+        v = next_unit(&r);
+        x = exp(SIZE_MU + SIZE_SIGMA * sqrt(-2 * log(u)) *
+                cos(2 * M_PI * v));
+        sizes[i] = x < MIN_SIZE ? MIN_SIZE :
+                   x > MAX_SIZE ? MAX_SIZE : (size_t) x;
+    }
+}
+
+/*
+ * An object drawn by the Zipf law.
+ */
+static int zipf(trace_t *t) {
+    double u = next_unit(&t->rand);
+    int lo = 0;
+    int hi = NOBJ - 1;
+    int mid;
+    
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] < u) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Open the trace called name, from its start.
+ * Return 0 on success, -1 otherwise.
+ */
+static int open_trace(trace_t *t, char *name) {
+    static char *names[] = {NULL, "zipf", "scans", "loop", "big1hit"};
+    
+    t->fp = NULL;
+    t->gets = 0;
+    t->scan = 0;
+    for (t->kind = TRACE_BIG1HIT; t->kind > TRACE_FILE; t->kind--) {
+        if (!strcmp(name, names[t->kind])) {
+            break;
+        }
+    }
+    t->rand = SEED + t->kind;
+    if (t->kind == TRACE_FILE && (t->fp = fopen(name, "r")) == NULL) {
+        perror("Open trace - fopen");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the next get of a trace: the key, of at most
+ * SIM_LINE - 1 bytes, and the object size.
+ * Return 0 on success, -1 at the end of the trace.
+ */
+static int next_get(trace_t *t, char *key, size_t *size) {
+    char line[SIM_LINE];
+    unsigned long n;
+    int o;
+    
+    if (t->kind == TRACE_FILE) {
+        while (fgets(line, SIM_LINE, t->fp)) {
+            if (sscanf(line, "%s %lu", key, &n) == 2) {
+                *size = n;
+                return 0;
+            }
+        }
+        return -1;
+    }
+    
+    switch (t->kind) {
+    case TRACE_SCANS:
+        o = (t->gets / SCAN_BLOCK) % 5 == 4 ? -1 : zipf(t);
+        break;
+    case TRACE_LOOP:
+        o = next_rand(&t->rand) % 2 ? zipf(t) : (int) (t->gets % LOOP_OBJS);
+        break;
+    case TRACE_BIG1HIT:
+        o = next_rand(&t->rand) % 10 == 0 ? -1 : zipf(t);
+        break;
+    default:
+        o = zipf(t);
+    }
+    t->gets++;
+    
+    if (o >= 0) {
+        sprintf(key, "http://host%d.example.com/obj/%d", o % 50, o);
+        *size = sizes[o];
+    }
+    else {
+        sprintf(key, "http://crawl.example.com/%ld", t->scan++);
+        *size = t->kind == TRACE_BIG1HIT ?
+                102400 + next_rand(&t->rand) % 307200 :
+                2048 + next_rand(&t->rand) % 20480;
+    }
+    return 0;
+}
+
+/*
+ * The policy given to init_cache for a name of -p, -1 if
+ * there is none. Suffixes: +admit for CACHE_ADMIT, and
+ * -bytes for CACHE_BYTES, after gdsf only.
+ */
+static int sim_policy(char *name) {
+    char base[SIM_LINE];
+    size_t len;
+    int flags = 0;
+    int policy;
+    
+    if (strlen(name) >= SIM_LINE) {
+        return -1;
+    }
+    strcpy(base, name);
+    while ((len = strlen(base)) > SUFFIX_LEN) {
+        if (!strcmp(base + len - SUFFIX_LEN, "+admit")) {
+            flags |= CACHE_ADMIT;
+        }
+        else if (!strcmp(base + len - SUFFIX_LEN, "-bytes")) {
+            flags |= CACHE_BYTES;
+        }
+        else {
+            break;
+        }
+        base[len - SUFFIX_LEN] = '\0';
+    }
+    if ((policy = cache_policy(base)) < 0 ||
+        ((flags & CACHE_BYTES) && policy != CACHE_GDSF)) {
+        return -1;
+    }
+    return policy | flags;
+}
+
+/*
+ * qsort comparison of body pointers.
+ */
+static int cmp_body(const void *a, const void *b) {
+    c_body_t *x = *(c_body_t **) a;
+    c_body_t *y = *(c_body_t **) b;
+    
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Check the invariants of the policy of shard i of *csh,
+ * out of its entries.
+ * Return the number of invariants broken.
+ */
+static int check_policy(cache_t *csh, int i, int entries) {
+    c_shard_t *sh = &csh->shards[i];
+    int broken = 0;
+    int j;
+    
+    switch (csh->policy) {
+    case CACHE_LRU:
+    case CACHE_CLOCK:
+        /* a single queue */
+        for (j = 1; j < CACHE_QUEUES; j++) {
+            broken += sh->queues[j].head->lru_next != sh->queues[j].tail;
+        }
+        break;
+    case CACHE_ARC:
+        broken += sh->target > sh->cap;
+        break;
+    case CACHE_GDSF:
+        /* a heap of every entry, the lowest priority first */
+        broken += sh->heaplen != entries;
+        for (j = 0; j < sh->heaplen; j++) {
+            broken += sh->heap[j]->heap != j;
+            broken += j > 0 && sh->heap[(j - 1) / 2]->prio > sh->heap[j]->prio;
+        }
+        break;
+    }
+    return broken;
+}
+
+/*
+ * Check that the shards of *csh account for what they hold,
+ * as put and evict charge it: each queue the bytes of its
+ * entries, each shard their per-key parts and the bodies
+ * charged to it, each body once. And the invariants of the
+ * policy. The shard structs are in cache.h; no other thread
+ * is on the cache.
+ * Return the number of invariants broken.
+ */
+static int check_shards(cache_t *csh) {
+    c_body_t **bodies = NULL;
+    c_body_t **tmp;
+    size_t *charged;
+    size_t queued, total = 0;
+    c_shard_t *sh;
+    c_queue_t *q;
+    c_node_t *cur;
+    int n = 0, room = 0;
+    int entries;
+    int broken = 0;
+    int i, j;
+    
+    if ((charged = calloc(csh->nshards, sizeof(size_t))) == NULL) {
+        perror("Check shards - malloc");
+        return 1;
+    }
+    /* entries gone are freed, so only those left count */
+    epoch_barrier();
+    
+    for (i = 0; i < csh->nshards; i++) {
+        sh = &csh->shards[i];
+        entries = 0;
+        for (j = 0; j < CACHE_QUEUES; j++) {
+            q = &sh->queues[j];
+            queued = 0;
+            for (cur = q->head->lru_next; cur != q->tail; 
+                 cur = cur->lru_next) {
+                queued += cur->size + (cur->body ? cur->body->size : 0);
+                charged[i] += cur->size;
+                entries++;
+                if (!cur->body) {
+                    continue;
+                }
+                if (n == room) {
+                    room = room ? 2 * room : 1024;
+                    if ((tmp = realloc(bodies, room * sizeof(c_body_t *))) 
+                        == NULL) {
+                        perror("Check shards - malloc");
+                        free(bodies);
+                        free(charged);
+                        return broken + 1;
+                    }
+                    bodies = tmp;
+                }
+                bodies[n++] = cur->body;
+            }
+            broken += queued != q->size;
+        }
+        broken += check_policy(csh, i, entries);
+    }
+    
+    /* each body once, to its shard, shared by all its entries */
+    qsort(bodies, n, sizeof(c_body_t *), cmp_body);
+    for (i = 0; i < n; i = j) {
+        j = i + 1;
+        while (j < n && bodies[j] == bodies[i]) {
+            j++;
+        }
+        broken += bodies[i]->refcnt != j - i;
+        if (bodies[i]->shard < 0 || bodies[i]->shard >= csh->nshards) {
+            broken++;
+            continue;
+        }
+        charged[bodies[i]->shard] += bodies[i]->size;
+    }
+    for (i = 0; i < csh->nshards; i++) {
+        broken += charged[i] != csh->shards[i].size;
+        total += charged[i];
+    }
+    broken += total != cache_size(csh);
+    
+    free(bodies);
+    free(charged);
+    return broken;
+}
+
+/*
+ * Replay at most gets gets of the trace called name against
+ * a new cache, into *res. If checking, check the cache
+ * along the way.
+ * Return 0 on success, -1 otherwise.
+ */
+static int replay(char *name, char *pname, int policy, size_t cap,
+                  int shards, long gets, sim_res_t *out) {
+    char key[SIM_LINE];
+    double hitbytes = 0;
+    double bytes = 0;
+    long hits = 0;
+    long over = 0;              /* puts leaving the cache over cap */
+    long lost = 0;              /* puts leaving the object out */
+    long broken = 0;            /* invariants broken in shards */
+    long n;
+    unsigned long h;
+    size_t size, hdr, len;
+    cache_t *csh;
+    c_res_t *res;
+    char *val;
+    trace_t t;
+    
+    if (open_trace(&t, name) < 0) {
+        return -1;
+    }
+    if ((csh = init_cache(cap, shards, policy)) == NULL) {
+        if (t.fp) {
+            fclose(t.fp);
+        }
+        return -1;
+    }
+    
+    for (n = 0; n < gets && next_get(&t, key, &size) == 0; n++) {
+        if (checking && n % CHECK_EVERY == CHECK_EVERY - 1) {
+            broken += check_shards(csh);
+        }
+        h = cache_hash(key);
+        bytes += size;
+        if ((res = get_hashed(csh, key, h))) {
+            hits++;
+            hitbytes += size;
+            cache_release(res);
+            continue;
+        }
+    
+        /* the key in the body too, so no two bodies are alike */
+        if ((val = (char *) calloc(1, size ? size : 1)) == NULL) {
+            perror("Replay - malloc");
+            break;
+        }
+        hdr = size < SIM_HDR ? size : SIM_HDR;
+        len = strlen(key);
+        memcpy(val, key, len < hdr ? len : hdr);
+        if (size > SIM_HDR) {
+            memcpy(val + SIM_HDR, key, 
+                   len < size - SIM_HDR ? len : size - SIM_HDR);
+        }
+        if (put_hashed(csh, key, h, val, size, hdr) < 0) {
+            free(val);
+        }
+        else if (checking) {
+            over += cache_size(csh) > cap;
+            lost += cache_contains(csh, key, h) != 1;
+        }
+    }
+    
+    if (checking) {
+        broken += check_shards(csh);
+        if (over || lost || broken) {
+            fprintf(stderr, "%s on %s: %ld puts over the capacity, "
+                    "%ld puts lost, %ld invariants broken\n",
+                    pname, name, over, lost, broken);
+        }
+        CHECK(over == 0 && lost == 0 && broken == 0);
+    }
+    out->gets = n;
+    out->hits = n ? (double) hits / n : 0;
+    out->bytes = bytes ? hitbytes / bytes : 0;
+    free_cache(csh);
+    if (t.fp) {
+        fclose(t.fp);
+    }
+    return 0;
+}
+
+/*
+ * Print the outcome of a replay.
+ */
+static void print_res(char *pname, sim_res_t *res) {
+    printf("%-18s %10ld %8.3f %8.3f\n", pname, res->gets, res->hits,
+           res->bytes);
+    fflush(stdout);
+}
+
+/*
+ * The outcome of the policy named pname on CHECK_GETS gets
+ * of the trace, replayed once. NULL on errors.
+ */
+static sim_res_t *run_of(char *trace, char *pname) {
+    run_t *run;
+    int policy;
+    int i;
+    
+    for (i = 0; i < nruns; i++) {
+        if (!strcmp(runs[i].trace, trace) && !strcmp(runs[i].pname, pname)) {
+            return &runs[i].res;
+        }
+    }
+    if (nruns == MAX_RUNS || (policy = sim_policy(pname)) < 0) {
+        return NULL;
+    }
+    run = &runs[nruns];
+    if (replay(trace, pname, policy, (size_t) SIM_CAP << 20, CACHE_SHARDS,
+               CHECK_GETS, &run->res) < 0) {
+        return NULL;
+    }
+    run->trace = trace;
+    run->pname = pname;
+    nruns++;
+    printf("%-8s ", trace);
+    print_res(pname, &run->res);
+    return &run->res;
+}
+
+/*
+ * Check the policies of orders, and each ordering.
+ * Return the exit status.
+ */
+static int check_orders(void) {
+    sim_res_t *better, *worse;
+    double b, w;
+    int i;
+    
+    printf("%-8s %-18s %10s %8s %8s\n", "trace", "policy", "gets", "hits",
+           "bytes");
+    for (i = 0; i < (int) (sizeof(orders) / sizeof(orders[0])); i++) {
+        better = run_of(orders[i].trace, orders[i].better);
+        worse = run_of(orders[i].trace, orders[i].worse);
+        CHECK(better != NULL && worse != NULL);
+        if (better == NULL || worse == NULL) {
+            continue;
+        }
+        b = orders[i].bytes ? better->bytes : better->hits;
+        w = orders[i].bytes ? worse->bytes : worse->hits;
+        if (b < w + orders[i].margin) {
+            fprintf(stderr, "%s: %s %s hit ratio %.3f, not %.3f over "
+                    "%s %.3f\n", orders[i].trace, orders[i].better,
+                    orders[i].bytes ? "byte" : "object", b,
+                    orders[i].margin, orders[i].worse, w);
+        }
+        CHECK(b >= w + orders[i].margin);
+    }
+    return check_done("cachesim");
+}
+
+int main(int argc, char **argv)
+{
+    char *policies = SIM_POLICIES;
+    long cap = SIM_CAP;
+    int shards = CACHE_SHARDS;
+    long gets = SIM_GETS;
+    sim_res_t res;
+    char *pname;
+    int policy;
+    int c;
+    
+    while ((c = getopt(argc, argv, "c:s:n:p:t")) != -1) {
+        switch (c) {
+        case 'c':
+            cap = atol(optarg);
+            break;
+        case 's':
+            shards = atoi(optarg);
+            break;
+        case 'n':
+            gets = atol(optarg);
+            break;
+        case 'p':
+            policies = optarg;
+            break;
+        case 't':
+            checking = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (checking) {
+        make_objects();
+        return check_orders();
+    }
+    if (optind >= argc || cap <= 0 || shards <= 0 || gets <= 0) {
+        usage();
+    }
+    
+    make_objects();
+    printf("%s, %ld MB, %d shards\n", argv[optind], cap, shards);
+    printf("%-18s %10s %8s %8s\n", "policy", "gets", "hits", "bytes");
+    for (pname = strtok(strdup(policies), ","); pname;
+         pname = strtok(NULL, ",")) {
+        if ((policy = sim_policy(pname)) < 0) {
+            fprintf(stderr, "Unknown policy: %s\n", pname);
+            continue;
+        }
+        if (replay(argv[optind], pname, policy, (size_t) cap << 20, shards,
+                   gets, &res) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        print_res(pname, &res);
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+/**
+ * Checks for the test programs: a check that does not hold
+ * is reported and counted, and the test goes on, so one run
+ * shows every failure. A test exits with EXIT_FAILURE if
+ * any check failed.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __CHECK_H__
+#define __CHECK_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Checks failed so far */
+static int check_failed = 0;
+
+/*
+ * Report and count cond if it does not hold.
+ */
+#define CHECK(cond) do {                                            \
+    if (!(cond)) {                                                  \
+        fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                __FILE__, __LINE__, #cond);                         \
+        check_failed++;                                             \
+    }                                                               \
+} while (0)
+
+/*
+ * Print the outcome of the test called name.
+ * Return its exit status.
+ */
+static inline int check_done(char *name) {
+    if (check_failed) {
+        printf("%s: %d checks failed\n", name, check_failed);
+        return EXIT_FAILURE;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+#endif /* __CHECK_H__ */
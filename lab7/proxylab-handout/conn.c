@@ -0,0 +1,253 @@
+/**
+ * This file implements connecting to the real servers
+ * the "happy eyeballs" way (RFC 8305).
+ * 
+ * Instead of trying the resolved addresses one by one
+ * with blocking connects, all addresses are raced with
+ * non-blocking connects:
+ *      1. Addresses are ordered so that IPv6 and IPv4
+ *          alternate, starting with the preferred family;
+ *      2. The first attempt is started right away, and every
+ *          stagger delay another one joins the race, or
+ *          immediately when a pending attempt fails;
+ *      3. The first attempt that completes wins, the others
+ *          are abandoned;
+ *      4. Nothing is left racing once the overall timeout
+ *          expires.
+ * 
+ * So a dead address costs a stagger delay instead of
+ * the kernel's full SYN retry period.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "conn.h"
+#include "debug.h"
+#include "util.h"
+
+#define CONN_MAX_ADDRS 16       /* max number of addresses raced */
+
+/*
+ * Set or clear O_NONBLOCK on a fd.
+ */
+static int set_nonblock(int fd, int on) {
+    int flags;
+    
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0) {
+        return -1;
+    }
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/*
+ * Order the addresses in listp into addrs so that the
+ * address families alternate, starting with the family
+ * of the first address returned by the resolver.
+ * Return the number of addresses put into addrs.
+ */
+static int interleave(struct addrinfo *listp, struct addrinfo **addrs) {
+    struct addrinfo *first[CONN_MAX_ADDRS];    /* preferred family */
+    struct addrinfo *second[CONN_MAX_ADDRS];   /* the other families */
+    struct addrinfo *p;
+    int nfirst = 0;
+    int nsecond = 0;
+    int n = 0;
+    int i;
+    
+    for (p = listp; p; p = p->ai_next) {
+        if (p->ai_family == listp->ai_family) {
+            if (nfirst < CONN_MAX_ADDRS) {
+                first[nfirst++] = p;
+            }
+        }
+        else if (nsecond < CONN_MAX_ADDRS) {
+            second[nsecond++] = p;
+        }
+    }
+    
+    for (i = 0; n < CONN_MAX_ADDRS && (i < nfirst || i < nsecond); i++) {
+        if (i < nfirst) {
+            addrs[n++] = first[i];
+        }
+        if (i < nsecond && n < CONN_MAX_ADDRS) {
+            addrs[n++] = second[i];
+        }
+    }
+    return n;
+}
+
+/*
+ * Start a non-blocking connect to the address.
+ * Return the fd, or -1 if the attempt failed at once.
+ * *done is set if the connect completed immediately.
+ */
+static int start_connect(struct addrinfo *p, int *done) {
+    int fd;
+    
+    *done = 0;
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+        return -1;
+    }
+    if (set_nonblock(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+        *done = 1;
+        return fd;
+    }
+    if (errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Open a connection to hostname:port, racing all the
+ * resolved addresses as described above.
+ * Return a blocking connected fd, -2 if the name can't be
+ * resolved, or -1 if no address connected in time
+ * (errno is ETIMEDOUT if the deadline expired).
+ */
+int open_originfd(char *hostname, char *port, conn_opt_t *opt) {
+    struct addrinfo hints;
+    struct addrinfo *listp;
+    int fd;
+    int err;
+    
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(hostname, port, &hints, &listp) != 0) {
+        return -2;
+    }
+    dbg_printf("Connecting %s:%s\n", hostname, port);
+    fd = conn_race(listp, opt);
+    err = errno;
+    freeaddrinfo(listp);
+    errno = err;
+    return fd;
+}
+
+/*
+ * Race the addresses of listp, as resolved for a name.
+ * Return a blocking connected fd, or -1 if no address
+ * connected in time (errno is ETIMEDOUT if the deadline
+ * expired).
+ */
+int conn_race(struct addrinfo *listp, conn_opt_t *opt) {
+    struct addrinfo *addrs[CONN_MAX_ADDRS];
+    struct pollfd pfds[CONN_MAX_ADDRS];
+    int naddr;                  /* number of addresses to race */
+    int next = 0;               /* next address to try */
+    int npending = 0;           /* attempts in flight */
+    int winner = -1;            /* the connected fd */
+    int lasterr = ECONNREFUSED; /* reported when everything fails */
+    long start;
+    long now;
+    long next_at;               /* when the next attempt may start */
+    int wait;
+    int done;
+    int fd;
+    int err;
+    socklen_t errlen;
+    int i;
+    
+    naddr = interleave(listp, addrs);
+    
+    start = now_ms();
+    next_at = start;
+    while (winner < 0) {
+        now = now_ms();
+        if (now - start >= opt->timeout_ms) {
+            lasterr = ETIMEDOUT;
+            break;
+        }
+        
+        /* let the next address join the race */
+        if (next < naddr && (npending == 0 || now >= next_at)) {
+            dbg_printf("Connect attempt %d\n", next);
+            if ((fd = start_connect(addrs[next++], &done)) < 0) {
+                lasterr = errno;
+                continue;
+            }
+            if (done) {
+                winner = fd;
+                break;
+            }
+            pfds[npending].fd = fd;
+            pfds[npending].events = POLLOUT;
+            pfds[npending].revents = 0;
+            npending++;
+            next_at = now + opt->stagger_ms;
+            continue;
+        }
+        
+        /* every address failed */
+        if (npending == 0) {
+            break;
+        }
+        
+        /* wait for an attempt to finish, the stagger, or the deadline */
+        wait = (int)(start + opt->timeout_ms - now);
+        if (next < naddr && next_at - now < wait) {
+            wait = (int)(next_at - now);
+        }
+        if (poll(pfds, npending, wait) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            lasterr = errno;
+            break;
+        }
+        
+        for (i = 0; i < npending; i++) {
+            if (!pfds[i].revents) {
+                continue;
+            }
+            errlen = sizeof(err);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+                err = errno;
+            }
+            if (err == 0) {
+                winner = pfds[i].fd;
+                pfds[i] = pfds[--npending];
+                break;
+            }
+            
+            /* failed, so the next address needn't wait */
+            lasterr = err;
+            close(pfds[i].fd);
+            pfds[i--] = pfds[--npending];
+            next_at = now;
+        }
+    }
+    
+    /* abandon the losers */
+    for (i = 0; i < npending; i++) {
+        close(pfds[i].fd);
+    }
+    
+    if (winner < 0) {
+        errno = lasterr;
+        return -1;
+    }
+    if (set_nonblock(winner, 0) < 0) {
+        close(winner);
+        return -1;
+    }
+    return winner;
+}
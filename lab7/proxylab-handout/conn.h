@@ -0,0 +1,26 @@
+/**
+ * Header file for conn.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __CONN_H__
+#define __CONN_H__
+
+/* Default connect tunables, in milliseconds */
+#define CONN_TIMEOUT_MS 3000    /* give up on the origin after this */
+#define CONN_STAGGER_MS 250     /* head start of one attempt over the next */
+
+/* The connect options struct */
+typedef struct {
+    int timeout_ms;             /* overall deadline for connecting */
+    int stagger_ms;             /* delay before racing the next address */
+} conn_opt_t;
+
+struct addrinfo;
+
+int open_originfd(char *, char *, conn_opt_t *);
+int conn_race(struct addrinfo *, conn_opt_t *);
+
+#endif /* __CONN_H__ */
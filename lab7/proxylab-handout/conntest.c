@@ -0,0 +1,232 @@
+/**
+ * This file tests racing origin addresses (conn.c) on the
+ * loopback interface. Address lists are built by hand, so
+ * each race mixes the kinds of addresses it needs:
+ *      live: a listener accepting connections;
+ *      refused: a port bound but not listening;
+ *      stalled: a listener whose accept queue is full, so
+ *          the kernel drops new SYNs and connects hang.
+ *
+ * Usage: conntest
+ *
+ *
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "conn.h"
+#include "util.h"
+#include "check.h"
+
+#define MAX_FILL 64             /* most connects filling an accept queue */
+#define FILL_WAIT_MS 100        /* a connect not done by then hangs */
+#define MAX_RACE 3              /* most addresses of a race */
+
+/* A loopback endpoint of the tests */
+typedef struct {
+    int fd;                     /* its socket */
+    struct sockaddr_storage addr;   /* its address */
+    struct addrinfo ai;         /* the address, as resolved */
+} end_t;
+
+/*************************
+ * Start global variables
+ *************************/
+/* Connects filling the accept queue of the stalled listener */
+static int fill[MAX_FILL];
+static int nfill = 0;
+/*************************
+ * End global variables
+ *************************/
+
+/*
+ * Open an endpoint on the loopback address of family,
+ * listening with backlog unless it is negative.
+ * Return 0 on success, -1 otherwise.
+ */
+static int open_end(end_t *e, int family, int backlog) {
+    socklen_t len = family == AF_INET ? sizeof(struct sockaddr_in) :
+                                        sizeof(struct sockaddr_in6);
+    
+    memset(e, 0, sizeof(end_t));
+    e->addr.ss_family = family;
+    if (family == AF_INET) {
+        ((struct sockaddr_in *) &e->addr)->sin_addr.s_addr =
+            htonl(INADDR_LOOPBACK);
+    }
+    else {
+        ((struct sockaddr_in6 *) &e->addr)->sin6_addr = in6addr_loopback;
+    }
+    if ((e->fd = socket(family, SOCK_STREAM, 0)) < 0 ||
+        bind(e->fd, (struct sockaddr *) &e->addr, len) < 0 ||
+        (backlog >= 0 && listen(e->fd, backlog) < 0) ||
+        getsockname(e->fd, (struct sockaddr *) &e->addr, &len) < 0) {
+        perror("Open endpoint");
+        return -1;
+    }
+    e->ai.ai_family = family;
+    e->ai.ai_socktype = SOCK_STREAM;
+    e->ai.ai_addr = (struct sockaddr *) &e->addr;
+    e->ai.ai_addrlen = len;
+    return 0;
+}
+
+/*
+ * Fill the accept queue of the listener *e, never accepting.
+ * Return 0 once a connect to it hangs, -1 otherwise.
+ */
+static int stall(end_t *e) {
+    struct pollfd pfd;
+    
+    while (nfill < MAX_FILL) {
+        if ((pfd.fd = socket(e->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK,
+                             0)) < 0) {
+            return -1;
+        }
+        fill[nfill++] = pfd.fd;
+        if (connect(pfd.fd, e->ai.ai_addr, e->ai.ai_addrlen) == 0) {
+            continue;
+        }
+        if (errno != EINPROGRESS) {
+            return -1;
+        }
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, FILL_WAIT_MS) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Chain copies of the addresses of n endpoints into list,
+ * as resolved, so an endpoint can be in it more than once.
+ */
+static struct addrinfo *chain(end_t **ends, int n, struct addrinfo *list) {
+    int i;
+    
+    for (i = 0; i < n; i++) {
+        list[i] = ends[i]->ai;
+        list[i].ai_next = i + 1 < n ? &list[i + 1] : NULL;
+    }
+    return list;
+}
+
+/*
+ * Whether fd is connected to the endpoint *e.
+ */
+static int connected_to(int fd, end_t *e) {
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    
+    if (getpeername(fd, (struct sockaddr *) &peer, &len) < 0 ||
+        peer.ss_family != e->addr.ss_family) {
+        return 0;
+    }
+    if (peer.ss_family == AF_INET) {
+        return ((struct sockaddr_in *) &peer)->sin_port ==
+               ((struct sockaddr_in *) &e->addr)->sin_port;
+    }
+    return ((struct sockaddr_in6 *) &peer)->sin6_port ==
+           ((struct sockaddr_in6 *) &e->addr)->sin6_port;
+}
+
+/*
+ * Race the n endpoints of ends with the given stagger and
+ * timeout, in ms. Return what conn_race returned, the time
+ * it took in *took and its errno in *err.
+ */
+static int race(end_t **ends, int n, int stagger, int timeout,
+                long *took, int *err) {
+    struct addrinfo list[MAX_RACE];
+    conn_opt_t opt;
+    long start = now_ms();
+    int fd;
+    
+    opt.stagger_ms = stagger;
+    opt.timeout_ms = timeout;
+    fd = conn_race(chain(ends, n, list), &opt);
+    *err = errno;
+    *took = now_ms() - start;
+    return fd;
+}
+
+int main(void)
+{
+    end_t live, refused, stalled, live6;
+    end_t *ends[MAX_RACE];
+    conn_opt_t opt = {CONN_TIMEOUT_MS, CONN_STAGGER_MS};
+    char port[8];
+    long took;
+    int fd, err;
+    
+    if (open_end(&live, AF_INET, 16) < 0 ||
+        open_end(&refused, AF_INET, -1) < 0 ||
+        open_end(&stalled, AF_INET, 0) < 0 ||
+        open_end(&live6, AF_INET6, 16) < 0) {
+        return EXIT_FAILURE;
+    }
+    if (stall(&stalled) < 0) {
+        fprintf(stderr, "Could not fill an accept queue\n");
+        return EXIT_FAILURE;
+    }
+    
+    /* a hanging address lets the next one in after the stagger */
+    ends[0] = &stalled;
+    ends[1] = &live;
+    fd = race(ends, 2, 200, 3000, &took, &err);
+    CHECK(fd >= 0 && connected_to(fd, &live));
+    CHECK(took >= 150 && took < 1500);
+    /* and the winner is handed out blocking */
+    CHECK(fd >= 0 && !(fcntl(fd, F_GETFL, 0) & O_NONBLOCK));
+    close(fd);
+    
+    /* a refused address lets the next one in at once */
+    ends[0] = &refused;
+    ends[1] = &live;
+    fd = race(ends, 2, 2000, 3000, &took, &err);
+    CHECK(fd >= 0 && connected_to(fd, &live));
+    CHECK(took < 1000);
+    close(fd);
+    
+    /* nothing connects before the deadline */
+    ends[0] = &stalled;
+    ends[1] = &stalled;
+    fd = race(ends, 2, 100, 300, &took, &err);
+    CHECK(fd == -1 && err == ETIMEDOUT);
+    CHECK(took >= 250 && took < 2000);
+    
+    /* nothing connects at all, no waiting for the deadline */
+    ends[0] = &refused;
+    ends[1] = &refused;
+    fd = race(ends, 2, 1000, 3000, &took, &err);
+    CHECK(fd == -1 && err == ECONNREFUSED);
+    CHECK(took < 1000);
+    
+    /* families alternate: the IPv6 address goes second, not third */
+    ends[0] = &stalled;
+    ends[1] = &stalled;
+    ends[2] = &live6;
+    fd = race(ends, 3, 300, 3000, &took, &err);
+    CHECK(fd >= 0 && connected_to(fd, &live6));
+    CHECK(took >= 250 && took < 500);
+    close(fd);
+    
+    /* through the resolver */
+    CHECK(open_originfd("localhost", "notaport", &opt) == -2);
+    sprintf(port, "%d", ntohs(((struct sockaddr_in *) &live.addr)->sin_port));
+    fd = open_originfd("127.0.0.1", port, &opt);
+    CHECK(fd >= 0 && connected_to(fd, &live));
+    close(fd);
+    
+    return check_done("conntest");
+}
@@ -0,0 +1,269 @@
+/**
+ * This file implements epoch based reclamation.
+ * 
+ * Readers walk shared structures without locks, between
+ * epoch_enter and epoch_exit. Writers unlink objects as usual
+ * but hand them to epoch_retire instead of freeing them.
+ * 
+ * There is a global epoch. A reader entering records the
+ * epoch it saw; the epoch only moves on once every reader
+ * inside has seen the current one. An object retired in
+ * epoch e is unreachable to readers entering after that, and
+ * those inside when it was retired are gone by epoch e + 2,
+ * so it is freed then. Retired objects wait in one of three
+ * bags, by epoch modulo three.
+ * 
+ * Reading costs a store to the thread's own record and a
+ * fence, no shared line is written. Retiring takes a lock,
+ * but writers are serialized anyway. The epoch is moved on
+ * every EPOCH_BATCH retirements, or sooner once EPOCH_BYTES
+ * are retired, so a few large objects don't wait long; the
+ * bytes waiting are told by epoch_pending, for caches to
+ * count them against their capacity.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "epoch.h"
+
+/*************************
+ * Start global variables
+ *************************/
+/* The global epoch */
+static unsigned long epoch = 0;
+/* Records of the reading threads */
+static e_rec_t *recs = NULL;
+/* The record of this thread */
+static __thread e_rec_t *self = NULL;
+/* Gives the record back on thread exit */
+static pthread_key_t reckey;
+static pthread_once_t reckey_once = PTHREAD_ONCE_INIT;
+/* Retired objects by epoch, guarded by bag_lock */
+static e_retired_t *bags[EPOCH_BAGS];
+static unsigned retired = 0;
+static size_t since = 0;        /* bytes retired since the last advance */
+static size_t pending = 0;      /* bytes retired, not freed yet */
+static pthread_mutex_t bag_lock = PTHREAD_MUTEX_INITIALIZER;
+/*************************
+ * End global variables
+ *************************/
+
+/*
+ * Give a record back for another thread to take.
+ */
+static void release_rec(void *arg) {
+    e_rec_t *rec = (e_rec_t *) arg;
+    __atomic_store_n(&rec->active, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->used, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Create the key for giving records back.
+ */
+static void make_reckey(void) {
+    pthread_key_create(&reckey, release_rec);
+}
+
+/*
+ * Find the record of this thread, taking an unused one
+ * or adding one on first use. NULL if out of memory.
+ */
+static e_rec_t *get_rec(void) {
+    e_rec_t *rec;
+    int unused;
+    
+    if (self) {
+        return self;
+    }
+    pthread_once(&reckey_once, make_reckey);
+    
+    for (rec = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        unused = 0;
+        if (__atomic_compare_exchange_n(&rec->used, &unused, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!rec) {
+        if ((rec = (e_rec_t *) calloc(1, sizeof(e_rec_t))) == NULL) {
+            perror("Epoch record - malloc");
+            return NULL;
+        }
+        rec->used = 1;
+        rec->next = __atomic_load_n(&recs, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&recs, &rec->next, rec, 0,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+            ;
+        }
+    }
+    pthread_setspecific(reckey, rec);
+    self = rec;
+    return rec;
+}
+
+/*
+ * Free the objects of a bag.
+ */
+static void free_bag(e_retired_t *r) {
+    e_retired_t *next;
+    
+    while (r) {
+        next = r->next;
+        __atomic_sub_fetch(&pending, r->bytes, __ATOMIC_RELAXED);
+        r->fn(r->ptr);
+        free(r);
+        r = next;
+    }
+}
+
+/*
+ * Move the global epoch on if every reader inside has
+ * seen it. Must be called with the bag lock held.
+ * Return the objects that became free, to be freed
+ * once the lock is released.
+ */
+static e_retired_t *try_advance(void) {
+    unsigned long e = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+    e_retired_t *freed;
+    e_rec_t *rec;
+    
+    for (rec = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+        if (__atomic_load_n(&rec->active, __ATOMIC_SEQ_CST) &&
+            __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST) != e) {
+            return NULL;
+        }
+    }
+    __atomic_store_n(&epoch, e + 1, __ATOMIC_SEQ_CST);
+    since = 0;
+    
+    /* retired two epochs ago */
+    freed = bags[(e + 1) % EPOCH_BAGS];
+    bags[(e + 1) % EPOCH_BAGS] = NULL;
+    return freed;
+}
+
+/*
+ * Start reading shared objects. Those retired meanwhile
+ * are not freed until the matching epoch_exit.
+ */
+void epoch_enter(void) {
+    e_rec_t *rec = get_rec();
+    
+    if (!rec || rec->depth++ > 0) {
+        return;
+    }
+    __atomic_store_n(&rec->epoch, __atomic_load_n(&epoch, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->active, 1, __ATOMIC_RELAXED);
+    /* be seen as inside before reading anything */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * Stop reading shared objects.
+ */
+void epoch_exit(void) {
+    e_rec_t *rec = self;
+    
+    if (!rec || --rec->depth > 0) {
+        return;
+    }
+    __atomic_store_n(&rec->active, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Have fn(ptr) called once no reader can see ptr any more,
+ * bytes being about the memory that frees.
+ * ptr must be unreachable to readers entering from now on.
+ * If out of memory, waits for the readers to leave instead.
+ */
+void epoch_retire(epoch_fn fn, void *ptr, size_t bytes) {
+    e_retired_t *r = (e_retired_t *) malloc(sizeof(e_retired_t));
+    e_retired_t *freed = NULL;
+    unsigned long start;
+    
+    pthread_mutex_lock(&bag_lock);
+    if (r) {
+        r->fn = fn;
+        r->ptr = ptr;
+        r->bytes = bytes;
+        __atomic_add_fetch(&pending, bytes, __ATOMIC_RELAXED);
+        /* the epoch only moves with the bag lock held */
+        r->next = bags[epoch % EPOCH_BAGS];
+        bags[epoch % EPOCH_BAGS] = r;
+        since += bytes;
+        /* tried again on each retirement until it moves */
+        if (++retired % EPOCH_BATCH == 0 || since >= EPOCH_BYTES) {
+            freed = try_advance();
+        }
+        pthread_mutex_unlock(&bag_lock);
+        free_bag(freed);
+        return;
+    }
+    
+    /* out of memory: free it after two advances, 
+     * writers are never inside a read section */
+    pthread_mutex_unlock(&bag_lock);
+    perror("Epoch retire - malloc");
+    start = __atomic_load_n(&epoch, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&epoch, __ATOMIC_RELAXED) - start < 2) {
+        pthread_mutex_lock(&bag_lock);
+        freed = try_advance();
+        pthread_mutex_unlock(&bag_lock);
+        free_bag(freed);
+        sched_yield();
+    }
+    fn(ptr);
+}
+
+/*
+ * Free everything retired so far, waiting for the readers
+ * inside to leave. Must not be called in a read section.
+ */
+void epoch_barrier(void) {
+    unsigned long start = __atomic_load_n(&epoch, __ATOMIC_RELAXED);
+    e_retired_t *freed;
+    
+    /* the bag of epoch e is freed on leaving epoch e + 2 */
+    while (__atomic_load_n(&epoch, __ATOMIC_RELAXED) - start < EPOCH_BAGS) {
+        pthread_mutex_lock(&bag_lock);
+        freed = try_advance();
+        pthread_mutex_unlock(&bag_lock);
+        free_bag(freed);
+        sched_yield();
+    }
+}
+
+/*
+ * Free what the readers inside let be freed now, moving
+ * the epoch on as far as it goes without waiting.
+ */
+void epoch_collect(void) {
+    e_retired_t *freed;
+    unsigned long e;
+    int moved = 1;
+    int i;
+    
+    for (i = 0; i < EPOCH_BAGS && moved; i++) {
+        pthread_mutex_lock(&bag_lock);
+        e = epoch;
+        freed = try_advance();
+        moved = epoch != e;
+        pthread_mutex_unlock(&bag_lock);
+        free_bag(freed);
+    }
+}
+
+/*
+ * Bytes retired and not freed yet.
+ */
+size_t epoch_pending(void) {
+    return __atomic_load_n(&pending, __ATOMIC_RELAXED);
+}
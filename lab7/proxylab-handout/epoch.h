@@ -0,0 +1,44 @@
+/**
+ * Header file for epoch.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include <stddef.h>
+
+#define EPOCH_BAGS 3            /* retired objects by epoch, modulo */
+#define EPOCH_BATCH 64          /* retirements between advance tries */
+#define EPOCH_BYTES (64 << 10)  /* or bytes retired between them */
+
+/* Function freeing a retired object */
+typedef void (*epoch_fn)(void *);
+
+/* The retired object struct */
+typedef struct e_retired {
+    struct e_retired *next;     /* next in the bag */
+    epoch_fn fn;                /* frees it */
+    void *ptr;                  /* the object */
+    size_t bytes;               /* memory it holds */
+} e_retired_t;
+
+/* The thread record struct, one per thread ever reading */
+typedef struct e_rec {
+    struct e_rec *next;         /* next record, never unlinked */
+    unsigned long epoch;        /* global epoch seen on entering */
+    int active;                 /* in a read section */
+    int depth;                  /* nested read sections */
+    int used;                   /* owned by a live thread */
+} e_rec_t;
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(epoch_fn, void *, size_t);
+void epoch_barrier(void);
+void epoch_collect(void);
+size_t epoch_pending(void);
+
+#endif /* __EPOCH_H__ */
@@ -0,0 +1,327 @@
+/**
+ * This file implements handing a running proxy over to
+ * a new process without dropping connections.
+ * 
+ * The old process listens on a Unix socket. The new process
+ * connects to it and receives:
+ *      1. The listening socket, passed with SCM_RIGHTS, so
+ *          connections queue up in the kernel instead of
+ *          being refused while the processes switch;
+ *      2. A snapshot of the cache, as a stream of records
+ *          [key length][head size][body size][key][head][body],
+ *          ended by a record with key length 0.
+ * The old process then drains, and the new one serves.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <stdint.h>
+#include <sys/un.h>
+#include "csapp.h"
+#include "handoff.h"
+#include "debug.h"
+
+#define HANDOFF_MAX_KEY 65536   /* sanity limit on received keys */
+#define SNAP_MIN 1024           /* first room for snapshot entries */
+
+/* Record header of the cache snapshot */
+typedef struct {
+    uint32_t keylen;            /* key length, 0 ends the snapshot */
+    uint32_t size;              /* size of the per-key part */
+    uint32_t bodysize;          /* size of the body */
+} rec_hdr_t;
+
+/* A cache entry pinned for the snapshot */
+typedef struct {
+    char *key;                  /* its key, valid while pinned */
+    c_res_t *res;               /* the pinned result */
+} snap_ent_t;
+
+/* The cache snapshot, taken before sending any of it */
+typedef struct {
+    snap_ent_t *ents;           /* the pinned entries */
+    int n;                      /* entries taken */
+    int cap;                    /* room in ents */
+} snap_t;
+
+/*
+ * Fill in a Unix socket address.
+ */
+static int unix_addr(char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/*
+ * Listen for a successor on the Unix socket at path,
+ * replacing whatever was there.
+ */
+int handoff_listen(char *path) {
+    struct sockaddr_un addr;
+    int fd;
+    
+    if (unix_addr(path, &addr) < 0) {
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (SA *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Connect to the predecessor listening at path.
+ * Return -1 if there is none.
+ */
+int handoff_connect(char *path) {
+    struct sockaddr_un addr;
+    int fd;
+    
+    if (unix_addr(path, &addr) < 0) {
+        return -1;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+    if (connect(fd, (SA *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Send one fd over a Unix socket.
+ */
+static int send_fd(int sockfd, int fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte = 'L';
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    
+    return sendmsg(sockfd, &msg, 0) == 1 ? 0 : -1;
+}
+
+/*
+ * Receive one fd over a Unix socket.
+ */
+static int recv_fd(int sockfd) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte;
+    int fd;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    
+    if (recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/*
+ * cache_walk callback pinning one entry into the snapshot,
+ * so it is written out once the shard is unlocked.
+ */
+static int hold_entry(char *key, c_res_t *res, void *arg) {
+    snap_t *snap = (snap_t *) arg;
+    snap_ent_t *ents;
+    int cap;
+    
+    if (snap->n == snap->cap) {
+        cap = snap->cap ? 2 * snap->cap : SNAP_MIN;
+        if ((ents = realloc(snap->ents, cap * sizeof(snap_ent_t))) == NULL) {
+            return -1;
+        }
+        snap->ents = ents;
+        snap->cap = cap;
+    }
+    if ((snap->ents[snap->n].res = cache_hold(res)) == NULL) {
+        return -1;
+    }
+    snap->ents[snap->n++].key = key;
+    return 0;
+}
+
+/*
+ * Write the snapshot record of one entry to fd.
+ */
+static int send_entry(int fd, char *key, c_res_t *res) {
+    rec_hdr_t hdr;
+    ssize_t n;
+    
+    hdr.keylen = strlen(key);
+    hdr.size = res->size;
+    hdr.bodysize = res->bodysize;
+    if (rio_writen(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        rio_writen(fd, key, hdr.keylen) != hdr.keylen ||
+        (n = rio_writen(fd, res->val, res->size)) < 0 || 
+        (size_t) n != res->size ||
+        (n = rio_writen(fd, res->body, res->bodysize)) < 0 || 
+        (size_t) n != res->bodysize) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hand listenfd and the contents of *csh over to the
+ * successor connected on sockfd.
+ * The entries are pinned during the walk and written after
+ * it, so a slow successor never stalls a shard lock.
+ */
+int handoff_send(int sockfd, int listenfd, cache_t *csh) {
+    rec_hdr_t end = {0, 0, 0};
+    snap_t snap = {NULL, 0, 0};
+    int rc = 0;
+    int i;
+    
+    if (send_fd(sockfd, listenfd) < 0) {
+        perror("Handoff - send listen fd");
+        return -1;
+    }
+    if (cache_walk(csh, hold_entry, &snap) != 0) {
+        perror("Handoff - snapshot cache");
+        rc = -1;
+    }
+    for (i = 0; i < snap.n && !rc; i++) {
+        if (send_entry(sockfd, snap.ents[i].key, snap.ents[i].res) < 0) {
+            perror("Handoff - send cache");
+            rc = -1;
+        }
+    }
+    for (i = 0; i < snap.n; i++) {
+        cache_release(snap.ents[i].res);
+    }
+    free(snap.ents);
+    
+    if (!rc && rio_writen(sockfd, &end, sizeof(end)) != sizeof(end)) {
+        perror("Handoff - end cache");
+        rc = -1;
+    }
+    return rc;
+}
+
+/*
+ * Read and drop n bytes from rp.
+ * Return 0 on success, -1 otherwise.
+ */
+static int skip_bytes(rio_t *rp, size_t n) {
+    char buf[MAXLINE];
+    size_t len;
+    
+    while (n > 0) {
+        len = n < MAXLINE ? n : MAXLINE;
+        if (rio_readnb(rp, buf, len) != len) {
+            return -1;
+        }
+        n -= len;
+    }
+    return 0;
+}
+
+/*
+ * Take over from the predecessor connected on sockfd,
+ * loading its cache snapshot into *csh.
+ * Return the inherited listen fd.
+ */
+int handoff_recv(int sockfd, cache_t *csh) {
+    rio_t rio;
+    rec_hdr_t hdr;
+    char *key;
+    void *val;
+    int listenfd;
+    int n = 0;
+    
+    if ((listenfd = recv_fd(sockfd)) < 0) {
+        perror("Handoff - receive listen fd");
+        return -1;
+    }
+    
+    rio_readinitb(&rio, sockfd);
+    while (rio_readnb(&rio, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.keylen) {
+        if (hdr.keylen > HANDOFF_MAX_KEY) {
+            break;
+        }
+        /* too big for this cache, as when it was given less room */
+        if ((size_t) hdr.size + hdr.bodysize > cache_max_entry(csh)) {
+            if (skip_bytes(&rio, (size_t) hdr.keylen + hdr.size + 
+                           hdr.bodysize) < 0) {
+                break;
+            }
+            continue;
+        }
+        key = malloc(hdr.keylen + 1);
+        val = malloc(hdr.size + hdr.bodysize);
+        if (!key || !val ||
+            rio_readnb(&rio, key, hdr.keylen) != hdr.keylen ||
+            rio_readnb(&rio, val, hdr.size + hdr.bodysize) != 
+            hdr.size + hdr.bodysize) {
+            free(key);
+            free(val);
+            break;
+        }
+        key[hdr.keylen] = '\0';
+        
+        /* a failed put just leaves the object out,
+         * shared bodies are deduplicated again by put */
+        if (put(csh, key, val, hdr.size + hdr.bodysize, hdr.size) < 0) {
+            free(val);
+        }
+        else {
+            n++;
+        }
+        free(key);
+    }
+    dbg_printf("Handoff - inherited %d cached objects\n", n);
+    return listenfd;
+}
@@ -0,0 +1,18 @@
+/**
+ * Header file for handoff.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include "cache.h"
+
+int handoff_listen(char *);
+int handoff_connect(char *);
+int handoff_send(int, int, cache_t *);
+int handoff_recv(int, cache_t *);
+
+#endif /* __HANDOFF_H__ */
@@ -0,0 +1,198 @@
+/**
+ * This file tests handing a cache over (handoff.c): a sender
+ * thread plays the old proxy, the main thread the new one,
+ * over a Unix socket. Each object is rebuilt from its index
+ * to check what arrived, byte for byte. Some objects share
+ * a body, some are too big for the small receiving cache.
+ *
+ * Usage: handofftest
+ *
+ *
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <sys/stat.h>
+#include "csapp.h"
+#include "handoff.h"
+#include "check.h"
+
+#define NOBJ 200                /* objects handed over */
+#define HEAD 16                 /* per-key part of each object */
+#define BIG 60000               /* size of every tenth object */
+#define SHARED 416              /* size of the objects sharing a body */
+#define ROOMY (4 << 20)         /* capacity of the roomy cache */
+#define SMALL (160 << 10)       /* capacity of the small cache */
+
+/*************************
+ * Start global variables
+ *************************/
+static cache_t *src;            /* the cache handed over */
+static char path[64];           /* the handoff socket */
+static int passfd;              /* the fd handed over */
+static int sent = 0;            /* handoffs the sender completed */
+/*************************
+ * End global variables
+ *************************/
+
+/*
+ * Whether object i is too big for the small cache.
+ */
+static int is_big(int i) {
+    return i % 10 == 0;
+}
+
+/*
+ * Whether object i shares its body with the others that do.
+ */
+static int is_shared(int i) {
+    return i % 7 == 3 && !is_big(i);
+}
+
+/*
+ * Size of object i.
+ */
+static size_t obj_size(int i) {
+    return is_big(i) ? BIG : is_shared(i) ? SHARED : 500 + i;
+}
+
+/*
+ * Build object i: a zeroed head naming it, then a body whose bytes
+ * follow from its index, or from 0 for shared bodies.
+ */
+static char *make_obj(int i) {
+    size_t n = obj_size(i);
+    int seed = is_shared(i) ? 0 : i;
+    char *obj = calloc(1, n);
+    size_t j;
+    
+    snprintf(obj, HEAD, "head %d", i);
+    for (j = HEAD; j < n; j++) {
+        obj[j] = (char) (seed * 131 + j * 7);
+    }
+    return obj;
+}
+
+/*
+ * The old proxy: hand src and passfd over to the next two
+ * successors, counting the handoffs that went through.
+ */
+static void *sender(void *vargp) {
+    int lfd = *(int *) vargp;
+    int fd;
+    int i;
+    
+    for (i = 0; i < 2; i++) {
+        if ((fd = accept(lfd, NULL, NULL)) < 0) {
+            perror("Sender - accept");
+            return NULL;
+        }
+        sent += handoff_send(fd, passfd, src) == 0;
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * The new proxy: take over into a cache of capacity cap.
+ * Check the inherited fd and every object, which is there
+ * unless it is big and expected left out.
+ */
+static void receive(size_t cap, int bigout) {
+    cache_t *dst = init_cache(cap, 4, CACHE_LRU);
+    c_res_t *shared = NULL;
+    c_res_t *res;
+    struct stat want, got;
+    char key[MAXLINE];
+    char *obj;
+    int fd, lfd;
+    int i;
+    
+    CHECK((fd = handoff_connect(path)) >= 0);
+    lfd = handoff_recv(fd, dst);
+    close(fd);
+    
+    /* the same open file, under another fd */
+    CHECK(lfd >= 0 && lfd != passfd);
+    CHECK(fstat(passfd, &want) == 0 && fstat(lfd, &got) == 0 &&
+          want.st_dev == got.st_dev && want.st_ino == got.st_ino);
+    close(lfd);
+    
+    for (i = 0; i < NOBJ; i++) {
+        sprintf(key, "http://handoff/%d", i);
+        res = get(dst, key);
+        if (bigout && is_big(i)) {
+            CHECK(res == NULL);
+            continue;
+        }
+        CHECK(res != NULL);
+        if (res == NULL) {
+            continue;
+        }
+        obj = make_obj(i);
+        CHECK(res->size == HEAD && res->bodysize == obj_size(i) - HEAD &&
+              !memcmp(res->val, obj, HEAD) &&
+              !memcmp(res->body, obj + HEAD, res->bodysize));
+        free(obj);
+    
+        /* shared bodies are deduplicated again */
+        if (!is_shared(i)) {
+            cache_release(res);
+        }
+        else if (shared == NULL) {
+            shared = res;
+        }
+        else {
+            CHECK(res->body == shared->body);
+            cache_release(res);
+        }
+    }
+    if (shared) {
+        cache_release(shared);
+    }
+    CHECK(cache_size(dst) <= cap);
+    free_cache(dst);
+}
+
+int main(void)
+{
+    char key[MAXLINE];
+    char *obj;
+    pthread_t tid;
+    int lfd;
+    int i;
+    
+    src = init_cache(ROOMY, 4, CACHE_LRU);
+    for (i = 0; i < NOBJ; i++) {
+        sprintf(key, "http://handoff/%d", i);
+        obj = make_obj(i);
+        if (put(src, key, obj, obj_size(i), HEAD) < 0) {
+            fprintf(stderr, "Could not fill the cache\n");
+            return EXIT_FAILURE;
+        }
+    }
+    
+    sprintf(path, "/tmp/handofftest.%d", (int) getpid());
+    if ((passfd = open("/dev/null", O_RDONLY)) < 0 ||
+        (lfd = handoff_listen(path)) < 0) {
+        perror("Handoff test");
+        return EXIT_FAILURE;
+    }
+    if (pthread_create(&tid, NULL, sender, &lfd) != 0) {
+        perror("Handoff test - sender");
+        return EXIT_FAILURE;
+    }
+    
+    /* everything fits */
+    receive(ROOMY, 0);
+    /* the big objects are skipped, the stream stays in step */
+    receive(SMALL, 1);
+    
+    pthread_join(tid, NULL);
+    CHECK(sent == 2);
+    close(lfd);
+    unlink(path);
+    close(passfd);
+    free_cache(src);
+    return check_done("handofftest");
+}
@@ -0,0 +1,447 @@
+/**
+ * This file implements HTTP/1.1 message framing for
+ * responses from the real servers.
+ * 
+ * A response head is parsed into its status and the way
+ * its body is delimited (Content-Length, chunked, or the
+ * connection close); the framing and other hop-by-hop
+ * headers, with those Connection names, are taken out of
+ * the head so the proxy can frame the body its own way:
+ * with the decoded length when it is cached, and chunked
+ * again, or delimited by closing, when it is streamed.
+ * 
+ * The body reader hands out the decoded bytes, so nothing
+ * past the end of the body is ever read, which is what a
+ * connection needs to be reused.
+ * 
+ * Request bodies go the other way as they are, chunked or
+ * not: only the framing is parsed to find the end, and the
+ * bytes are spliced from the client to the server without
+ * entering user space, once the client buffer is drained.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <ctype.h>
+#include <strings.h>
+#include "http.h"
+#include "tunnel.h"
+#include "debug.h"
+
+/* hop-by-hop and framing headers, dropped from heads */
+#define HD_FRAMING "transfer-encoding:content-length:connection:keep-alive:\
+proxy-connection:te:trailer:upgrade:"
+#define HD_NAME_MAX 32
+#define HD_NAMED_MAX 256        /* room for the names Connection lists */
+
+/*
+ * Whether the header line is one of list, lowercase names
+ * each followed by ':'.
+ */
+static int is_listed(char *line, const char *list) {
+    char name[HD_NAME_MAX + 2];
+    size_t len = strcspn(line, ":\r\n");
+    const char *p = list;
+    size_t i;
+    
+    if (line[len] != ':' || len == 0 || len > HD_NAME_MAX) {
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        name[i] = tolower(line[i]);
+    }
+    name[len] = ':';
+    name[len + 1] = '\0';
+    /* whole names only */
+    while ((p = strstr(p, name))) {
+        if (p == list || p[-1] == ':') {
+            return 1;
+        }
+        p++;
+    }
+    return 0;
+}
+
+/*
+ * Add the header names a Connection header line lists to
+ * named, in the form of is_listed. Names past its size
+ * are left out.
+ */
+static void add_named(char *line, char *named, size_t size) {
+    char *p = line + strcspn(line, ":") + 1;
+    size_t len = strlen(named);
+    size_t n, i;
+    
+    while (*p) {
+        p += strspn(p, " \t,");
+        if ((n = strcspn(p, " \t,\r\n")) == 0) {
+            break;
+        }
+        if (n <= HD_NAME_MAX && len + n + 1 < size) {
+            for (i = 0; i < n; i++) {
+                named[len++] = tolower(p[i]);
+            }
+            named[len++] = ':';
+            named[len] = '\0';
+        }
+        p += n;
+    }
+}
+
+/*
+ * Drop the header lines of the head that are in named,
+ * the status line kept. Connection may come after the
+ * headers it names, so this is done once the head is read.
+ */
+static void drop_named(http_resp_t *resp, char *named) {
+    char *line = resp->head + strcspn(resp->head, "\n") + 1;
+    char *end = resp->head + resp->headlen;
+    char *next;
+    
+    while (line < end) {
+        next = line + strcspn(line, "\n");
+        if (next < end) {
+            next++;
+        }
+        if (is_listed(line, named)) {
+            /* the terminating NUL too */
+            memmove(line, next, end - next + 1);
+            end -= next - line;
+        }
+        else {
+            line = next;
+        }
+    }
+    resp->headlen = end - resp->head;
+}
+
+/*
+ * Append len bytes to the head.
+ * Return 0 on success, -1 on errors.
+ */
+static int append(http_resp_t *resp, char *s, size_t len) {
+    char *tmp;
+    
+    if ((tmp = realloc(resp->head, resp->headlen + len + 1)) == NULL) {
+        perror("Read head - malloc");
+        return -1;
+    }
+    resp->head = tmp;
+    memcpy(resp->head + resp->headlen, s, len);
+    resp->headlen += len;
+    resp->head[resp->headlen] = '\0';
+    return 0;
+}
+
+/*
+ * Read one head, interim or final, into *resp.
+ * Return 0 on success, -1 on errors.
+ */
+static int read_one(rio_t *rp, http_resp_t *resp) {
+    char line[MAXLINE];
+    char named[HD_NAMED_MAX] = "";  /* headers Connection lists */
+    char *val;
+    ssize_t n;
+    
+    resp->status = 0;
+    resp->mode = BODY_CLOSE;
+    resp->length = -1;
+    resp->headlen = 0;
+    
+    /* status line: HTTP/x.y code reason */
+    if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0 || 
+        strncmp(line, "HTTP/", 5) || 
+        sscanf(line, "%*s %3d", &resp->status) != 1 ||
+        append(resp, line, n) < 0) {
+        return -1;
+    }
+    
+    while ((n = rio_readlineb(rp, line, MAXLINE)) > 0) {
+        /* end of head */
+        if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) {
+            if (named[0]) {
+                drop_named(resp, named);
+            }
+            return 0;
+        }
+        if (!strncasecmp(line, "content-length:", 15)) {
+            resp->length = atol(line + 15);
+        }
+        else if (!strncasecmp(line, "connection:", 11)) {
+            add_named(line, named, HD_NAMED_MAX);
+        }
+        else if (!strncasecmp(line, "transfer-encoding:", 18)) {
+            for (val = line + 18; *val; val++) {
+                *val = tolower(*val);
+            }
+            if (strstr(line + 18, "chunked")) {
+                resp->mode = BODY_CHUNKED;
+            }
+        }
+        if (!is_listed(line, HD_FRAMING) && append(resp, line, n) < 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Read a response head from *rp into *resp, skipping
+ * interim 1xx responses. nobody is set if the request
+ * was one whose response has no body (HEAD).
+ * Return 0 on success, -1 on errors.
+ */
+int http_read_head(rio_t *rp, int nobody, http_resp_t *resp) {
+    resp->head = NULL;
+    
+    do {
+        if (read_one(rp, resp) < 0) {
+            http_free_head(resp);
+            return -1;
+        }
+    } while (resp->status >= 100 && resp->status < 200 && 
+             resp->status != 101);
+    
+    /* chunked wins over Content-Length */
+    if (resp->mode == BODY_CHUNKED) {
+        resp->length = -1;
+    }
+    if (nobody || resp->status < 200 || 
+        resp->status == 204 || resp->status == 304) {
+        resp->mode = BODY_NONE;
+    }
+    else if (resp->mode != BODY_CHUNKED && resp->length >= 0) {
+        resp->mode = BODY_LENGTH;
+    }
+    return 0;
+}
+
+/*
+ * Free the head of a response.
+ */
+void http_free_head(http_resp_t *resp) {
+    free(resp->head);
+    resp->head = NULL;
+    resp->headlen = 0;
+}
+
+/*
+ * Build the head of a response to send on, framed with
+ * Content-Length if length is not negative, as chunked if
+ * chunked is set, else by closing the connection.
+ * Return its length, with *out set to the malloced head,
+ * or -1 on errors.
+ */
+int http_build_head(http_resp_t *resp, long length, int chunked, 
+                    char **out) {
+    char framing[MAXLINE];
+    int len;
+    
+    if (length >= 0) {
+        sprintf(framing, "Content-Length: %ld\r\n", length);
+    }
+    else if (chunked) {
+        strcpy(framing, "Transfer-Encoding: chunked\r\n");
+    }
+    else {
+        strcpy(framing, "");
+    }
+    strcat(framing, "Connection: close\r\n\r\n");
+    
+    len = resp->headlen + strlen(framing);
+    if ((*out = malloc(len + 1)) == NULL) {
+        perror("Build head - malloc");
+        return -1;
+    }
+    memcpy(*out, resp->head, resp->headlen);
+    strcpy(*out + resp->headlen, framing);
+    return len;
+}
+
+/*
+ * Start reading the body of the response *resp from *rp.
+ */
+void http_body_init(http_body_t *body, rio_t *rp, http_resp_t *resp) {
+    body->rio = rp;
+    body->mode = resp->mode;
+    body->left = resp->mode == BODY_LENGTH ? resp->length : 0;
+    body->done = resp->mode == BODY_NONE || 
+        (resp->mode == BODY_LENGTH && resp->length == 0);
+}
+
+/*
+ * Read the size line of the next chunk, and the trailers
+ * after the last one.
+ * Return 0 on success, -1 on errors.
+ */
+static int next_chunk(http_body_t *body) {
+    char line[MAXLINE];
+    char *end;
+    
+    if (rio_readlineb(body->rio, line, MAXLINE) <= 0) {
+        return -1;
+    }
+    body->left = strtol(line, &end, 16);
+    /* size, then maybe ;extensions */
+    if (end == line || body->left < 0) {
+        return -1;
+    }
+    if (body->left > 0) {
+        return 0;
+    }
+    
+    /* last chunk, skip the trailers */
+    body->done = 1;
+    do {
+        if (rio_readlineb(body->rio, line, MAXLINE) <= 0) {
+            return -1;
+        }
+    } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+    return 0;
+}
+
+/*
+ * Read up to n decoded body bytes into buf.
+ * Return the number of bytes read, 0 at the end of
+ * the body, -1 on errors.
+ */
+ssize_t http_body_read(http_body_t *body, void *buf, size_t n) {
+    char crlf[3];
+    ssize_t len;
+    
+    if (body->done) {
+        return 0;
+    }
+    if (body->mode == BODY_CLOSE) {
+        return rio_readnb(body->rio, buf, n);
+    }
+    
+    if (body->mode == BODY_CHUNKED && body->left == 0) {
+        if (next_chunk(body) < 0) {
+            return -1;
+        }
+        if (body->done) {
+            return 0;
+        }
+    }
+    
+    if ((size_t) body->left < n) {
+        n = body->left;
+    }
+    /* a body cut short is an error */
+    if ((len = rio_readnb(body->rio, buf, n)) <= 0) {
+        return -1;
+    }
+    body->left -= len;
+    
+    if (body->left == 0) {
+        if (body->mode == BODY_LENGTH) {
+            body->done = 1;
+        }
+        /* the line break closing the chunk */
+        else if (rio_readlineb(body->rio, crlf, sizeof(crlf)) <= 0) {
+            return -1;
+        }
+    }
+    return len;
+}
+
+/*
+ * Write n bytes to fd as one chunk; n == 0 writes the
+ * last chunk.
+ * Return 0 on success, -1 on errors.
+ */
+int http_chunk_write(int fd, void *buf, size_t n) {
+    char line[32];
+    int len = sprintf(line, "%lx\r\n", (unsigned long) n);
+    
+    if (n == 0) {
+        strcat(line, "\r\n");
+        len += 2;
+    }
+    if (rio_writen(fd, line, len) != len || 
+        (n > 0 && (rio_writen(fd, buf, n) != (ssize_t) n || 
+                   rio_writen(fd, "\r\n", 2) != 2))) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Relay n bytes from *rp to tofd, the buffered ones first.
+ * Return 0 on success, -1 on errors.
+ */
+static int relay_n(rio_t *rp, int tofd, long n) {
+    char buf[MAXBUF];
+    ssize_t len;
+    
+    while (n > 0 && rp->rio_cnt > 0) {
+        len = n < rp->rio_cnt ? n : rp->rio_cnt;
+        if (len > MAXBUF) {
+            len = MAXBUF;
+        }
+        /* served from the buffer, never blocks */
+        if (rio_readnb(rp, buf, len) != len || 
+            rio_writen(tofd, buf, len) != len) {
+            return -1;
+        }
+        n -= len;
+    }
+    return n > 0 ? tunnel_splice(rp->rio_fd, tofd, n) : 0;
+}
+
+/*
+ * Relay a line from *rp to tofd into line.
+ * Return 0 on success, -1 on errors.
+ */
+static int relay_line(rio_t *rp, int tofd, char *line) {
+    ssize_t n;
+    
+    if ((n = rio_readlineb(rp, line, MAXLINE)) <= 0 || 
+        line[n - 1] != '\n' || rio_writen(tofd, line, n) != n) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Relay a request body from *rp to tofd as it is:
+ * length bytes, or chunks up to the last one and its
+ * trailers if chunked is set.
+ * Return 0 on success, -1 on errors.
+ */
+int http_relay_body(rio_t *rp, int tofd, long length, int chunked) {
+    char line[MAXLINE];
+    char *end;
+    long n;
+    
+    if (!chunked) {
+        return relay_n(rp, tofd, length);
+    }
+    while (1) {
+        /* size;extensions */
+        if (relay_line(rp, tofd, line) < 0) {
+            return -1;
+        }
+        n = strtol(line, &end, 16);
+        if (end == line || n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        /* data, then the line break closing it */
+        if (relay_n(rp, tofd, n) < 0 || relay_line(rp, tofd, line) < 0) {
+            return -1;
+        }
+    }
+    /* trailers, up to the empty line */
+    do {
+        if (relay_line(rp, tofd, line) < 0) {
+            return -1;
+        }
+    } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+    return 0;
+}
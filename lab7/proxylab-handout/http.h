@@ -0,0 +1,43 @@
+/**
+ * Header file for http.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+#define BODY_NONE 0             /* no body (HEAD, 1xx, 204, 304) */
+#define BODY_LENGTH 1           /* Content-Length bytes */
+#define BODY_CHUNKED 2          /* chunked transfer coding */
+#define BODY_CLOSE 3            /* up to the connection close */
+
+/* The response head struct */
+typedef struct {
+    int status;                 /* status code */
+    int mode;                   /* how the body is delimited */
+    long length;                /* Content-Length, -1 if none */
+    char *head;                 /* status line and end-to-end headers */
+    size_t headlen;             /* size of head */
+} http_resp_t;
+
+/* The body reader struct */
+typedef struct {
+    rio_t *rio;                 /* where the body comes from */
+    int mode;                   /* how the body is delimited */
+    long left;                  /* bytes left in the body or chunk */
+    int done;                   /* the whole body was read */
+} http_body_t;
+
+int http_read_head(rio_t *, int, http_resp_t *);
+void http_free_head(http_resp_t *);
+int http_build_head(http_resp_t *, long, int, char **);
+void http_body_init(http_body_t *, rio_t *, http_resp_t *);
+ssize_t http_body_read(http_body_t *, void *, size_t);
+int http_chunk_write(int, void *, size_t);
+int http_relay_body(rio_t *, int, long, int);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,366 @@
+/**
+ * This file tests HTTP/1.1 response framing (http.c):
+ * parsing heads, with hop-by-hop headers taken out, decoding
+ * chunked bodies read in pieces of any size, and chunking
+ * them again, as the proxy does when it streams a body.
+ * Responses are fed through a socket pair, followed by
+ * another one, so a reader going past its body shows.
+ *
+ * Usage: httptest
+ *
+ *
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include "http.h"
+#include "check.h"
+
+#define BODY_MAX 65536          /* room for a decoded body */
+#define NEXT "HTTP/1.1 204 No Content\r\nServer: next\r\n\r\n"
+
+/*
+ * Write n bytes of data into a socket pair, and start
+ * reading them from *rp. The writing end is closed, so
+ * the data ends there.
+ * Return the reading end, -1 on errors.
+ */
+static int feed(rio_t *rp, char *data, size_t n) {
+    int sv[2];
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("Feed - socketpair");
+        return -1;
+    }
+    if (rio_writen(sv[0], data, n) != (ssize_t) n) {
+        perror("Feed - write");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    close(sv[0]);
+    rio_readinitb(rp, sv[1]);
+    return sv[1];
+}
+
+/*
+ * Read the body of *resp from *rp into buf, step bytes at a
+ * time. Return its size, -1 on errors.
+ */
+static long read_body(rio_t *rp, http_resp_t *resp, char *buf,
+                      size_t step) {
+    http_body_t body;
+    long total = 0;
+    ssize_t n;
+    
+    http_body_init(&body, rp, resp);
+    while (total < BODY_MAX) {
+        if (step > (size_t) (BODY_MAX - total)) {
+            step = BODY_MAX - total;
+        }
+        if ((n = http_body_read(&body, buf + total, step)) < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            return total;
+        }
+        total += n;
+    }
+    return -1;
+}
+
+/*
+ * Whether the next response on *rp is NEXT, so the body
+ * before it was read up to its end and no further.
+ */
+static int next_is_intact(rio_t *rp) {
+    http_resp_t resp;
+    int ok;
+    
+    if (http_read_head(rp, 0, &resp) < 0) {
+        return 0;
+    }
+    ok = resp.status == 204 && resp.mode == BODY_NONE &&
+         strstr(resp.head, "Server: next") != NULL;
+    http_free_head(&resp);
+    return ok;
+}
+
+/*
+ * Fill buf with n bytes of a made up body.
+ */
+static void make_body(char *buf, size_t n) {
+    size_t i;
+    
+    for (i = 0; i < n; i++) {
+        buf[i] = (char) (i * 7 + i / 251);
+    }
+}
+
+/*
+ * Hop-by-hop headers, and those Connection names, are
+ * taken out of the head, the end-to-end ones kept.
+ */
+static void test_head(void) {
+    char *msg = "HTTP/1.1 100 Continue\r\n\r\n"
+        "HTTP/1.1 200 OK\r\n"
+        "X-Secret: 1\r\n"
+        "Server: test\r\n"
+        "TE: trailers\r\n"
+        "Upgrade: h2c\r\n"
+        "Trailer: X-Sum\r\n"
+        "Keep-Alive: timeout=5\r\n"
+        "Connection: x-secret, Keep-Alive ,close\r\n"
+        "Content-Length: 3\r\n"
+        "X-Secretive: 2\r\n"
+        "\r\n"
+        "abc" NEXT;
+    http_resp_t resp;
+    char buf[BODY_MAX];
+    char *out;
+    rio_t rio;
+    int fd, len;
+    
+    if ((fd = feed(&rio, msg, strlen(msg))) < 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(http_read_head(&rio, 0, &resp) == 0);
+    CHECK(resp.status == 200 && resp.mode == BODY_LENGTH &&
+          resp.length == 3);
+    CHECK(!strcmp(resp.head, "HTTP/1.1 200 OK\r\n"
+                  "Server: test\r\n"
+                  "X-Secretive: 2\r\n"));
+    CHECK(resp.headlen == strlen(resp.head));
+    
+    /* framed again, cached with its length */
+    len = http_build_head(&resp, 3, 0, &out);
+    CHECK(len > 0 && !strcmp(out, "HTTP/1.1 200 OK\r\n"
+                             "Server: test\r\n"
+                             "X-Secretive: 2\r\n"
+                             "Content-Length: 3\r\n"
+                             "Connection: close\r\n\r\n"));
+    free(out);
+    
+    CHECK(read_body(&rio, &resp, buf, 2) == 3 && !memcmp(buf, "abc", 3));
+    CHECK(next_is_intact(&rio));
+    http_free_head(&resp);
+    close(fd);
+}
+
+/*
+ * A chunked body, with extensions and trailers, is decoded
+ * whatever the size of the reads, and chunked wins over
+ * Content-Length.
+ */
+static void test_chunked(void) {
+    static size_t sizes[] = {1, 0x1a, 4096, 10000, 3};
+    static size_t steps[] = {1, 7, 4096, BODY_MAX};
+    char body[BODY_MAX];
+    char buf[BODY_MAX];
+    char msg[2 * BODY_MAX];
+    http_resp_t resp;
+    rio_t rio;
+    size_t len, off = 0;
+    int fd;
+    int i, s;
+    
+    for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+        off += sizes[i];
+    }
+    make_body(body, off);
+    
+    for (s = 0; s < (int) (sizeof(steps) / sizeof(steps[0])); s++) {
+        len = sprintf(msg, "HTTP/1.1 200 OK\r\n"
+                      "Transfer-Encoding: gzip, Chunked\r\n"
+                      "Content-Length: 99\r\n\r\n");
+        off = 0;
+        for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+            /* upper case hex, and an extension on one */
+            len += sprintf(msg + len, i == 1 ? "%lX;name=val\r\n" :
+                           "%lX\r\n", (unsigned long) sizes[i]);
+            memcpy(msg + len, body + off, sizes[i]);
+            len += sizes[i];
+            len += sprintf(msg + len, "\r\n");
+            off += sizes[i];
+        }
+        len += sprintf(msg + len, "0\r\nX-Sum: 1\r\nX-More: 2\r\n\r\n"
+                       NEXT);
+    
+        if ((fd = feed(&rio, msg, len)) < 0) {
+            CHECK(0);
+            return;
+        }
+        CHECK(http_read_head(&rio, 0, &resp) == 0);
+        CHECK(resp.mode == BODY_CHUNKED && resp.length == -1);
+        CHECK(!strcmp(resp.head, "HTTP/1.1 200 OK\r\n"));
+        CHECK(read_body(&rio, &resp, buf, steps[s]) == (long) off &&
+              !memcmp(buf, body, off));
+        CHECK(next_is_intact(&rio));
+        http_free_head(&resp);
+        close(fd);
+    }
+}
+
+/*
+ * A body chunked again by http_chunk_write decodes to
+ * itself, and is relayed as it is by http_relay_body.
+ */
+static void test_rechunk(void) {
+    static size_t pieces[] = {1, 100, 5000, 3000, 20000};
+    char body[BODY_MAX];
+    char buf[BODY_MAX];
+    char wire[2 * BODY_MAX];
+    http_resp_t resp;
+    rio_t rio, out;
+    size_t off = 0;
+    long len;
+    int sv[2], relay[2];
+    int fd;
+    int i;
+    
+    for (i = 0; i < (int) (sizeof(pieces) / sizeof(pieces[0])); i++) {
+        off += pieces[i];
+    }
+    make_body(body, off);
+    
+    /* chunk it into a socket pair, ended by the last chunk */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("Rechunk - socketpair");
+        CHECK(0);
+        return;
+    }
+    off = 0;
+    for (i = 0; i < (int) (sizeof(pieces) / sizeof(pieces[0])); i++) {
+        CHECK(http_chunk_write(sv[0], body + off, pieces[i]) == 0);
+        off += pieces[i];
+    }
+    CHECK(http_chunk_write(sv[0], NULL, 0) == 0);
+    CHECK(rio_writen(sv[0], NEXT, strlen(NEXT)) == (ssize_t) strlen(NEXT));
+    close(sv[0]);
+    
+    /* the bytes on the wire, as they were chunked */
+    rio_readinitb(&rio, sv[1]);
+    len = rio_readnb(&rio, wire, sizeof(wire) - 1);
+    close(sv[1]);
+    CHECK(len > (long) (off + strlen(NEXT)));
+    if (len <= (long) (off + strlen(NEXT))) {
+        return;
+    }
+    wire[len] = '\0';
+    CHECK(!strncmp(wire, "1\r\n", 3));
+    CHECK(!strcmp(wire + len - strlen(NEXT) - 5, "0\r\n\r\n" NEXT));
+    
+    /* decoded */
+    resp.mode = BODY_CHUNKED;
+    resp.length = -1;
+    if ((fd = feed(&rio, wire, len)) < 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(read_body(&rio, &resp, buf, 1000) == (long) off &&
+          !memcmp(buf, body, off));
+    CHECK(next_is_intact(&rio));
+    close(fd);
+    
+    /* relayed to the end of the last chunk, no further */
+    if ((fd = feed(&rio, wire, len)) < 0 ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, relay) < 0) {
+        CHECK(0);
+        return;
+    }
+    CHECK(http_relay_body(&rio, relay[0], -1, 1) == 0);
+    close(relay[0]);
+    rio_readinitb(&out, relay[1]);
+    CHECK(rio_readnb(&out, buf, sizeof(buf)) ==
+          len - (long) strlen(NEXT) &&
+          !memcmp(buf, wire, len - strlen(NEXT)));
+    CHECK(next_is_intact(&rio));
+    close(relay[1]);
+    close(fd);
+}
+
+/*
+ * Bodies with no chunking, and broken ones.
+ */
+static void test_framing(void) {
+    char buf[BODY_MAX];
+    http_resp_t resp;
+    rio_t rio;
+    char *msg;
+    int fd;
+    
+    /* no length: up to the close */
+    msg = "HTTP/1.0 200 OK\r\n\r\nall of it";
+    if ((fd = feed(&rio, msg, strlen(msg))) >= 0) {
+        CHECK(http_read_head(&rio, 0, &resp) == 0 &&
+              resp.mode == BODY_CLOSE);
+        CHECK(read_body(&rio, &resp, buf, 4) == 9 &&
+              !memcmp(buf, "all of it", 9));
+        http_free_head(&resp);
+        close(fd);
+    }
+    
+    /* no body for HEAD or 304, whatever the head says */
+    msg = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n" NEXT;
+    if ((fd = feed(&rio, msg, strlen(msg))) >= 0) {
+        CHECK(http_read_head(&rio, 1, &resp) == 0 &&
+              resp.mode == BODY_NONE);
+        CHECK(read_body(&rio, &resp, buf, 4) == 0);
+        CHECK(next_is_intact(&rio));
+        http_free_head(&resp);
+        close(fd);
+    }
+    msg = "HTTP/1.1 304 Not Modified\r\n"
+          "Transfer-Encoding: chunked\r\n\r\n" NEXT;
+    if ((fd = feed(&rio, msg, strlen(msg))) >= 0) {
+        CHECK(http_read_head(&rio, 0, &resp) == 0 &&
+              resp.mode == BODY_NONE);
+        CHECK(next_is_intact(&rio));
+        http_free_head(&resp);
+        close(fd);
+    }
+    
+    /* a chunk size that is not one */
+    msg = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+          "zz\r\nabc\r\n0\r\n\r\n";
+    if ((fd = feed(&rio, msg, strlen(msg))) >= 0) {
+        CHECK(http_read_head(&rio, 0, &resp) == 0);
+        CHECK(read_body(&rio, &resp, buf, 4) == -1);
+        http_free_head(&resp);
+        close(fd);
+    }
+    
+    /* cut short, in a chunk and by the length */
+    msg = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+          "10\r\nabc";
+    if ((fd = feed(&rio, msg, strlen(msg))) >= 0) {
+        CHECK(http_read_head(&rio, 0, &resp) == 0);
+        CHECK(read_body(&rio, &resp, buf, 4) == -1);
+        http_free_head(&resp);
+        close(fd);
+    }
+    msg = "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nabc";
+    if ((fd = feed(&rio, msg, strlen(msg))) >= 0) {
+        CHECK(http_read_head(&rio, 0, &resp) == 0);
+        CHECK(read_body(&rio, &resp, buf, 4) == -1);
+        http_free_head(&resp);
+        close(fd);
+    }
+    
+    /* a head cut short */
+    msg = "HTTP/1.1 200 OK\r\nServer: x\r\n";
+    if ((fd = feed(&rio, msg, strlen(msg))) >= 0) {
+        CHECK(http_read_head(&rio, 0, &resp) == -1);
+        close(fd);
+    }
+}
+
+int main(void)
+{
+    test_head();
+    test_chunked();
+    test_rechunk();
+    test_framing();
+    return check_done("httptest");
+}
@@ -0,0 +1,203 @@
+/**
+ * This file samples memory pressure, so the cache can
+ * give memory back before the container gets OOM killed,
+ * and take more when it is free.
+ * 
+ * Usage and limit come from the memory cgroup of the
+ * process (v2 memory.current / memory.max, or v1
+ * usage_in_bytes / limit_in_bytes), with the inactive
+ * page cache taken out since the kernel reclaims it before
+ * killing anyone. Without a cgroup limit the whole machine
+ * is the limit, as told by /proc/meminfo.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mempress.h"
+#include "debug.h"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_V1 "/sys/fs/cgroup/memory"
+#define PATH_LEN 512
+
+/*
+ * Read the number a cgroup file starts with into *n.
+ * "max" reads as no limit.
+ * Return 0 on success, -1 on errors.
+ */
+static int read_num(char *dir, char *file, size_t *n) {
+    char path[PATH_LEN];
+    char buf[64];
+    FILE *fp;
+    int rc = -1;
+    
+    snprintf(path, PATH_LEN, "%s/%s", dir, file);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    if (fscanf(fp, "%63s", buf) == 1) {
+        *n = strcmp(buf, "max") ? strtoull(buf, NULL, 10) : MEM_NO_LIMIT;
+        rc = 0;
+    }
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * Read the value of name from a "name value" per line
+ * file into *n, scaled by unit.
+ * Return 0 on success, -1 if not found.
+ */
+static int read_field(char *path, char *name, size_t unit, size_t *n) {
+    char line[256];
+    char key[128];
+    unsigned long long val;
+    FILE *fp;
+    int rc = -1;
+    
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%127[^: ]%*[: ]%llu", key, &val) == 2 && 
+            !strcmp(key, name)) {
+            *n = (size_t) val * unit;
+            rc = 0;
+            break;
+        }
+    }
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * Find the directory of the cgroup the process is in under
+ * root, for the hierarchy with the controller ctrl
+ * (empty for the cgroup v2 one).
+ * Return 0 on success, -1 on errors.
+ */
+static int cgroup_dir(char *root, char *ctrl, char *dir) {
+    char line[PATH_LEN];
+    char *ctrls;
+    char *path;
+    FILE *fp;
+    int rc = -1;
+    
+    if ((fp = fopen("/proc/self/cgroup", "r")) == NULL) {
+        return -1;
+    }
+    /* id:controllers:path */
+    while (fgets(line, sizeof(line), fp)) {
+        if (!(ctrls = strchr(line, ':')) || 
+            !(path = strchr(++ctrls, ':'))) {
+            continue;
+        }
+        *path++ = '\0';
+        path[strcspn(path, "\n")] = '\0';
+        if ((!*ctrl && !*ctrls) || (*ctrl && strstr(ctrls, ctrl))) {
+            snprintf(dir, PATH_LEN, "%s%s", root, 
+                     strcmp(path, "/") ? path : "");
+            rc = 0;
+            break;
+        }
+    }
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * Sample the cgroup at dir.
+ * Return 0 on success, -1 if it can't be read or 
+ * has no limit.
+ */
+static int cgroup_sample(char *dir, char *cur, char *max, 
+                         char *inactive, mem_usage_t *mem) {
+    char path[PATH_LEN];
+    size_t reclaim = 0;
+    
+    if (read_num(dir, cur, &mem->used) < 0 || 
+        read_num(dir, max, &mem->limit) < 0 || 
+        mem->limit >= MEM_NO_LIMIT) {
+        return -1;
+    }
+    snprintf(path, PATH_LEN, "%s/memory.stat", dir);
+    if (read_field(path, inactive, 1, &reclaim) == 0 && 
+        reclaim < mem->used) {
+        mem->used -= reclaim;
+    }
+    return 0;
+}
+
+/*
+ * Sample the memory usage into *mem.
+ * Return 0 on success, -1 on errors.
+ */
+int mem_sample(mem_usage_t *mem) {
+    char dir[PATH_LEN];
+    size_t avail;
+    
+    /* cgroup v2, the own one, then the root of the namespace */
+    if ((cgroup_dir(CGROUP_ROOT, "", dir) == 0 && 
+         cgroup_sample(dir, "memory.current", "memory.max", 
+                       "inactive_file", mem) == 0) ||
+        cgroup_sample(CGROUP_ROOT, "memory.current", "memory.max", 
+                      "inactive_file", mem) == 0) {
+        return 0;
+    }
+    
+    /* cgroup v1 */
+    if ((cgroup_dir(CGROUP_V1, "memory", dir) == 0 && 
+         cgroup_sample(dir, "memory.usage_in_bytes", 
+                       "memory.limit_in_bytes", 
+                       "total_inactive_file", mem) == 0) ||
+        cgroup_sample(CGROUP_V1, "memory.usage_in_bytes", 
+                      "memory.limit_in_bytes", 
+                      "total_inactive_file", mem) == 0) {
+        return 0;
+    }
+    
+    /* no limit, the machine is */
+    if (read_field("/proc/meminfo", "MemTotal", 1024, &mem->limit) < 0 ||
+        read_field("/proc/meminfo", "MemAvailable", 1024, &avail) < 0) {
+        perror("Memory sample - meminfo");
+        return -1;
+    }
+    mem->used = avail < mem->limit ? mem->limit - avail : 0;
+    return 0;
+}
+
+/*
+ * Compute the cache capacity keeping the memory usage at
+ * percent of the limit, given cached bytes in the cache:
+ * the cache may take what is free under the target, and
+ * has to give back what is used over it. The result is
+ * kept between floor and ceiling.
+ */
+size_t mem_target_cap(mem_usage_t *mem, size_t cached, int percent, 
+                      size_t floor, size_t ceiling) {
+    size_t target = mem->limit / 100 * percent;
+    size_t cap;
+    
+    if (target >= mem->used) {
+        cap = cached + (target - mem->used);
+    }
+    else if (cached > mem->used - target) {
+        cap = cached - (mem->used - target);
+    }
+    else {
+        cap = 0;
+    }
+    
+    if (cap < floor) {
+        cap = floor;
+    }
+    if (ceiling && cap > ceiling) {
+        cap = ceiling;
+    }
+    return cap;
+}
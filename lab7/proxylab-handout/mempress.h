@@ -0,0 +1,24 @@
+/**
+ * Header file for mempress.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __MEMPRESS_H__
+#define __MEMPRESS_H__
+
+#include <stddef.h>
+
+#define MEM_NO_LIMIT (1UL << 62)    /* cgroup v1 limits above are unset */
+
+/* The memory usage struct */
+typedef struct {
+    size_t used;                /* bytes in use, reclaimable page cache excluded */
+    size_t limit;               /* bytes that may be used */
+} mem_usage_t;
+
+int mem_sample(mem_usage_t *);
+size_t mem_target_cap(mem_usage_t *, size_t, int, size_t, size_t);
+
+#endif /* __MEMPRESS_H__ */
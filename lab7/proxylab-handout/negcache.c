@@ -0,0 +1,184 @@
+/**
+ * This file implements a negative cache, remembering for
+ * a short while that an origin or a URL is failing so the
+ * failure can be answered from memory.
+ * 
+ * The table is direct mapped: a key lives in the one slot
+ * its hash picks, and a new failure simply replaces whatever
+ * was there. Forgetting a failure early is harmless (the
+ * next request just tries the origin), so the table needs
+ * no eviction policy and its size is fixed.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "negcache.h"
+#include "debug.h"
+#include "util.h"
+
+/*
+ * Empty a slot.
+ */
+static void clear_slot(n_entry_t *e) {
+    free(e->key);
+    free(e->resp);
+    e->key = NULL;
+    e->resp = NULL;
+    e->len = 0;
+}
+
+/*
+ * Init a negative cache instance.
+ */
+negcache_t *init_negcache(void) {
+    negcache_t *neg = (negcache_t *) calloc(1, sizeof(negcache_t));
+    int i;
+    
+    if (!neg) {
+        perror("Init negcache - malloc");
+        return NULL;
+    }
+    for (i = 0; i < NEG_LOCKS; i++) {
+        if (sem_init(&neg->locks[i], 0, 1) < 0) {
+            perror("Init negcache - lock");
+            free(neg);
+            return NULL;
+        }
+    }
+    return neg;
+}
+
+/*
+ * Free a negative cache instance.
+ */
+void free_negcache(negcache_t *neg) {
+    int i;
+    
+    if (!neg) {
+        return;
+    }
+    for (i = 0; i < NEG_SLOTS; i++) {
+        clear_slot(&neg->slots[i]);
+    }
+    for (i = 0; i < NEG_LOCKS; i++) {
+        sem_destroy(&neg->locks[i]);
+    }
+    free(neg);
+}
+
+/*
+ * Remember that key failed for ttl milliseconds.
+ * resp (len bytes, copied) is what to answer with,
+ * NULL to let the caller make up an answer.
+ */
+void neg_put(negcache_t *neg, char *key, int ttl, void *resp, size_t len) {
+    unsigned slot = hash_key(key) % NEG_SLOTS;
+    n_entry_t *e = &neg->slots[slot];
+    sem_t *lock = &neg->locks[slot % NEG_LOCKS];
+    char *newkey;
+    void *newresp = NULL;
+    
+    if (ttl <= 0 || len > NEG_MAX_RESP) {
+        return;
+    }
+    
+    /* copy outside the lock */
+    if ((newkey = malloc(strlen(key) + 1)) == NULL ||
+        (resp && (newresp = malloc(len)) == NULL)) {
+        free(newkey);
+        return;
+    }
+    strcpy(newkey, key);
+    if (resp) {
+        memcpy(newresp, resp, len);
+    }
+    
+    if (sem_p(lock) < 0) {
+        perror("Neg put - lock");
+        free(newkey);
+        free(newresp);
+        return;
+    }
+    clear_slot(e);
+    e->key = newkey;
+    e->resp = newresp;
+    e->len = resp ? len : 0;
+    e->expires = now_ms() + ttl;
+    if (sem_v(lock) < 0) {
+        perror("Neg put - unlock");
+    }
+    dbg_printf("Negative cached %s for %dms\n", key, ttl);
+}
+
+/*
+ * Look up whether key is known to fail.
+ * Return 1 if so, with *resp set to a malloced copy of the
+ * response to answer with (or NULL) and *len to its size.
+ * Return 0 otherwise.
+ */
+int neg_get(negcache_t *neg, char *key, void **resp, size_t *len) {
+    unsigned slot = hash_key(key) % NEG_SLOTS;
+    n_entry_t *e = &neg->slots[slot];
+    sem_t *lock = &neg->locks[slot % NEG_LOCKS];
+    int found = 0;
+    
+    *resp = NULL;
+    *len = 0;
+    if (sem_p(lock) < 0) {
+        perror("Neg get - lock");
+        return 0;
+    }
+    if (e->key && !strcmp(e->key, key)) {
+        /* expired, forget it */
+        if (e->expires <= now_ms()) {
+            clear_slot(e);
+        }
+        else {
+            found = 1;
+            if (e->resp && (*resp = malloc(e->len))) {
+                memcpy(*resp, e->resp, e->len);
+                *len = e->len;
+            }
+        }
+    }
+    if (sem_v(lock) < 0) {
+        perror("Neg get - unlock");
+    }
+    return found;
+}
+
+/*
+ * Forget the failure of key, or of all keys starting
+ * with it if prefix is set.
+ */
+void neg_forget(negcache_t *neg, char *key, int prefix) {
+    size_t len = strlen(key);
+    unsigned first = 0;
+    unsigned last = NEG_SLOTS - 1;
+    unsigned slot;
+    n_entry_t *e;
+    
+    /* an exact key can only be in one slot */
+    if (!prefix) {
+        first = last = hash_key(key) % NEG_SLOTS;
+    }
+    for (slot = first; slot <= last; slot++) {
+        e = &neg->slots[slot];
+        if (sem_p(&neg->locks[slot % NEG_LOCKS]) < 0) {
+            perror("Neg forget - lock");
+            return;
+        }
+        if (e->key && (prefix ? !strncmp(e->key, key, len) : 
+                       !strcmp(e->key, key))) {
+            clear_slot(e);
+        }
+        if (sem_v(&neg->locks[slot % NEG_LOCKS]) < 0) {
+            perror("Neg forget - unlock");
+        }
+    }
+}
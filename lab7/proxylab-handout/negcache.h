@@ -0,0 +1,38 @@
+/**
+ * Header file for negcache.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __NEGCACHE_H__
+#define __NEGCACHE_H__
+
+#include <semaphore.h>
+#include <stddef.h>
+
+#define NEG_SLOTS 4096          /* number of entries remembered */
+#define NEG_LOCKS 64            /* number of lock stripes */
+#define NEG_MAX_RESP 8192       /* largest failure response kept */
+
+/* The negative cache entry struct */
+typedef struct {
+    char *key;                  /* the failing origin or URL */
+    long expires;               /* when the failure is forgotten, in ms */
+    void *resp;                 /* response to answer with, may be NULL */
+    size_t len;                 /* size of the response */
+} n_entry_t;
+
+/* The negative cache struct */
+typedef struct {
+    n_entry_t slots[NEG_SLOTS]; /* direct mapped table */
+    sem_t locks[NEG_LOCKS];     /* slot i is guarded by lock i % NEG_LOCKS */
+} negcache_t;
+
+negcache_t *init_negcache(void);
+void free_negcache(negcache_t *);
+void neg_put(negcache_t *, char *, int, void *, size_t);
+int neg_get(negcache_t *, char *, void **, size_t *);
+void neg_forget(negcache_t *, char *, int);
+
+#endif /* __NEGCACHE_H__ */
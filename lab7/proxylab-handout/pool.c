@@ -0,0 +1,350 @@
+/**
+ * This file implements a fixed size thread pool.
+ * 
+ * At most nthreads jobs of a pool run at once. That bound is
+ * the point: a pool is a concurrency limit as much as it is
+ * a way to save thread creation. It can be changed while the
+ * pool runs: new workers are started at once, surplus ones
+ * exit after their current job.
+ * 
+ * Jobs may carry a key (the origin server, for fetches).
+ * Each key has its own FIFO queue, and:
+ *      1. At most keycap jobs of a key run at once, so one key
+ *          can't take all the workers;
+ *      2. Idle workers take jobs from the queues round robin,
+ *          so a key with a long backlog doesn't delay the
+ *          others, who only wait for their own jobs.
+ * Jobs without a key share one queue that is never capped.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+#include "debug.h"
+#include "util.h"
+
+/*
+ * Find the queue of a key, creating it if needed.
+ * Must be called with the pool lock held.
+ */
+static p_queue_t *find_queue(pool_t *pool, char *key) {
+    p_queue_t **row = &pool->rows[hash_key(key) % POOL_ROWS];
+    p_queue_t *q;
+    
+    for (q = *row; q; q = q->next) {
+        if (key ? (q->key && !strcmp(q->key, key)) : !q->key) {
+            return q;
+        }
+    }
+    if ((q = (p_queue_t *) calloc(1, sizeof(p_queue_t))) == NULL) {
+        return NULL;
+    }
+    if (key && (q->key = strdup(key)) == NULL) {
+        free(q);
+        return NULL;
+    }
+    q->next = *row;
+    *row = q;
+    return q;
+}
+
+/*
+ * Free a queue with no jobs left.
+ * Must be called with the pool lock held.
+ */
+static void drop_queue(pool_t *pool, p_queue_t *q) {
+    p_queue_t **link = &pool->rows[hash_key(q->key) % POOL_ROWS];
+    
+    while (*link != q) {
+        link = &(*link)->next;
+    }
+    *link = q->next;
+    free(q->key);
+    free(q);
+}
+
+/*
+ * Put a queue into the round robin ring, right before
+ * the queue served next, i.e. last in line.
+ */
+static void ring_insert(pool_t *pool, p_queue_t *q) {
+    if (!pool->rr) {
+        q->rr_next = q;
+        q->rr_prev = q;
+        pool->rr = q;
+        return;
+    }
+    q->rr_next = pool->rr;
+    q->rr_prev = pool->rr->rr_prev;
+    q->rr_prev->rr_next = q;
+    pool->rr->rr_prev = q;
+}
+
+/*
+ * Take a queue out of the round robin ring.
+ */
+static void ring_remove(pool_t *pool, p_queue_t *q) {
+    if (q->rr_next == q) {
+        pool->rr = NULL;
+    }
+    else {
+        q->rr_prev->rr_next = q->rr_next;
+        q->rr_next->rr_prev = q->rr_prev;
+        if (pool->rr == q) {
+            pool->rr = q->rr_next;
+        }
+    }
+    q->rr_next = NULL;
+    q->rr_prev = NULL;
+}
+
+/*
+ * Find the next queue in the ring that may run a job.
+ * Must be called with the pool lock held.
+ */
+static p_queue_t *pick(pool_t *pool) {
+    p_queue_t *q = pool->rr;
+    
+    if (!q) {
+        return NULL;
+    }
+    do {
+        if (!q->key || pool->keycap <= 0 || q->running < pool->keycap) {
+            return q;
+        }
+        q = q->rr_next;
+    } while (q != pool->rr);
+    return NULL;
+}
+
+/*
+ * Let a worker go. Must be called with the pool lock held.
+ */
+static void *worker_exit(pool_t *pool) {
+    pool->live--;
+    pthread_cond_broadcast(&pool->exited);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Worker thread routine.
+ */
+static void *worker(void *arg) {
+    pool_t *pool = (pool_t *) arg;
+    p_queue_t *q;
+    p_job_t *job;
+    
+    pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (!(q = pick(pool))) {
+            if ((pool->stop && pool->queued == 0) || 
+                pool->live > pool->nthreads) {
+                return worker_exit(pool);
+            }
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        /* surplus after shrinking */
+        if (pool->live > pool->nthreads) {
+            return worker_exit(pool);
+        }
+        
+        job = q->head;
+        if ((q->head = job->next) == NULL) {
+            q->tail = NULL;
+        }
+        q->waiting--;
+        q->running++;
+        pool->queued--;
+        
+        /* the next job comes from the next queue */
+        if (q->waiting == 0) {
+            ring_remove(pool, q);
+        }
+        else {
+            pool->rr = q->rr_next;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        
+        job->fn(job->arg);
+        free(job);
+        
+        pthread_mutex_lock(&pool->lock);
+        q->running--;
+        if (q->waiting == 0 && q->running == 0) {
+            drop_queue(pool, q);
+        }
+        /* a capped queue may run again, stopping workers recheck */
+        else if (q->waiting > 0 || pool->stop) {
+            pthread_cond_signal(&pool->ready);
+        }
+        if (pool->stop) {
+            pthread_cond_broadcast(&pool->ready);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/*
+ * Start workers until there are nthreads of them.
+ * Must be called with the pool lock held.
+ * Return the number of workers running.
+ */
+static int spawn(pool_t *pool) {
+    pthread_t tid;
+    
+    while (pool->live < pool->nthreads) {
+        if (pthread_create(&tid, NULL, worker, pool) != 0) {
+            perror("Pool - create worker");
+            break;
+        }
+        pool->live++;
+    }
+    return pool->live;
+}
+
+/*
+ * Init a pool instance with nthreads workers, running
+ * at most keycap jobs of a key at once (0 for no cap).
+ */
+pool_t *init_pool(int nthreads, int keycap) {
+    pool_t *pool = (pool_t *) calloc(1, sizeof(pool_t));
+    int live;
+    
+    if (!pool) {
+        perror("Init pool - malloc");
+        return NULL;
+    }
+    pool->nthreads = nthreads;
+    pool->keycap = keycap;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pthread_cond_init(&pool->exited, NULL);
+    
+    pthread_mutex_lock(&pool->lock);
+    live = spawn(pool);
+    pthread_mutex_unlock(&pool->lock);
+    
+    /* no worker at all */
+    if (live == 0) {
+        free_pool(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/*
+ * Free a pool instance.
+ * Queued jobs are run before the workers exit.
+ */
+void free_pool(pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->ready);
+    while (pool->live > 0) {
+        pthread_cond_wait(&pool->exited, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+    pthread_cond_destroy(&pool->exited);
+    free(pool);
+}
+
+/*
+ * Change the number of workers of the pool.
+ * Return the number of workers running or about to exit.
+ */
+int pool_resize(pool_t *pool, int nthreads) {
+    int live;
+    
+    if (nthreads <= 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->nthreads = nthreads;
+    live = spawn(pool);
+    /* idle surplus workers exit when woken */
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    return live;
+}
+
+/*
+ * Change the max number of running jobs per key.
+ */
+void pool_set_keycap(pool_t *pool, int keycap) {
+    pthread_mutex_lock(&pool->lock);
+    pool->keycap = keycap;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Queue fn(arg) to be run by a worker of the pool,
+ * as one of the jobs of key (NULL for none).
+ */
+int pool_submit_keyed(pool_t *pool, char *key, pool_fn fn, void *arg) {
+    p_job_t *job = (p_job_t *) malloc(sizeof(p_job_t));
+    p_queue_t *q;
+    
+    if (!job) {
+        perror("Pool submit - malloc");
+        return -1;
+    }
+    job->next = NULL;
+    job->fn = fn;
+    job->arg = arg;
+    
+    pthread_mutex_lock(&pool->lock);
+    if ((q = find_queue(pool, key)) == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        perror("Pool submit - queue");
+        free(job);
+        return -1;
+    }
+    if (q->tail) {
+        q->tail->next = job;
+    }
+    else {
+        q->head = job;
+    }
+    q->tail = job;
+    if (q->waiting++ == 0) {
+        ring_insert(pool, q);
+    }
+    pool->queued++;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    
+    return 0;
+}
+
+/*
+ * Queue fn(arg) to be run by a worker of the pool.
+ */
+int pool_submit(pool_t *pool, pool_fn fn, void *arg) {
+    return pool_submit_keyed(pool, NULL, fn, arg);
+}
+
+/*
+ * Number of jobs of the pool waiting for a worker.
+ */
+int pool_queued(pool_t *pool) {
+    int n;
+    
+    pthread_mutex_lock(&pool->lock);
+    n = pool->queued;
+    pthread_mutex_unlock(&pool->lock);
+    return n;
+}
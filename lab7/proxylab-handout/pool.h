@@ -0,0 +1,59 @@
+/**
+ * Header file for pool.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <pthread.h>
+
+#define POOL_ROWS 64            /* queue table rows */
+
+/* Job routine */
+typedef void (*pool_fn)(void *);
+
+/* The job struct */
+typedef struct p_job {
+    struct p_job *next;         /* queue next */
+    pool_fn fn;                 /* what to run */
+    void *arg;                  /* what to run it on */
+} p_job_t;
+
+/* The queue struct, one per key with jobs waiting or running */
+typedef struct p_queue {
+    struct p_queue *next;       /* queue table next */
+    struct p_queue *rr_next;    /* ring of queues with jobs waiting */
+    struct p_queue *rr_prev;
+    char *key;                  /* what the jobs share, NULL for none */
+    p_job_t *head;              /* next job to run */
+    p_job_t *tail;
+    int waiting;                /* number of queued jobs */
+    int running;                /* number of jobs being run */
+} p_queue_t;
+
+/* The pool struct */
+typedef struct {
+    int nthreads;               /* number of workers wanted */
+    int live;                   /* number of workers running */
+    int keycap;                 /* max running jobs per key, 0 for none */
+    p_queue_t *rows[POOL_ROWS]; /* queues by key */
+    p_queue_t *rr;              /* next queue to take a job from */
+    int queued;                 /* number of queued jobs */
+    int stop;                   /* set to let the workers exit */
+    pthread_mutex_t lock;       /* guards the queues */
+    pthread_cond_t ready;       /* signaled when a job may be taken */
+    pthread_cond_t exited;      /* signaled when a worker exits */
+} pool_t;
+
+pool_t *init_pool(int, int);
+void free_pool(pool_t *);
+int pool_submit(pool_t *, pool_fn, void *);
+int pool_submit_keyed(pool_t *, char *, pool_fn, void *);
+int pool_queued(pool_t *);
+int pool_resize(pool_t *, int);
+void pool_set_keycap(pool_t *, int);
+
+#endif /* __POOL_H__ */
@@ -0,0 +1,259 @@
+/**
+ * This file implements finding the sub-resources of a page.
+ * 
+ * A cached HTML response is scanned for src and href
+ * attributes. Links that stay on the same origin are
+ * resolved into absolute paths, the same way a browser would
+ * before requesting them, so they match the cache keys the
+ * browser's requests will produce. Everything else (other
+ * hosts, other schemes, fragments) is ignored.
+ * 
+ * The scanner is deliberately sloppy: it does not parse HTML,
+ * it only looks for attribute-looking text, so it also finds
+ * links in scripts and comments. Prefetching a useless link
+ * only costs a fetch.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include "prefetch.h"
+#include "debug.h"
+#include "util.h"
+
+#define PREFETCH_SEEN 64        /* links remembered to skip repeats */
+
+/*
+ * Find the end of the headers of a raw response.
+ * Return the offset of the body, or 0 if there is none.
+ */
+static size_t body_offset(char *res, size_t len) {
+    size_t i;
+    for (i = 0; i + 3 < len; i++) {
+        if (!memcmp(res + i, "\r\n\r\n", 4)) {
+            return i + 4;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Whether a raw response is a successful HTML page.
+ */
+int is_html(char *res, size_t len) {
+    size_t hdrlen = body_offset(res, len);
+    size_t i;
+    
+    if (hdrlen == 0 || len < 12 || memcmp(res + 9, "200", 3)) {
+        return 0;
+    }
+    for (i = 0; i + 24 < hdrlen; i++) {
+        if (res[i] == '\n' && 
+            !strncasecmp(res + i + 1, "content-type:", 13)) {
+            i += 14;
+            while (i < hdrlen && res[i] == ' ') {
+                i++;
+            }
+            return i + 9 < hdrlen && !strncasecmp(res + i, "text/html", 9);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Remove "." and ".." segments from an absolute path in place.
+ */
+static void normalize(char *path) {
+    char *in = path;
+    char *out = path;
+    
+    while (*in) {
+        if (!strncmp(in, "/./", 3)) {
+            in += 2;
+        }
+        else if (!strcmp(in, "/.")) {
+            in[1] = '\0';
+        }
+        else if (!strncmp(in, "/../", 4) || !strcmp(in, "/..")) {
+            /* drop the last output segment */
+            while (out > path && *--out != '/') {
+                ;
+            }
+            in += 3;
+            if (!*in) {
+                *out++ = '/';
+            }
+        }
+        else {
+            do {
+                *out++ = *in++;
+            } while (*in && *in != '/');
+        }
+    }
+    if (out == path) {
+        *out++ = '/';
+    }
+    *out = '\0';
+}
+
+/*
+ * Resolve a link found on the page at host + base into
+ * an absolute path on the same origin.
+ * Return 0 on success, -1 if the link leads elsewhere.
+ */
+static int resolve(char *link, char *host, char *base, char *path) {
+    char *p;
+    size_t hostlen = strlen(host);
+    size_t len;
+    
+    /* absolute or protocol relative: must be our host */
+    if (!strncasecmp(link, "http://", 7) || !strncmp(link, "//", 2)) {
+        link += link[0] == '/' ? 2 : 7;
+        if (strncasecmp(link, host, hostlen) ||
+            (link[hostlen] != '/' && link[hostlen] != '\0')) {
+            return -1;
+        }
+        link += hostlen;
+        if (!*link) {
+            link = "/";
+        }
+    }
+    
+    /* other schemes, fragments and queries of this very page */
+    for (p = link; *p && *p != '/'; p++) {
+        if (*p == ':') {
+            return -1;
+        }
+    }
+    if (!*link || *link == '#' || *link == '?') {
+        return -1;
+    }
+    
+    if (*link == '/') {
+        if (strlen(link) >= PREFETCH_URI_MAX) {
+            return -1;
+        }
+        strcpy(path, link);
+    }
+    /* relative to the directory of the page */
+    else {
+        p = strrchr(base, '/');
+        len = p ? (size_t)(p - base) + 1 : 0;
+        if (len + strlen(link) + 1 >= PREFETCH_URI_MAX) {
+            return -1;
+        }
+        if (len == 0) {
+            path[len++] = '/';
+        }
+        else {
+            memcpy(path, base, len);
+        }
+        strcpy(path + len, link);
+    }
+    
+    /* drop the fragment, the browser never sends it */
+    if ((p = strchr(path, '#'))) {
+        *p = '\0';
+    }
+    normalize(path);
+    return 0;
+}
+
+/*
+ * Copy an attribute value starting at s, at most max - 1 chars.
+ * Return the number of chars consumed from s.
+ */
+static size_t attr_value(char *s, char *end, char *out, size_t max) {
+    char quote = 0;
+    char *p = s;
+    size_t n = 0;
+    
+    if (p < end && (*p == '"' || *p == '\'')) {
+        quote = *p++;
+    }
+    while (p < end && *p != quote && *p != '>' &&
+           (quote || !isspace((unsigned char)*p))) {
+        if (n + 1 < max) {
+            out[n++] = *p;
+        }
+        /* a browser would decode the entity */
+        if (p + 5 <= end && !strncmp(p, "&amp;", 5)) {
+            p += 4;
+        }
+        p++;
+    }
+    out[n] = '\0';
+    return p - s;
+}
+
+/*
+ * Scan the raw HTML response res, served for the page
+ * host + base, and call fn on every same-origin link path.
+ * Return the number of links reported.
+ */
+int prefetch_scan(char *res, size_t len, char *host, char *base,
+                  prefetch_fn fn, void *arg) {
+    char *p = res + body_offset(res, len);
+    char *end = res + len;
+    char link[PREFETCH_URI_MAX];
+    char path[PREFETCH_URI_MAX];
+    unsigned seen[PREFETCH_SEEN];
+    unsigned h;
+    int nseen = 0;
+    int n = 0;
+    int i;
+    
+    while (p + 5 < end) {
+        /* attribute names start after a blank */
+        if (!isspace((unsigned char)*p++)) {
+            continue;
+        }
+        if (!strncasecmp(p, "src", 3)) {
+            p += 3;
+        }
+        else if (!strncasecmp(p, "href", 4)) {
+            p += 4;
+        }
+        else {
+            continue;
+        }
+        while (p < end && *p == ' ') {
+            p++;
+        }
+        if (p >= end || *p != '=') {
+            continue;
+        }
+        p++;
+        while (p < end && *p == ' ') {
+            p++;
+        }
+        p += attr_value(p, end, link, sizeof(link));
+        
+        if (resolve(link, host, base, path) < 0) {
+            continue;
+        }
+        
+        /* skip repeats */
+        h = hash_key(path);
+        for (i = 0; i < nseen && seen[i] != h; i++) {
+            ;
+        }
+        if (i < nseen) {
+            continue;
+        }
+        if (nseen < PREFETCH_SEEN) {
+            seen[nseen++] = h;
+        }
+        
+        dbg_printf("Prefetch candidate: %s%s\n", host, path);
+        n++;
+        if (fn(path, arg)) {
+            break;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,21 @@
+/**
+ * Header file for prefetch.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <stddef.h>
+
+#define PREFETCH_URI_MAX 2048   /* longest link path followed */
+
+/* Callback for every same-origin link path, stop by returning non-zero */
+typedef int (*prefetch_fn)(char *, void *);
+
+int is_html(char *, size_t);
+int prefetch_scan(char *, size_t, char *, char *, prefetch_fn, void *);
+
+#endif /* __PREFETCH_H__ */
@@ -9,39 +9,99 @@
  *      1. Configure in main;
  *      2. Run server, listen on a port;
  *      3. Accept a client connection;
- *      4. Spin up a thread to serve the client;
- *      5. The thread parses request, gets response from the cache
- *          or makes request to the real server, then forwards back
- *          the results.
+ *      4. Queue the client to the hit lane, a small pool that
+ *          parses the request and looks it up in the cache;
+ *      5. Hits are answered right there, so they never wait
+ *          behind slow origins; misses are queued to the miss
+ *          lane, a bigger pool that makes request to the real
+ *          server, then forwards back the results;
  *      6. Repeat 3 - 5 till the server gets shut down.
  * 
+ * Options can also come from a config file, which is read
+ * again on SIGHUP. Some of them (cache size, object size,
+ * lane sizes, ...) take effect at once; requests to
+ * /proxy/config from the local host show them and set
+ * them on a running server, e.g.
+ *      GET /proxy/config?cache-size=4194304&miss-workers=32
+ * Cached objects are purged with PURGE requests for their
+ * URL, or with /proxy/purge for a URL, a host, a URL prefix
+ * or a URL pattern, e.g.
+ *      GET /proxy/purge?prefix=http://example.com/assets/
+ * 
  * 
  * Liruoyang YU
  * liruoyay
  */
 
+#include <getopt.h>
+#include <poll.h>
 #include "csapp.h"
 #include "cache.h"
+#include "conn.h"
+#include "tunnel.h"
+#include "admit.h"
+#include "handoff.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "negcache.h"
+#include "mempress.h"
+#include "http.h"
 #include "contracts.h"
 #include "debug.h"
 
-/* Recommended max cache and object sizes */
+/* Recommended max cache and object sizes, the defaults */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+#define READ_CHUNK 102400       /* bytes read from servers at once */
 
 #define HOST_MAX_LEN 256
-#define PORT_MAX_LEN 5
-#define METHOD_MAX_LEN 5
+#define PORT_MAX_LEN 6
+#define METHOD_MAX_LEN 8
 #define VERSION_MAX_LEN 10
 #define URI_MAX_LEN 2048
 
+#define DRAIN_TIMEOUT 30        /* seconds to wait for in-flight requests */
+#define CLIENT_TIMEOUT 10       /* seconds a client may stall either way */
+#define HIT_WORKERS 8           /* default hit lane size */
+#define MISS_WORKERS 64         /* default miss lane size */
+#define ORIGIN_MAX 16           /* default max concurrent fetches per server */
+#define PREFETCH_BUDGET 16      /* default links prefetched per page */
+#define PREFETCH_QUEUE 256      /* max prefetches waiting */
+#define WARM_WORKERS 8          /* default warm-up concurrency */
+#define NEG_TTL_CONNECT 5000    /* default ms to remember dead origins */
+#define NEG_TTL_5XX 5000        /* default ms to remember 5xx responses */
+#define NEG_TTL_404 30000       /* default ms to remember 404 responses */
+#define CACHE_FLOOR 262144      /* default least capacity under pressure */
+#define CACHE_CEILING 1073741824    /* default most capacity when free */
+#define MEM_TARGET 90           /* default percent of the memory limit to use */
+#define MEM_INTERVAL 1000       /* ms between memory samples */
+#define MEM_SLACK 32            /* ignore capacity changes under 1/32 */
+
 #define BAD_REQUEST "405 BAD REQUEST"
 #define SERVER_ERROR "500 SERVER ERROR"
+#define TOO_MANY_REQUESTS "429 TOO MANY REQUESTS"
+#define SERVICE_UNAVAILABLE "503 SERVICE UNAVAILABLE"
+#define FORBIDDEN "403 FORBIDDEN"
+#define NOT_FOUND "404 NOT FOUND"
 
 #define EMPTY_LINE "\r\n"
 #define HD_IGNORE "connection:proxy-connection:user-agent"
 #define HD_HOST "host"
+#define HD_LENGTH "content-length"
+#define HD_ENCODING "transfer-encoding"
+#define HD_EXPECT "expect"
+#define CONTINUE "HTTP/1.1 100 Continue\r\n\r\n"
 #define HTTP_VERSION "HTTP/1.0"
+#define UPSTREAM_VERSION "HTTP/1.1"
+#define METHOD_GET "GET"
+#define METHOD_HEAD "HEAD"
+#define METHOD_CONNECT "CONNECT"
+#define TUNNEL_PORT "443"
+#define TUNNEL_ESTABLISHED "HTTP/1.1 200 Connection established\r\n\r\n"
+#define METHOD_PURGE "PURGE"
+#define ADMIN_CONFIG "/proxy/config"
+#define ADMIN_PURGE "/proxy/purge"
+#define RUNTIME_OPTS "tsHMoPc54COluT"  /* options that can change while running */
 
 /* 
  * Request type. 
@@ -54,8 +114,26 @@ typedef struct {
     char uri[URI_MAX_LEN];
     char headers[MAXLINE];
     char version[VERSION_MAX_LEN];
+    int local;                  /* origin form, addressed to the proxy */
+    long bodylen;               /* Content-Length of the body */
+    int chunked;                /* the body is chunked */
+    int expect;                 /* the client waits for 100 Continue */
+    rio_t rio;                  /* client buffer, may hold bytes after headers */
 } req_t;
 
+/*
+ * Client type.
+ * Instances carry a connection from the acceptor
+ * through the lanes serving it.
+ */
+typedef struct {
+    int fd;                             /* conn fd */
+    struct sockaddr_storage addr;       /* client address */
+    req_t req;                          /* the parsed request */
+    char cachekey[HOST_MAX_LEN + URI_MAX_LEN];  /* cache key */
+    unsigned long keyhash;              /* its cache_hash */
+} client_t;
+
 /*************************
  * Start global variables
  *************************/
@@ -66,17 +144,124 @@ User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) \
 Gecko/20120305 Firefox/10.0.3\r\n";
 /* Pointer to the cache instance */
 static cache_t *csh;
+/* Cache capacity and max cached object size */
+static size_t cachesize = MAX_CACHE_SIZE;
+static int maxobject = MAX_OBJECT_SIZE;
+/* Max number of cache shards */
+static int cacheshards = CACHE_SHARDS;
+/* Cache eviction policy */
+static int cachepolicy = CACHE_LRU;
+/* Put new objects only if asked for more than their victims */
+static int cacheadmit = 0;
+/* Have GDSF aim at byte hit ratio rather than hit ratio */
+static int cachebytes = 0;
+/* Follow the memory pressure, between floor and ceiling */
+static int memadapt = 0;
+static size_t cachefloor = CACHE_FLOOR;
+static size_t cacheceiling = CACHE_CEILING;
+/* Percent of the memory limit to keep the usage at */
+static int memtarget = MEM_TARGET;
+/* Config file, NULL if none */
+static char *configpath = NULL;
+/* Set by SIGHUP, the acceptor rereads the config file */
+static volatile sig_atomic_t reloading = 0;
+/* Serializes changing the configuration. Options workers read
+ * while serving are also stored and loaded atomically, with 
+ * OPT_STORE and OPT_LOAD */
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
 /* The listen fd. Made global for cleaning up */
 static int listenfd;
+/* Options for connecting to the real servers */
+static conn_opt_t connopt = {CONN_TIMEOUT_MS, CONN_STAGGER_MS};
+/* Per-client limits, all off by default */
+static admit_opt_t admitopt = {0, 0, 0};
+/* Per-client admission state */
+static admit_t *adm;
+/* Unix socket for handing over to a successor, NULL if disabled */
+static char *handoffpath = NULL;
+/* Seconds to finish in-flight requests for when stopping */
+static int draintimeout = DRAIN_TIMEOUT;
+/* Self pipe waking the acceptor up on stop signals */
+static int sigfds[2];
+/* Set once a stop signal has arrived */
+static volatile sig_atomic_t stopping = 0;
+/* Lane sizes */
+static int hitworkers = HIT_WORKERS;
+static int missworkers = MISS_WORKERS;
+/* Max concurrent fetches from one server, 0 for no limit */
+static int originmax = ORIGIN_MAX;
+/* Parses, looks up and answers hits; never talks to servers */
+static pool_t *hitpool;
+/* Fetches misses from the real servers */
+static pool_t *misspool;
+/* Prefetch concurrency, 0 disables prefetching */
+static int prefetchworkers = 0;
+/* Max links prefetched per page */
+static int prefetchbudget = PREFETCH_BUDGET;
+/* Fetches sub-resources of cached pages in the background */
+static pool_t *prefetchpool;
+/* URL manifest to warm the cache up with, NULL if none */
+static char *warmpath = NULL;
+/* Warm-up concurrency */
+static int warmworkers = WARM_WORKERS;
+/* Warm-up fetches started per second, 0 for no limit */
+static double warmrate = 0;
+/* Finish warming up before accepting */
+static int warmwait = 0;
+/* Recently failed origins and URLs */
+static negcache_t *neg;
+/* How long failures are remembered, in ms, 0 disables */
+static int negttlconnect = NEG_TTL_CONNECT;
+static int negttl5xx = NEG_TTL_5XX;
+static int negttl404 = NEG_TTL_404;
+/* Number of connections being served, and their lock */
+static int inflight = 0;
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inflight_done = PTHREAD_COND_INITIALIZER;
 /*************************
  * End global variables
  *************************/
  
-static void cleanup(void);
+/*
+ * Load an option a reload may change meanwhile.
+ */
+#define OPT_LOAD(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+/*
+ * Change an option workers may be reading.
+ */
+#define OPT_STORE(v, n) __atomic_store_n(&(v), (n), __ATOMIC_RELAXED)
+
+/*
+ * The connect options as they are now.
+ */
+static conn_opt_t conn_opts(void) {
+    conn_opt_t opt;
+    opt.timeout_ms = OPT_LOAD(connopt.timeout_ms);
+    opt.stagger_ms = OPT_LOAD(connopt.stagger_ms);
+    return opt;
+}
 
 /*************************
  * Start signal handlers
  *************************/
+/*
+ * Ask the acceptor to drain.
+ * The second request gives up on draining and exits.
+ */
+static void request_stop(void) {
+    int olderrno = errno;
+    
+    if (stopping) {
+        _exit(EXIT_FAILURE);
+    }
+    stopping = 1;
+    if (write(sigfds[1], "s", 1) < 0) {
+        /* the pipe is full, a wake up is pending anyway */
+    }
+    errno = olderrno;
+}
+
 /*
  * SIGPIPE handler.
  * Ignore sigpipe.
@@ -90,26 +275,41 @@ static void sigpipe_handler(int sig) {
 
 /*
  * SIGINT handler.
- * Clean up then exit.
+ * Drain then exit.
  */
 static void sigint_handler(int sig) {
 #ifdef DEBUG
     sio_puts("Received sigint\n");
 #endif
-    cleanup();
-    exit(0);
+    request_stop();
 }
 
 /*
  * SIGTERM handler.
- * Clean up then exit.
+ * Drain then exit.
  */
 static void sigterm_handler(int sig) {
 #ifdef DEBUG
     sio_puts("Received sigterm\n");
 #endif
-    cleanup();
-    exit(0);
+    request_stop();
+}
+
+/*
+ * SIGHUP handler.
+ * Ask the acceptor to reread the config file.
+ */
+static void sighup_handler(int sig) {
+    int olderrno = errno;
+    
+#ifdef DEBUG
+    sio_puts("Received sighup\n");
+#endif
+    reloading = 1;
+    if (write(sigfds[1], "r", 1) < 0) {
+        /* the pipe is full, a wake up is pending anyway */
+    }
+    errno = olderrno;
 }
 /*************************
  * End signal handlers
@@ -119,7 +319,79 @@ static void sigterm_handler(int sig) {
  * Print usage info.
  */
 static void usage() {
-    printf("Usage: proxy <port>\n");
+    printf("Usage: proxy [options] <port>\n");
+    printf("Options:\n");
+    printf("  --config <file>         read options from <file>, one "
+           "'name value' per line,\n");
+    printf("                          and again on SIGHUP\n");
+    printf("  --cache-size <bytes>    cache capacity (default %d)\n", 
+           MAX_CACHE_SIZE);
+    printf("  --max-object-size <bytes>  largest object cached "
+           "(default %d)\n", MAX_OBJECT_SIZE);
+    printf("  --cache-shards <n>      split the cache into at most <n> "
+           "locked shards\n");
+    printf("                          (default %d)\n", CACHE_SHARDS);
+    printf("  --cache-policy <name>   evict by 'lru' (default), 'clock', "
+           "'slru', 'arc',\n");
+    printf("                          's3fifo', 'wtinylfu' or 'gdsf'; "
+           "hits of 'clock'\n");
+    printf("                          and 's3fifo' don't lock out each "
+           "other\n");
+    printf("  --cache-objective <name>  what 'gdsf' keeps most of: "
+           "'hits' (default)\n");
+    printf("                          or 'bytes'\n");
+    printf("  --cache-admit           cache a new object only if it is "
+           "asked for more\n");
+    printf("                          often than those it would evict\n");
+    printf("  --mem-adapt             resize the cache with the memory "
+           "pressure,\n");
+    printf("                          starting at --cache-size\n");
+    printf("  --cache-floor <bytes>   least cache size under pressure "
+           "(default %d)\n", CACHE_FLOOR);
+    printf("  --cache-ceiling <bytes> most cache size, 0 for none "
+           "(default %d)\n", CACHE_CEILING);
+    printf("  --mem-target <percent>  keep memory usage at <percent> "
+           "of the limit (default %d)\n", MEM_TARGET);
+    printf("  --connect-timeout <ms>  give up connecting to a server "
+           "after <ms> (default %d)\n", CONN_TIMEOUT_MS);
+    printf("  --connect-stagger <ms>  race the next server address "
+           "after <ms> (default %d)\n", CONN_STAGGER_MS);
+    printf("  --rate <n>              accept <n> connections per second "
+           "per client\n");
+    printf("  --burst <n>             let clients burst <n> connections "
+           "over the rate\n");
+    printf("  --max-conns <n>         serve <n> connections at once "
+           "per client\n");
+    printf("  --handoff <path>        take over from the proxy listening "
+           "on Unix socket\n");
+    printf("                          <path> if any, then listen there "
+           "for a successor\n");
+    printf("  --drain-timeout <s>     wait <s> for in-flight requests "
+           "when stopping (default %d)\n", DRAIN_TIMEOUT);
+    printf("  --hit-workers <n>       threads parsing requests and "
+           "serving hits (default %d)\n", HIT_WORKERS);
+    printf("  --miss-workers <n>      max concurrent fetches from servers "
+           "(default %d)\n", MISS_WORKERS);
+    printf("  --origin-max <n>        max concurrent fetches from one server "
+           "(default %d)\n", ORIGIN_MAX);
+    printf("  --prefetch <n>          prefetch links of cached pages with "
+           "<n> threads\n");
+    printf("  --prefetch-budget <n>   prefetch at most <n> links per page "
+           "(default %d)\n", PREFETCH_BUDGET);
+    printf("  --warm <file>           fetch the URLs listed in <file> into "
+           "the cache at startup\n");
+    printf("  --warm-workers <n>      warm up with <n> threads "
+           "(default %d)\n", WARM_WORKERS);
+    printf("  --warm-rate <n>         start at most <n> warm-up fetches "
+           "per second\n");
+    printf("  --warm-wait             finish warming up before accepting "
+           "connections\n");
+    printf("  --neg-ttl-connect <ms>  remember servers failing to connect "
+           "for <ms> (default %d)\n", NEG_TTL_CONNECT);
+    printf("  --neg-ttl-5xx <ms>      remember 5xx responses for <ms> "
+           "(default %d)\n", NEG_TTL_5XX);
+    printf("  --neg-ttl-404 <ms>      remember 404 responses for <ms> "
+           "(default %d)\n", NEG_TTL_404);
     exit(EXIT_FAILURE);
 }
 
@@ -134,14 +406,20 @@ static void lower(char *str) {
 }
 
 /*
- * Clean up by closing the listen fd
- * and freeing the cache.
+ * Clean up by freeing the cache.
+ * Only safe once no thread is serving.
  */
 static void cleanup(void) {
-    if (close(listenfd) < 0) {
-        perror("Cleanup - close listenfd");
-    }
+    free_pool(hitpool);
+    free_pool(misspool);
+    free_pool(prefetchpool);
+    /* the memory sampler may still be around */
+    pthread_mutex_lock(&config_lock);
     free_cache(csh);
+    csh = NULL;
+    pthread_mutex_unlock(&config_lock);
+    free_negcache(neg);
+    free_admit(adm);
 }
 
 /*
@@ -178,34 +456,54 @@ static void resp_error(char *errstatus, int fd) {
 static int parse_req(int connfd, req_t *req) {
     ASSERT(req != NULL);
     
-    rio_t rio;
+    rio_t *rio = &req->rio;
     char buf[MAXLINE];
     char pair[2][MAXLINE];
-    char tmpuri[URI_MAX_LEN];
+    char target[URI_MAX_LEN];
     
     req->fd = connfd;
     
-    rio_readinitb(&rio, connfd);
+    rio_readinitb(rio, connfd);
     
     /* parse the first line */
-    if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0) {
         return -1;
     }
-    sscanf(buf, "%s http://%[^/ ]/%s %s", req->method, req->host,
-                tmpuri, req->version);
-                
-    /* deal with the http://hostname:port/ case */
-    if (strlen(req->version) == 0) {
-        strcpy(req->version, tmpuri);
-        strcpy(tmpuri, "");
-    }
     
-    /* append '/' before the uri */
-    strcpy(req->uri, "/");
-    strcat(req->uri, tmpuri);
+    /* tunnel request: CONNECT host:port version */
+    if (sscanf(buf, "%7s %255s %9s", req->method, req->host,
+               req->version) == 3 && !strcmp(req->method, METHOD_CONNECT)) {
+        /* the headers are meant for the proxy, skip them */
+        do {
+            if (rio_readlineb(rio, buf, MAXLINE) <= 0) {
+                return -1;
+            }
+        } while (strcmp(buf, EMPTY_LINE));
+        return 0;
+    }
+    strcpy(req->host, "");
+    strcpy(req->uri, "");
     
     /* malformatted request */
-    if (req->method == NULL || req->uri == NULL || req->version == NULL) {
+    if (sscanf(buf, "%7s %2047s %9s", req->method, target, 
+               req->version) != 3) {
+        return -1;
+    }
+    
+    /* absolute form: http://hostname[:port][/uri] */
+    if (!strncasecmp(target, "http://", 7)) {
+        sscanf(target + 7, "%255[^/]%2047s", req->host, req->uri);
+        /* deal with the http://hostname:port case */
+        if (strlen(req->uri) == 0) {
+            strcpy(req->uri, "/");
+        }
+    }
+    /* origin form: /uri, asking the proxy itself */
+    else if (target[0] == '/') {
+        strcpy(req->uri, target);
+        req->local = 1;
+    }
+    else {
         return -1;
     }
     
@@ -214,7 +512,7 @@ static int parse_req(int connfd, req_t *req) {
      **********************/
     /* append the default headers first */
     strcat(req->headers, CONST_HEADERS);
-    if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0) {
         return -1;
     }
     
@@ -227,11 +525,24 @@ static int parse_req(int connfd, req_t *req) {
         if (!strcmp(HD_HOST, pair[0])) {
             strcpy(req->host, pair[1]);
         }
+        /* answered by the proxy, not passed on */
+        else if (!strcmp(HD_EXPECT, pair[0])) {
+            lower(pair[1]);
+            req->expect = !strcmp(pair[1], "100-continue");
+        }
         /* not default header */
         else if (!strstr(HD_IGNORE, pair[0])) {
             strcat(req->headers, buf);
+            /* how the body is delimited */
+            if (!strcmp(HD_LENGTH, pair[0])) {
+                req->bodylen = atol(pair[1]);
+            }
+            else if (!strcmp(HD_ENCODING, pair[0])) {
+                lower(pair[1]);
+                req->chunked = strstr(pair[1], "chunked") != NULL;
+            }
         }
-        if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+        if (rio_readlineb(rio, buf, MAXLINE) <= 0) {
             return -1;
         }
     }
@@ -250,228 +561,1604 @@ static int parse_req(int connfd, req_t *req) {
     return 0;
 }
 
+/*
+ * Build a GET request for host + uri on behalf of the
+ * proxy itself, as parse_req would for a bare client.
+ */
+static void init_req(req_t *req, char *host, char *uri) {
+    req->fd = -1;
+    req->local = 0;
+    req->bodylen = 0;
+    req->chunked = 0;
+    req->expect = 0;
+    strcpy(req->method, "GET");
+    strcpy(req->host, host);
+    strcpy(req->uri, uri);
+    strcpy(req->version, HTTP_VERSION);
+    
+    strcpy(req->headers, CONST_HEADERS);
+    strcat(req->headers, "Host: ");
+    strcat(req->headers, host);
+    strcat(req->headers, EMPTY_LINE);
+    strcat(req->headers, EMPTY_LINE);
+}
+
 /*
  * Make a request to the host with the headers
- * in the given the request instance.
+ * in the given the request instance, streaming the
+ * request body from the client if there is one.
  */
-static int make_request(req_t req) {
+static int make_request(req_t *req) {
     char hostname[HOST_MAX_LEN];
     char port[PORT_MAX_LEN];
     int clientfd;
     char reqstr[MAXLINE];
     int reqlen;
+    conn_opt_t opt = conn_opts();
     
-    sscanf(req.host, "%[^:]:%[^:]", hostname, port);
+    strcpy(port, "");
+    sscanf(req->host, "%[^:]:%[^:]", hostname, port);
     if (strlen(port) == 0) {
         strcpy(port, "80");
     }
-    if ((clientfd = open_clientfd(hostname, port)) < 0) {
+    if ((clientfd = open_originfd(hostname, port, &opt)) < 0) {
+        /* spare the next requests the wait */
+        neg_put(neg, req->host, OPT_LOAD(negttlconnect), NULL, 0);
         return -1;
     }
     
-    sprintf(reqstr, "%s %s %s\r\n", req.method, req.uri, HTTP_VERSION);
-    sprintf(reqstr, "%s%s\r\n\r\n", reqstr, req.headers);
+    sprintf(reqstr, "%s %s %s\r\n", req->method, req->uri, UPSTREAM_VERSION);
+    /* the headers end with the empty line, the body follows */
+    strcat(reqstr, req->headers);
     
     reqlen = strlen(reqstr);
     
     if (rio_writen(clientfd, reqstr, reqlen) != reqlen) {
+        close(clientfd);
+        return -1;
+    }
+    
+    if (req->bodylen <= 0 && !req->chunked) {
+        return clientfd;
+    }
+    /* the client holds the body back until told to go on */
+    if (req->expect && 
+        rio_writen(req->fd, CONTINUE, strlen(CONTINUE)) < 0) {
+        close(clientfd);
+        return -1;
+    }
+    if (http_relay_body(&req->rio, clientfd, req->bodylen, 
+                        req->chunked) < 0) {
+        perror("Make request - body");
+        close(clientfd);
         return -1;
     }
     return clientfd;
 }
 
 /*
- * Core function for serving the client.
- * This is done by
- *      1. parsing the client's request;
- *      2. making request to the real server or getting from cache;
- *      3. forwarding responses to the client.
+ * Serve a CONNECT request by tunneling the client
+ * to the requested host:port.
+ * Errors before the tunnel is established are returned
+ * as -1, so the client still gets an error page.
  */
-static void serve(int connfd) {
-    req_t req;                  /* request instance */
-    char *err = NULL;           /* error status */
-    int responsefd;             /* fd for the real server */
-    rio_t rio;
-    int readlen;                /* number of bytes read into buffer */ 
-    char buf[MAX_OBJECT_SIZE];  /* buffer */
-    int reslen = 0;             /* response size */
-    char *res;                  /* potential cache */
+static int serve_tunnel(req_t *req) {
+    char hostname[HOST_MAX_LEN];
+    char port[PORT_MAX_LEN];
+    int serverfd;
+    int pending;
+    conn_opt_t opt = conn_opts();
     
-    char cachekey[HOST_MAX_LEN + URI_MAX_LEN];  /* cache key */
-    c_res_t *cacheres;          /* result obtained from cache */
+    strcpy(port, "");
+    sscanf(req->host, "%[^:]:%5[0-9]", hostname, port);
+    if (strlen(port) == 0) {
+        strcpy(port, TUNNEL_PORT);
+    }
+    if ((serverfd = open_originfd(hostname, port, &opt)) < 0) {
+        perror("Tunnel - connect");
+        return -1;
+    }
     
-    /* init struct req */
-    req.fd = 0;
-    strcpy(req.host, "");
-    strcpy(req.method, "");
-    strcpy(req.uri, "");
-    strcpy(req.headers, "");
-    strcpy(req.version, "");
-    
-    if (parse_req(connfd, &req) < 0) {
-        /* parsing failed */
-        err = BAD_REQUEST;
+    if (rio_writen(req->fd, TUNNEL_ESTABLISHED, 
+                   strlen(TUNNEL_ESTABLISHED)) < 0) {
+        perror("Tunnel - established");
+    }
+    /* bytes the client sent right after the headers */
+    else if ((pending = req->rio.rio_cnt) > 0 &&
+             rio_writen(serverfd, req->rio.rio_bufptr, pending) != pending) {
+        perror("Tunnel - pending bytes");
     }
     else {
-        /* try cache first */
-        strcpy(cachekey, req.host);
-        strcat(cachekey, req.uri);
-        /* cache hit */
-        if ((cacheres = get(csh, cachekey))) {
-            dbg_printf("Cache hit. Key: %s\n", cachekey);
-            res = cacheres->val;
-            reslen = cacheres->size;
-            if (rio_writen(connfd, res, reslen) != reslen) {
-                err = SERVER_ERROR;
-                perror("Writing response - cached");
-            }
-            dbg_printf("Respond with cache. Key: %s\n", cachekey);
-            /* malloced temporary results must be freed */
-            free(cacheres);
-        }
-        /* cache miss */
-        else {
-            dbg_printf("%s %s %s\r\n%s", req.method, 
-                        req.uri, req.version, req.headers);
-            if ((responsefd = make_request(req)) < 0) {
-                /* making request failed */
-                err = SERVER_ERROR;
-                perror("Make request error");
-            }
-            else {
-                dbg_printf("Started consuming reponse from remote server.\n\n");
-                
-                if ((res = malloc(MAX_OBJECT_SIZE))) {
-                    strcpy(res, "");
-                }
-                
-                Rio_readinitb(&rio, responsefd);
-                /* read from the real server */
-                while ((readlen = rio_readnb(&rio, buf, MAX_OBJECT_SIZE)) > 0) {
-                    /* cache only if not exceeding the object size limit */
-                    if (res && reslen + readlen <= MAX_OBJECT_SIZE) {
-                        memcpy(res + reslen, buf, readlen);
-                    }
-                    reslen += readlen;
-                    if (rio_writen(connfd, buf, readlen) != readlen) {
-                        err = SERVER_ERROR;
-                        perror("Writing response");
-                        break;
-                    }
-                }
-                if (close(responsefd) < 0) {
-                    perror("Close response fd");
-                }
-                
-                /* error occurred when reading */
-                if (readlen < 0) {
-                    err = SERVER_ERROR;
-                    perror("Reading response");
-                    if (res) {
-                        free(res);
-                    }
-                }
-                
-                /* eligible for caching */
-                if (!err && res && reslen <= MAX_OBJECT_SIZE) {
-                    res = realloc(res, reslen);
-                    if (put(csh, cachekey, res, reslen) == 0) {
-                        dbg_printf("Put cache succ. Key: %s, len: %d\n", 
-                                    cachekey, reslen);
-                    }
-                    else {
-                        dbg_printf("Put cache fail. Key: %s, len: %d\n", 
-                                    cachekey, reslen);
-                        free(res);
-                    }
-                }
-                /* not eligible for caching, 
-                 * but malloced temporary cache */
-                else if (res) {
-                    free(res);
-                }
-            }
+        dbg_printf("Tunnel to %s:%s established\n", hostname, port);
+        if (tunnel_relay(req->fd, serverfd) < 0) {
+            dbg_printf("Tunnel to %s:%s broken\n", hostname, port);
         }
     }
+    
+    if (close(serverfd) < 0) {
+        perror("Tunnel - close server fd");
+    }
+    return 0;
+}
+
+/*
+ * Count work a draining server has to wait for in or out,
+ * letting the server know when nothing is left.
+ */
+static void track_inflight(int delta) {
+    pthread_mutex_lock(&inflight_lock);
+    inflight += delta;
+    if (inflight == 0) {
+        pthread_cond_signal(&inflight_done);
+    }
+    pthread_mutex_unlock(&inflight_lock);
+}
+
+/*
+ * Done with a client: answer with the error page if
+ * err is set, close the connection and let go of it.
+ */
+static void finish(client_t *client, char *err) {
     /* error ocurred during serving */
     if (err) {
-        resp_error(err, connfd);
+        resp_error(err, client->fd);
     }
     /* normal */
     else {
-        if (close(connfd) < 0) {
+        if (close(client->fd) < 0) {
             perror("Serve - close conn fd");
         }
     }
+    admit_release(adm, (SA *) &client->addr);
+    free(client);
     
+    track_inflight(-1);
 }
 
 /*
- * New thread routine.
+ * Tunnel thread routine.
+ * Tunnels live as long as the client wants,
+ * so they get their own thread instead of a lane.
  */
-static void *new_thread(void *fd) {
-    /* obtain the passed conn fd */
-    int connfd = *(int *)fd;
+static void *tunnel_thread(void *arg) {
+    client_t *client = (client_t *)arg;
     pthread_detach(pthread_self());
-    serve(connfd);
+    finish(client, serve_tunnel(&client->req) < 0 ? SERVER_ERROR : NULL);
+    return NULL;
+}
+
+static void prefetch_page(req_t *, char *, int);
+
+/*
+ * How long to remember a response with the status
+ * instead of caching it, 0 if it should be cached.
+ */
+static int neg_ttl(int status) {
+    if (status == 404) {
+        return OPT_LOAD(negttl404);
+    }
+    if (status >= 500 && status < 600) {
+        return OPT_LOAD(negttl5xx);
+    }
+    return 0;
+}
+
+/*
+ * Cache a fetched response, or remember it as a failure.
+ * res is consumed.
+ */
+static void store_object(req_t *req, char *cachekey, unsigned long keyhash,
+                         int status, char *res, int reslen, int hdrlen, 
+                         int scan) {
+    int ttl = neg_ttl(status);
     
-    free(fd);
+    /* failures are only remembered for a while */
+    if (ttl > 0) {
+        neg_put(neg, cachekey, ttl, res, reslen);
+        free(res);
+        return;
+    }
     
-    return NULL;
+    /* scan before put, the cache may free it any time after */
+    if (scan && prefetchpool) {
+        prefetch_page(req, res, reslen);
+    }
+    if (put_hashed(csh, cachekey, keyhash, res, reslen, hdrlen) == 0) {
+        dbg_printf("Put cache succ. Key: %s, len: %d\n", 
+                    cachekey, reslen);
+    }
+    else {
+        dbg_printf("Put cache fail. Key: %s, len: %d\n", 
+                    cachekey, reslen);
+        free(res);
+    }
 }
 
 /*
- * Function for starting the server.
+ * Make request to the real server, forward the response
+ * to connfd (if not -1), and cache it if it is small
+ * enough. Pages are scanned for links to prefetch if
+ * scan is set.
+ * The body is decoded as it comes, and framed again for
+ * the client: chunked for HTTP/1.1 clients if its length
+ * is unknown. Cached copies carry the decoded length.
+ * keyhash is the cache_hash of cachekey.
+ * Return an error status, or NULL on success.
  */
-static void run_server(char *port) {
-    int *connfd;
-    int tmpfd;
+static char *fetch_object(req_t *req, char *cachekey, unsigned long keyhash, 
+                          int connfd, int scan) {
+    char *err = NULL;           /* error status */
+    int responsefd;             /* fd for the real server */
+    rio_t rio;
+    http_resp_t resp;           /* response head */
+    http_body_t body;           /* response body reader */
+    int readlen = 0;            /* number of bytes read into buffer */ 
+    char buf[READ_CHUNK];       /* buffer */
+    char *head;                 /* head sent on */
+    char *obj;                  /* head and body, to cache */
+    int headlen;
+    char *res = NULL;           /* potential cache, the body so far */
+    int reslen = 0;             /* decoded body size */
+    int chunked;                /* re-chunk for the client */
+    int maxobj = OPT_LOAD(maxobject);   /* may change meanwhile */
     
-#ifdef DEBUG
-    char clienthostname[MAXLINE], clientport[MAXLINE];
-#endif
+    /* larger ones don't fit a shard of the cache as it is now */
+    if ((size_t) maxobj > cache_max_entry(csh)) {
+        maxobj = (int) cache_max_entry(csh);
+    }
+    
+    dbg_printf("%s %s %s\r\n%s", req->method, 
+                req->uri, req->version, req->headers);
+    if ((responsefd = make_request(req)) < 0) {
+        /* making request failed */
+        perror("Make request error");
+        return SERVER_ERROR;
+    }
+    dbg_printf("Started consuming reponse from remote server.\n\n");
+    
+    Rio_readinitb(&rio, responsefd);
+    if (http_read_head(&rio, !strcmp(req->method, METHOD_HEAD), &resp) < 0) {
+        perror("Reading response head");
+        close(responsefd);
+        return SERVER_ERROR;
+    }
+    
+    /* forward the head */
+    chunked = (resp.mode == BODY_CHUNKED || resp.mode == BODY_CLOSE) && 
+        !strcmp(req->version, "HTTP/1.1");
+    if (connfd >= 0) {
+        if ((headlen = http_build_head(&resp, resp.length, 
+                                       chunked, &head)) < 0 || 
+            rio_writen(connfd, head, headlen) != headlen) {
+            err = SERVER_ERROR;
+            perror("Writing response head");
+        }
+        if (headlen >= 0) {
+            free(head);
+        }
+    }
+    
+    /* only full responses to GETs are cached */
+    if (!strcmp(req->method, METHOD_GET) && 
+        resp.status != 206 && resp.status != 304) {
+        res = malloc(maxobj);
+    }
+    
+    /* read the body from the real server */
+    http_body_init(&body, &rio, &resp);
+    while (!err && (readlen = http_body_read(&body, buf, READ_CHUNK)) > 0) {
+        /* cache only if not exceeding the object size limit */
+        if (res && reslen + readlen <= maxobj) {
+            memcpy(res + reslen, buf, readlen);
+        }
+        reslen += readlen;
+        if (connfd >= 0 && (chunked ? 
+                            http_chunk_write(connfd, buf, readlen) < 0 :
+                            rio_writen(connfd, buf, readlen) != readlen)) {
+            err = SERVER_ERROR;
+            perror("Writing response");
+        }
+    }
+    if (close(responsefd) < 0) {
+        perror("Close response fd");
+    }
+    
+    /* error occurred when reading */
+    if (!err && readlen < 0) {
+        err = SERVER_ERROR;
+        perror("Reading response");
+    }
+    /* the last chunk */
+    if (!err && chunked && connfd >= 0 && 
+        http_chunk_write(connfd, NULL, 0) < 0) {
+        err = SERVER_ERROR;
+        perror("Writing response");
+    }
+    
+    /* eligible for caching, with the decoded length */
+    if (!err && res && reslen <= maxobj && 
+        (headlen = http_build_head(&resp, reslen, 0, &head)) >= 0) {
+        if (headlen + reslen <= maxobj && 
+            (obj = realloc(head, headlen + reslen + 1))) {
+            memcpy(obj + headlen, res, reslen);
+            store_object(req, cachekey, keyhash, resp.status, obj, 
+                         headlen + reslen, headlen, scan);
+        }
+        else {
+            free(head);
+        }
+    }
+    free(res);
+    http_free_head(&resp);
+    
+    return err;
+}
 
-    struct sockaddr_storage sockaddr;
-    socklen_t socklen;
-    pthread_t tid;
+/*
+ * Miss lane routine.
+ * Fetch the object for the client.
+ */
+static void fetch(void *arg) {
+    client_t *client = (client_t *)arg;
     
-    listenfd = Open_listenfd(port);
+    finish(client, fetch_object(&client->req, client->cachekey, 
+                                client->keyhash, client->fd, 1));
+}
+
+/*
+ * Prefetch job type.
+ */
+typedef struct {
+    char host[HOST_MAX_LEN];
+    char uri[URI_MAX_LEN];
+} prefetch_t;
+
+/*
+ * Prefetch routine.
+ * Fetch a sub-resource into the cache unless it got
+ * there while the job was waiting.
+ */
+static void prefetch(void *arg) {
+    prefetch_t *job = (prefetch_t *)arg;
+    req_t *req;
+    char cachekey[HOST_MAX_LEN + URI_MAX_LEN];
+    unsigned long keyhash;
     
-    /* init the cache */
-    csh = init_cache(MAX_CACHE_SIZE);
+    strcpy(cachekey, job->host);
+    strcat(cachekey, job->uri);
+    keyhash = cache_hash(cachekey);
+    /* a peek, as a prefetch is no use of the entry; and 
+     * req_t is too big for comfort on the stack */
+    if (cache_contains(csh, cachekey, keyhash) == 0 &&
+        (req = malloc(sizeof(req_t)))) {
+        init_req(req, job->host, job->uri);
+        dbg_printf("Prefetching %s\n", cachekey);
+        fetch_object(req, cachekey, keyhash, -1, 0);
+        free(req);
+    }
+    free(job);
+}
+
+/*
+ * State of scanning one page for links.
+ */
+typedef struct {
+    char *host;                 /* host of the page */
+    int left;                   /* links left in the budget */
+} prefetch_ctx_t;
+
+/*
+ * prefetch_scan callback queueing one link.
+ */
+static int queue_prefetch(char *path, void *arg) {
+    prefetch_ctx_t *ctx = (prefetch_ctx_t *)arg;
+    prefetch_t *job;
+    char cachekey[HOST_MAX_LEN + URI_MAX_LEN];
     
-    while (1) {
-        socklen = sizeof(sockaddr);
-        
-        /* save the fd into a tmp so that nothing is malloced
-         * if the server is shut down when waiting for connection.*/
-        tmpfd = Accept(listenfd, (SA *) &sockaddr, &socklen);
-        connfd = malloc(sizeof(int));
-        *connfd = tmpfd;
-        
-#ifdef DEBUG
-        Getnameinfo((SA *) &sockaddr, socklen, 
-            clienthostname, MAXLINE, clientport, MAXLINE, 0);
-        dbg_printf("Got connection from: %s:%s\n", clienthostname, clientport);
-#endif
+    if (strlen(path) >= URI_MAX_LEN || 
+        pool_queued(prefetchpool) >= PREFETCH_QUEUE) {
+        return 0;
+    }
+    strcpy(cachekey, ctx->host);
+    strcat(cachekey, path);
+    if (cache_contains(csh, cachekey, cache_hash(cachekey)) != 0) {
+        return 0;
+    }
+    
+    if ((job = malloc(sizeof(prefetch_t))) == NULL) {
+        return 1;
+    }
+    strcpy(job->host, ctx->host);
+    strcpy(job->uri, path);
+    if (pool_submit_keyed(prefetchpool, job->host, prefetch, job) < 0) {
+        free(job);
+        return 1;
+    }
+    return --ctx->left <= 0;
+}
+
+/*
+ * Queue prefetches of the same-origin links of a page
+ * if the response is HTML.
+ */
+static void prefetch_page(req_t *req, char *res, int reslen) {
+    prefetch_ctx_t ctx;
+    
+    if (!is_html(res, reslen)) {
+        return;
+    }
+    ctx.host = req->host;
+    ctx.left = OPT_LOAD(prefetchbudget);
+    prefetch_scan(res, reslen, req->host, req->uri, queue_prefetch, &ctx);
+}
+
+static int set_runtime_opt(char *, char *);
+static void apply_config(void);
+static int dump_config(char *, size_t);
+static void reload_config(void);
+
+/*
+ * Whether a client connects from this host.
+ */
+static int is_loopback(struct sockaddr_storage *addr) {
+    struct sockaddr_in *in4 = (struct sockaddr_in *) addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+    
+    if (addr->ss_family == AF_INET) {
+        return (ntohl(in4->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr->ss_family == AF_INET6) {
+        return IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr) ||
+            (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr) && 
+             in6->sin6_addr.s6_addr[12] == 127);
+    }
+    return 0;
+}
+
+/*
+ * Respond with a plain text body.
+ */
+static void resp_text(int fd, char *body, int len) {
+    char head[MAXLINE];
+    
+    sprintf(head, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+            "Content-Length: %d\r\n\r\n", len);
+    if (rio_writen(fd, head, strlen(head)) < 0 || 
+        rio_writen(fd, body, len) < 0) {
+        perror("Writing response - text");
+    }
+}
 
-        if (pthread_create(&tid, NULL, new_thread, (void *)connfd) != 0) {
-            resp_error(SERVER_ERROR, *connfd);
-            free(connfd);
+/*
+ * Decode %XX escapes in place.
+ */
+static void url_decode(char *s) {
+    char *out = s;
+    unsigned c;
+    
+    for (; *s; s++) {
+        if (*s == '%' && isxdigit(s[1]) && isxdigit(s[2]) && 
+            sscanf(s + 1, "%2x", &c) == 1) {
+            *out++ = (char) c;
+            s += 2;
+        }
+        else {
+            *out++ = *s;
         }
     }
+    *out = '\0';
+}
+
+/*
+ * Turn a URL into the cache key it is stored under.
+ */
+static char *url_key(char *url) {
+    return strncasecmp(url, "http://", 7) ? url : url + 7;
+}
+
+/*
+ * Set the options given as name=value pairs, in order,
+ * up to the first bad one, then print the runtime options
+ * into body.
+ * Return an error status, or NULL on success.
+ */
+static char *admin_config(char *query, char *body, int *len) {
+    char *pair;
+    char *val;
+    char *save;
+    char *err = NULL;
     
-    if (close(listenfd) < 0) {
-        perror("Run server - close listen fd");
+    pthread_mutex_lock(&config_lock);
+    for (pair = query ? strtok_r(query, "&", &save) : NULL; pair; 
+         pair = strtok_r(NULL, "&", &save)) {
+        if ((val = strchr(pair, '=')) == NULL) {
+            err = BAD_REQUEST;
+            break;
+        }
+        *val++ = '\0';
+        if (set_runtime_opt(pair, val) < 0) {
+            err = BAD_REQUEST;
+            break;
+        }
+    }
+    if (query) {
+        apply_config();
     }
+    *len = dump_config(body, MAXBUF);
+    pthread_mutex_unlock(&config_lock);
+    return err;
+}
+
+/*
+ * Purge what the name=value pairs ask for: key=<url>,
+ * host=<host>, prefix=<url prefix>, pattern=<url pattern>.
+ * Print the number of cached objects purged into body.
+ * Return an error status, or NULL on success.
+ */
+static char *admin_purge(char *query, char *body, int *len) {
+    char key[HOST_MAX_LEN + URI_MAX_LEN];
+    char *pair;
+    char *val;
+    char *save;
+    int mode;
+    int n;
+    int total = 0;
     
-    /* free the cache */
-    free_cache(csh);
+    for (pair = query ? strtok_r(query, "&", &save) : NULL; pair; 
+         pair = strtok_r(NULL, "&", &save)) {
+        if ((val = strchr(pair, '=')) == NULL) {
+            return BAD_REQUEST;
+        }
+        *val++ = '\0';
+        url_decode(val);
+        if (strlen(val) + 1 >= sizeof(key)) {
+            return BAD_REQUEST;
+        }
+        strcpy(key, url_key(val));
+        
+        if (!strcmp(pair, "key")) {
+            mode = PURGE_EXACT;
+        }
+        /* everything cached under the host */
+        else if (!strcmp(pair, "host")) {
+            neg_forget(neg, key, 0);
+            strcat(key, "/");
+            mode = PURGE_PREFIX;
+        }
+        else if (!strcmp(pair, "prefix")) {
+            mode = PURGE_PREFIX;
+        }
+        else if (!strcmp(pair, "pattern")) {
+            mode = PURGE_GLOB;
+        }
+        else {
+            return BAD_REQUEST;
+        }
+        
+        if (mode != PURGE_GLOB) {
+            neg_forget(neg, key, mode == PURGE_PREFIX);
+        }
+        if ((n = cache_purge(csh, key, mode)) < 0) {
+            return SERVER_ERROR;
+        }
+        dbg_printf("Purged %d under %s\n", n, key);
+        total += n;
+    }
+    *len = sprintf(body, "purged %d\n", total);
+    return NULL;
 }
 
-int main(int argc, char **argv)
+/*
+ * Serve a request addressed to the proxy itself.
+ * GET /proxy/config shows and sets the runtime options,
+ * GET /proxy/purge drops cached objects.
+ * Return an error status, or NULL on success.
+ */
+static char *serve_admin(client_t *client) {
+    req_t *req = &client->req;
+    char body[MAXBUF];
+    char *query;
+    char *err;
+    int len = 0;
+    
+    if (!is_loopback(&client->addr)) {
+        return FORBIDDEN;
+    }
+    if ((query = strchr(req->uri, '?'))) {
+        *query++ = '\0';
+    }
+    if (!strcmp(req->uri, ADMIN_CONFIG)) {
+        err = admin_config(query, body, &len);
+    }
+    else if (!strcmp(req->uri, ADMIN_PURGE)) {
+        err = admin_purge(query, body, &len);
+    }
+    else {
+        return NOT_FOUND;
+    }
+    
+    if (!err) {
+        resp_text(client->fd, body, len);
+    }
+    return err;
+}
+
+/*
+ * Serve a PURGE request by dropping the cached object.
+ * Return an error status, or NULL on success.
+ */
+static char *serve_purge(client_t *client) {
+    char body[MAXLINE];
+    int n;
+    
+    if (!is_loopback(&client->addr)) {
+        return FORBIDDEN;
+    }
+    neg_forget(neg, client->cachekey, 0);
+    if ((n = cache_purge(csh, client->cachekey, PURGE_EXACT)) < 0) {
+        return SERVER_ERROR;
+    }
+    /* nothing was cached */
+    if (n == 0) {
+        return NOT_FOUND;
+    }
+    resp_text(client->fd, body, sprintf(body, "purged %d\n", n));
+    return NULL;
+}
+
+/*
+ * Hit lane routine, the core function for serving the client.
+ * This is done by
+ *      1. parsing the client's request;
+ *      2. getting from cache, or handing the client to the
+ *          miss lane to make request to the real server;
+ *      3. forwarding cached responses to the client.
+ */
+static void serve(void *arg) {
+    client_t *client = (client_t *)arg;
+    req_t *req = &client->req;
+    int connfd = client->fd;
+    char *cachekey = client->cachekey;
+    char *err = NULL;           /* error status */
+    int reslen;                 /* response size */
+    char *res;                  /* cached response */
+    c_res_t *cacheres = NULL;   /* result obtained from cache */
+    int cacheable;              /* only GETs are cached */
+    void *negres;               /* remembered failure response */
+    size_t neglen;              /* its size */
+    ssize_t n;                  /* bytes written */
+    struct timeval timeout = {CLIENT_TIMEOUT, 0};
+    pthread_t tid;
+    
+    /* init struct req */
+    req->fd = 0;
+    strcpy(req->host, "");
+    strcpy(req->method, "");
+    strcpy(req->uri, "");
+    strcpy(req->headers, "");
+    strcpy(req->version, "");
+    req->local = 0;
+    req->bodylen = 0;
+    req->chunked = 0;
+    req->expect = 0;
+    
+    /* a stalled client must not pin a hit lane worker, 
+     * neither sending the request nor reading the response */
+    if (setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, 
+                   &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, 
+                   &timeout, sizeof(timeout)) < 0) {
+        perror("Serve - client timeout");
+    }
+    
+    if (parse_req(connfd, req) < 0) {
+        /* parsing failed */
+        finish(client, BAD_REQUEST);
+        return;
+    }
+    
+    /* not meant to be proxied */
+    if (req->local) {
+        finish(client, serve_admin(client));
+        return;
+    }
+    
+    /* https and friends */
+    if (!strcmp(req->method, METHOD_CONNECT)) {
+        if (pthread_create(&tid, NULL, tunnel_thread, client) != 0) {
+            finish(client, SERVER_ERROR);
+        }
+        return;
+    }
+    
+    /* try cache first, hashing the key once for all lanes */
+    strcpy(cachekey, req->host);
+    strcat(cachekey, req->uri);
+    client->keyhash = cache_hash(cachekey);
+    
+    if (!strcmp(req->method, METHOD_PURGE)) {
+        finish(client, serve_purge(client));
+        return;
+    }
+    cacheable = !strcmp(req->method, METHOD_GET);
+    
+    /* cache miss */
+    if (!cacheable || 
+        !(cacheres = get_hashed(csh, cachekey, client->keyhash))) {
+        /* known to fail, answer from memory */
+        if (neg_get(neg, req->host, &negres, &neglen) ||
+            (cacheable && neg_get(neg, cachekey, &negres, &neglen))) {
+            dbg_printf("Negative hit. Key: %s\n", cachekey);
+            if (!negres) {
+                err = SERVER_ERROR;
+            }
+            else if ((n = rio_writen(connfd, negres, neglen)) < 0 ||
+                     (size_t) n != neglen) {
+                perror("Writing response - negative");
+            }
+            free(negres);
+            finish(client, err);
+        }
+        /* waits in line with the other fetches from the server */
+        else if (pool_submit_keyed(misspool, req->host, fetch, client) < 0) {
+            finish(client, SERVER_ERROR);
+        }
+        return;
+    }
+    
+    /* cache hit */
+    dbg_printf("Cache hit. Key: %s\n", cachekey);
+    res = cacheres->val;
+    reslen = cacheres->size;
+    if (rio_writen(connfd, res, reslen) != reslen ||
+        (n = rio_writen(connfd, cacheres->body, cacheres->bodysize)) < 0 ||
+        (size_t) n != cacheres->bodysize) {
+        err = SERVER_ERROR;
+        perror("Writing response - cached");
+    }
+    dbg_printf("Respond with cache. Key: %s\n", cachekey);
+    /* unpin the entry */
+    cache_release(cacheres);
+    
+    finish(client, err);
+}
+
+/*
+ * Warm-up item type.
+ */
+typedef struct {
+    char host[HOST_MAX_LEN];
+    char uri[URI_MAX_LEN];
+    int ok;                     /* fetched, or found cached */
+    int size;                   /* size of the object */
+} warm_t;
+
+/*
+ * Warm-up routine.
+ * Fetch one manifest URL through the miss path.
+ */
+static void warm_one(void *arg) {
+    warm_t *item = (warm_t *)arg;
+    req_t *req;
+    char cachekey[HOST_MAX_LEN + URI_MAX_LEN];
+    unsigned long keyhash;
+    c_res_t *cacheres;
+    
+    strcpy(cachekey, item->host);
+    strcat(cachekey, item->uri);
+    keyhash = cache_hash(cachekey);
+    
+    /* a predecessor may have handed it over already */
+    if (!(cacheres = get_hashed(csh, cachekey, keyhash))) {
+        if ((req = malloc(sizeof(req_t))) == NULL) {
+            return;
+        }
+        init_req(req, item->host, item->uri);
+        item->ok = fetch_object(req, cachekey, keyhash, -1, 0) == NULL;
+        free(req);
+        cacheres = get_hashed(csh, cachekey, keyhash);
+    }
+    else {
+        item->ok = 1;
+    }
+    if (cacheres) {
+        item->size = cacheres->size + cacheres->bodysize;
+        cache_release(cacheres);
+    }
+}
+
+/*
+ * Read the URL manifest at warmpath, one absolute URL
+ * per line. Blank lines and lines starting with '#' are
+ * skipped. Return the number of items read into *items.
+ */
+static int read_manifest(warm_t **items) {
+    FILE *fp;
+    char line[MAXLINE];
+    char tmpuri[URI_MAX_LEN];
+    warm_t *tmp;
+    warm_t *item;
+    int cap = 0;
+    int n = 0;
+    
+    *items = NULL;
+    if ((fp = fopen(warmpath, "r")) == NULL) {
+        perror("Warm up - open manifest");
+        return 0;
+    }
+    while (fgets(line, MAXLINE, fp)) {
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            if ((tmp = realloc(*items, cap * sizeof(warm_t))) == NULL) {
+                perror("Warm up - malloc");
+                break;
+            }
+            *items = tmp;
+        }
+        item = &(*items)[n];
+        strcpy(tmpuri, "");
+        if (sscanf(line, "http://%255[^/ \r\n]/%2046s", 
+                   item->host, tmpuri) < 1) {
+            fprintf(stderr, "Warm up - skipping %s", line);
+            continue;
+        }
+        strcpy(item->uri, "/");
+        strcat(item->uri, tmpuri);
+        item->ok = 0;
+        item->size = 0;
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+/*
+ * Warm the cache up with the manifest, then report how
+ * long it took and how much of it ended up cached.
+ */
+static void warm_up(void) {
+    warm_t *items;
+    pool_t *warmpool;
+    struct timespec start;
+    struct timespec end;
+    struct timespec gap;
+    char cachekey[HOST_MAX_LEN + URI_MAX_LEN];
+    c_res_t *cacheres;
+    double secs;
+    long bytes = 0;
+    int fetched = 0;
+    int cached = 0;
+    int n;
+    int i;
+    
+    if ((n = read_manifest(&items)) == 0 || 
+        (warmpool = init_pool(warmworkers, OPT_LOAD(originmax))) == NULL) {
+        free(items);
+        track_inflight(-1);
+        return;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n && !stopping; i++) {
+        if (pool_submit_keyed(warmpool, items[i].host, 
+                              warm_one, &items[i]) < 0) {
+            break;
+        }
+        /* rate limit by spacing the fetches out */
+        if (warmrate > 0) {
+            gap.tv_sec = (time_t)(1 / warmrate);
+            gap.tv_nsec = (long)((1 / warmrate - gap.tv_sec) * 1e9);
+            nanosleep(&gap, NULL);
+        }
+    }
+    /* runs the queue dry before returning */
+    free_pool(warmpool);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    /* what is still there after everything went in */
+    for (i = 0; i < n; i++) {
+        if (!items[i].ok) {
+            continue;
+        }
+        fetched++;
+        strcpy(cachekey, items[i].host);
+        strcat(cachekey, items[i].uri);
+        if ((cacheres = get(csh, cachekey))) {
+            cached++;
+            bytes += cacheres->size + cacheres->bodysize;
+            cache_release(cacheres);
+        }
+    }
+    
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Warm up: %d URLs, %d fetched, %d cached (%.1f%%), "
+           "%ld bytes in %.3fs\n", n, fetched, cached, 
+           100.0 * cached / n, bytes, secs);
+    fflush(stdout);
+    
+    free(items);
+    track_inflight(-1);
+}
+
+/*
+ * Warm-up thread routine.
+ */
+static void *warm_thread(void *arg) {
+    pthread_detach(pthread_self());
+    warm_up();
+    return NULL;
+}
+
+/*
+ * Make the cache as large as cachesize says. A shard only
+ * takes objects up to its slice of the capacity, so tell
+ * when objects up to the max object size stop fitting in,
+ * and when they fit again.
+ * Must be called with the config lock held.
+ */
+static void resize_cache(void) {
+    static int small = 0;       /* told they don't fit */
+    size_t most;
+    
+    cache_set_cap(csh, cachesize);
+    most = cache_max_entry(csh);
+    if (!small && most < (size_t) maxobject) {
+        fprintf(stderr, "Cache - objects over %lu bytes not cached "
+                "until the cache grows\n", (unsigned long) most);
+    }
+    else if (small && most >= (size_t) maxobject) {
+        fprintf(stderr, "Cache - objects up to %d bytes cached again\n", 
+                maxobject);
+    }
+    small = most < (size_t) maxobject;
+}
+
+/*
+ * Memory sampler thread routine.
+ * Move the cache capacity along with the memory pressure,
+ * leaving small changes be.
+ */
+static void *mem_thread(void *arg) {
+    mem_usage_t mem;
+    size_t cap;
+    
+    pthread_detach(pthread_self());
+    while (1) {
+        if (mem_sample(&mem) == 0) {
+            pthread_mutex_lock(&config_lock);
+            if (!csh) {
+                pthread_mutex_unlock(&config_lock);
+                return NULL;
+            }
+            cap = mem_target_cap(&mem, cache_size(csh), memtarget, 
+                                 cachefloor, cacheceiling);
+            if (cap + cachesize / MEM_SLACK < cachesize || 
+                cap > cachesize + cachesize / MEM_SLACK) {
+                dbg_printf("Memory %lu of %lu, cache %lu -> %lu\n", 
+                           (unsigned long) mem.used, 
+                           (unsigned long) mem.limit, 
+                           (unsigned long) cachesize, 
+                           (unsigned long) cap);
+                cachesize = cap;
+                resize_cache();
+            }
+            pthread_mutex_unlock(&config_lock);
+        }
+        usleep(MEM_INTERVAL * 1000);
+    }
+}
+
+/*
+ * Hand an accepted connection to the hit lane,
+ * unless the client is over its limits.
+ */
+static void dispatch(int connfd, struct sockaddr_storage *sockaddr) {
+    client_t *client;
+    
+    /* turn abusive clients away before spending a thread */
+    switch (admit_acquire(adm, (SA *) sockaddr)) {
+    case ADMIT_RATE:
+        dbg_printf("Rate limited\n");
+        resp_error(TOO_MANY_REQUESTS, connfd);
+        return;
+    case ADMIT_CONN:
+        dbg_printf("Too many connections\n");
+        resp_error(SERVICE_UNAVAILABLE, connfd);
+        return;
+    }
+    
+    if ((client = malloc(sizeof(client_t))) == NULL) {
+        admit_release(adm, (SA *) sockaddr);
+        resp_error(SERVER_ERROR, connfd);
+        return;
+    }
+    client->fd = connfd;
+    client->addr = *sockaddr;
+    
+    track_inflight(1);
+
+    if (pool_submit(hitpool, serve, client) < 0) {
+        admit_release(adm, (SA *) sockaddr);
+        resp_error(SERVER_ERROR, client->fd);
+        free(client);
+        track_inflight(-1);
+    }
+}
+
+/*
+ * Stop accepting, wait for the in-flight requests
+ * to finish (at most draintimeout seconds), then exit.
+ */
+static void drain(int handofffd, int handedoff) {
+    struct timespec deadline;
+    int left;
+    
+    if (close(listenfd) < 0) {
+        perror("Drain - close listen fd");
+    }
+    if (handofffd >= 0) {
+        close(handofffd);
+        /* the successor owns the path now */
+        if (!handedoff) {
+            unlink(handoffpath);
+        }
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += draintimeout;
+    
+    pthread_mutex_lock(&inflight_lock);
+    while (inflight > 0) {
+        dbg_printf("Draining %d connections\n", inflight);
+        if (pthread_cond_timedwait(&inflight_done, &inflight_lock, 
+                                   &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    left = inflight;
+    pthread_mutex_unlock(&inflight_lock);
+    
+    /* threads still running may use the cache, leave it to exit */
+    if (left == 0) {
+        cleanup();
+    }
+    else {
+        fprintf(stderr, "Drain timed out, %d connections dropped\n", left);
+    }
+    exit(0);
+}
+
+/*
+ * Function for starting the server.
+ */
+static void run_server(char *port) {
+    int tmpfd;
+    int handofffd = -1;         /* where a successor shows up */
+    int handedoff = 0;          /* a successor took over */
+    size_t shards;              /* cache shards */
+    int policy = cachepolicy | (cacheadmit ? CACHE_ADMIT : 0) | 
+                 (cachebytes ? CACHE_BYTES : 0);
+    struct pollfd pfds[3];
+    char sigbuf[16];            /* wake ups from signal handlers */
+    pthread_t tid;
+    
+#ifdef DEBUG
+    char clienthostname[MAXLINE], clientport[MAXLINE];
+#endif
+
+    struct sockaddr_storage sockaddr;
+    socklen_t socklen;
+    
+    /* init the cache, each shard holding the largest object */
+    shards = cachesize / maxobject;
+    if (shards > (size_t) cacheshards) {
+        shards = cacheshards;
+    }
+    if ((csh = init_cache(cachesize, (int) shards, policy)) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    
+    /* init the admission control */
+    if ((adm = init_admit(&admitopt)) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    
+    /* init the negative cache */
+    if ((neg = init_negcache()) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    
+    /* init the lanes */
+    if ((hitpool = init_pool(hitworkers, 0)) == NULL ||
+        (misspool = init_pool(missworkers, originmax)) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    if (prefetchworkers > 0 && 
+        (prefetchpool = init_pool(prefetchworkers, originmax)) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    
+    if (pipe(sigfds) < 0 || fcntl(sigfds[1], F_SETFL, O_NONBLOCK) < 0) {
+        perror("Run server - signal pipe");
+        exit(EXIT_FAILURE);
+    }
+    
+    /* take over from a running predecessor, or start afresh */
+    if (handoffpath && (tmpfd = handoff_connect(handoffpath)) >= 0) {
+        listenfd = handoff_recv(tmpfd, csh);
+        close(tmpfd);
+        if (listenfd < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        listenfd = Open_listenfd(port);
+    }
+    if (handoffpath && (handofffd = handoff_listen(handoffpath)) < 0) {
+        perror("Run server - handoff socket");
+    }
+    
+    /* the listen fd may be shared with a predecessor or successor,
+     * so never block in accept on a connection the other one took */
+    if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("Run server - nonblock listen fd");
+    }
+    
+    if (memadapt && pthread_create(&tid, NULL, mem_thread, NULL) != 0) {
+        perror("Run server - memory sampler");
+    }
+    
+    /* a draining server waits for the warm-up like for a request */
+    if (warmpath) {
+        track_inflight(1);
+        if (warmwait) {
+            warm_up();
+        }
+        else if (pthread_create(&tid, NULL, warm_thread, NULL) != 0) {
+            perror("Run server - warm up");
+            track_inflight(-1);
+        }
+    }
+    
+    pfds[0].fd = listenfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = sigfds[0];
+    pfds[1].events = POLLIN;
+    pfds[2].fd = handofffd;
+    pfds[2].events = POLLIN;
+    
+    while (!stopping) {
+        if (poll(pfds, 3, -1) < 0) {
+            if (errno != EINTR) {
+                perror("Run server - poll");
+            }
+            continue;
+        }
+        
+        /* a signal came in */
+        if (pfds[1].revents & POLLIN) {
+            if (read(sigfds[0], sigbuf, sizeof(sigbuf)) < 0) {
+                perror("Run server - signal pipe");
+            }
+            if (reloading && !stopping) {
+                reloading = 0;
+                reload_config();
+            }
+        }
+        
+        /* a successor wants to take over */
+        if (pfds[2].revents & POLLIN) {
+            if ((tmpfd = accept(handofffd, NULL, NULL)) >= 0) {
+                dbg_printf("Handing over to a successor\n");
+                handedoff = handoff_send(tmpfd, listenfd, csh) == 0;
+                close(tmpfd);
+                if (handedoff) {
+                    break;
+                }
+            }
+        }
+        
+        if (!(pfds[0].revents & POLLIN)) {
+            continue;
+        }
+        socklen = sizeof(sockaddr);
+        if ((tmpfd = accept(listenfd, (SA *) &sockaddr, &socklen)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Run server - accept");
+            }
+            continue;
+        }
+        
+#ifdef DEBUG
+        Getnameinfo((SA *) &sockaddr, socklen, 
+            clienthostname, MAXLINE, clientport, MAXLINE, 0);
+        dbg_printf("Got connection from: %s:%s\n", clienthostname, clientport);
+#endif
+
+        dispatch(tmpfd, &sockaddr);
+    }
+    
+    drain(handofffd, handedoff);
+}
+
+/* Command line options, also the names used by config files */
+static struct option longopts[] = {
+    {"connect-timeout", required_argument, NULL, 't'},
+    {"connect-stagger", required_argument, NULL, 's'},
+    {"rate", required_argument, NULL, 'r'},
+    {"burst", required_argument, NULL, 'b'},
+    {"max-conns", required_argument, NULL, 'm'},
+    {"handoff", required_argument, NULL, 'h'},
+    {"drain-timeout", required_argument, NULL, 'd'},
+    {"hit-workers", required_argument, NULL, 'H'},
+    {"miss-workers", required_argument, NULL, 'M'},
+    {"origin-max", required_argument, NULL, 'o'},
+    {"prefetch", required_argument, NULL, 'p'},
+    {"prefetch-budget", required_argument, NULL, 'P'},
+    {"warm", required_argument, NULL, 'w'},
+    {"warm-workers", required_argument, NULL, 'W'},
+    {"warm-rate", required_argument, NULL, 'R'},
+    {"warm-wait", no_argument, NULL, 'A'},
+    {"neg-ttl-connect", required_argument, NULL, 'c'},
+    {"neg-ttl-5xx", required_argument, NULL, '5'},
+    {"neg-ttl-404", required_argument, NULL, '4'},
+    {"cache-size", required_argument, NULL, 'C'},
+    {"max-object-size", required_argument, NULL, 'O'},
+    {"config", required_argument, NULL, 'f'},
+    {"mem-adapt", no_argument, NULL, 'a'},
+    {"cache-floor", required_argument, NULL, 'l'},
+    {"cache-ceiling", required_argument, NULL, 'u'},
+    {"mem-target", required_argument, NULL, 'T'},
+    {"cache-shards", required_argument, NULL, 'S'},
+    {"cache-policy", required_argument, NULL, 'E'},
+    {"cache-admit", no_argument, NULL, 'L'},
+    {"cache-objective", required_argument, NULL, 'G'},
+    {NULL, 0, NULL, 0}
+};
+
+static int load_config(char *, int);
+
+/*
+ * Set the option with short code c to arg.
+ * Bad values leave the option as it is.
+ * Return 0 on success, -1 on bad values.
+ */
+static int set_opt(int c, char *arg) {
+    int n = arg ? atoi(arg) : 0;
+    double d = arg ? atof(arg) : 0;
+    
+    switch (c) {
+    case 't':
+        if (n <= 0) {
+            return -1;
+        }
+        OPT_STORE(connopt.timeout_ms, n);
+        break;
+    case 's':
+        if (n < 0) {
+            return -1;
+        }
+        OPT_STORE(connopt.stagger_ms, n);
+        break;
+    case 'r':
+        if (d < 0) {
+            return -1;
+        }
+        admitopt.rate = d;
+        break;
+    case 'b':
+        if (d < 0) {
+            return -1;
+        }
+        admitopt.burst = d;
+        break;
+    case 'm':
+        if (n < 0) {
+            return -1;
+        }
+        admitopt.maxconn = n;
+        break;
+    case 'h':
+        handoffpath = strdup(arg);
+        break;
+    case 'd':
+        if (n < 0) {
+            return -1;
+        }
+        draintimeout = n;
+        break;
+    case 'H':
+        if (n <= 0) {
+            return -1;
+        }
+        hitworkers = n;
+        break;
+    case 'M':
+        if (n <= 0) {
+            return -1;
+        }
+        missworkers = n;
+        break;
+    case 'o':
+        if (n < 0) {
+            return -1;
+        }
+        OPT_STORE(originmax, n);
+        break;
+    case 'p':
+        if (n < 0) {
+            return -1;
+        }
+        prefetchworkers = n;
+        break;
+    case 'P':
+        if (n <= 0) {
+            return -1;
+        }
+        OPT_STORE(prefetchbudget, n);
+        break;
+    case 'w':
+        warmpath = strdup(arg);
+        break;
+    case 'W':
+        if (n <= 0) {
+            return -1;
+        }
+        warmworkers = n;
+        break;
+    case 'R':
+        if (d < 0) {
+            return -1;
+        }
+        warmrate = d;
+        break;
+    case 'A':
+        warmwait = 1;
+        break;
+    case 'c':
+        if (n < 0) {
+            return -1;
+        }
+        OPT_STORE(negttlconnect, n);
+        break;
+    case '5':
+        if (n < 0) {
+            return -1;
+        }
+        OPT_STORE(negttl5xx, n);
+        break;
+    case '4':
+        if (n < 0) {
+            return -1;
+        }
+        OPT_STORE(negttl404, n);
+        break;
+    case 'C':
+        if (d < 1) {
+            return -1;
+        }
+        cachesize = (size_t) d;
+        break;
+    case 'O':
+        if (n <= 0) {
+            return -1;
+        }
+        OPT_STORE(maxobject, n);
+        break;
+    case 'a':
+        memadapt = 1;
+        break;
+    case 'L':
+        cacheadmit = 1;
+        break;
+    case 'l':
+        if (d < 1) {
+            return -1;
+        }
+        cachefloor = (size_t) d;
+        break;
+    case 'u':
+        if (d < 0) {
+            return -1;
+        }
+        cacheceiling = (size_t) d;
+        break;
+    case 'T':
+        if (n <= 0 || n > 100) {
+            return -1;
+        }
+        memtarget = n;
+        break;
+    case 'S':
+        if (n <= 0) {
+            return -1;
+        }
+        cacheshards = n;
+        break;
+    case 'E':
+        if ((n = cache_policy(arg)) < 0) {
+            return -1;
+        }
+        cachepolicy = n;
+        break;
+    case 'G':
+        if (!strcmp(arg, "hits")) {
+            cachebytes = 0;
+        }
+        else if (!strcmp(arg, "bytes")) {
+            cachebytes = 1;
+        }
+        else {
+            return -1;
+        }
+        break;
+    case 'f':
+        configpath = strdup(arg);
+        return load_config(configpath, 0);
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Find the option called name.
+ */
+static struct option *find_opt(char *name) {
+    struct option *opt;
+    
+    for (opt = longopts; opt->name; opt++) {
+        if (!strcmp(opt->name, name)) {
+            return opt;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Set an option of a running server by name.
+ * Must be called with the config lock held.
+ * Return 0 on success, -1 on unknown names, options
+ * that need a restart, and bad values.
+ */
+static int set_runtime_opt(char *name, char *arg) {
+    struct option *opt = find_opt(name);
+    
+    if (!opt || !strchr(RUNTIME_OPTS, opt->val)) {
+        fprintf(stderr, "Config - %s can't be changed while running\n", 
+                name);
+        return -1;
+    }
+    return set_opt(opt->val, arg);
+}
+
+/*
+ * Read options from the config file at path, one
+ * "name value" per line, named like the command line
+ * options. Blank lines and lines starting with '#' are
+ * skipped. A running server only takes the options
+ * that can change while running, leaving the others.
+ * Return 0 on success, -1 on errors.
+ */
+static int load_config(char *path, int running) {
+    FILE *fp;
+    char line[MAXLINE];
+    char name[MAXLINE];
+    char arg[MAXLINE];
+    struct option *opt;
+    int lineno = 0;
+    int rc = 0;
+    int n;
+    
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror("Config - open");
+        return -1;
+    }
+    while (fgets(line, MAXLINE, fp)) {
+        lineno++;
+        if ((n = sscanf(line, "%s %s", name, arg)) < 1 || name[0] == '#') {
+            continue;
+        }
+        opt = find_opt(name);
+        /* the rest was taken at startup */
+        if (running && opt && !strchr(RUNTIME_OPTS, opt->val)) {
+            continue;
+        }
+        if (!opt || opt->val == 'f' ||
+            (opt->has_arg == required_argument && n < 2) ||
+            set_opt(opt->val, n < 2 ? NULL : arg) < 0) {
+            fprintf(stderr, "Config - %s:%d: bad option %s\n", 
+                    path, lineno, name);
+            rc = -1;
+        }
+    }
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * Make the running server use the current options.
+ * Must be called with the config lock held.
+ */
+static void apply_config(void) {
+    pool_resize(hitpool, hitworkers);
+    pool_resize(misspool, missworkers);
+    pool_set_keycap(misspool, originmax);
+    if (prefetchpool) {
+        pool_set_keycap(prefetchpool, originmax);
+    }
+    resize_cache();
+}
+
+/*
+ * Print the options that can change while running
+ * into buf, in config file format.
+ * Return the length printed.
+ */
+static int dump_config(char *buf, size_t len) {
+    int n = snprintf(buf, len, 
+                     "cache-size %lu\n"
+                     "max-object-size %d\n"
+                     "hit-workers %d\n"
+                     "miss-workers %d\n"
+                     "origin-max %d\n"
+                     "prefetch-budget %d\n"
+                     "connect-timeout %d\n"
+                     "connect-stagger %d\n"
+                     "neg-ttl-connect %d\n"
+                     "neg-ttl-5xx %d\n"
+                     "neg-ttl-404 %d\n"
+                     "cache-floor %lu\n"
+                     "cache-ceiling %lu\n"
+                     "mem-target %d\n",
+                     (unsigned long) cachesize, maxobject, hitworkers, 
+                     missworkers, originmax, prefetchbudget, 
+                     connopt.timeout_ms, connopt.stagger_ms, 
+                     negttlconnect, negttl5xx, negttl404, 
+                     (unsigned long) cachefloor, 
+                     (unsigned long) cacheceiling, memtarget);
+    return n < (int) len ? n : (int) len - 1;
+}
+
+/*
+ * Reread the config file on a running server.
+ */
+static void reload_config(void) {
+    if (!configpath) {
+        fprintf(stderr, "Config - no config file to reload\n");
+        return;
+    }
+    pthread_mutex_lock(&config_lock);
+    if (load_config(configpath, 1) < 0) {
+        fprintf(stderr, "Config - %s partly applied\n", configpath);
+    }
+    apply_config();
+    pthread_mutex_unlock(&config_lock);
+}
+
+/*
+ * Parse the command line options into the globals.
+ * Return the index of the first non-option argument.
+ */
+static int parse_opts(int argc, char **argv) {
+    int c;
+    
+    while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        if (set_opt(c, optarg) < 0) {
+            usage();
+        }
+    }
+    return optind;
+}
+
+int main(int argc, char **argv)
 {
-    if (argc < 2 || atoi(argv[1]) == 0) {
+    int argi = parse_opts(argc, argv);
+    
+    if (argi >= argc || atoi(argv[argi]) == 0) {
         usage();
     }
     
@@ -479,9 +2166,10 @@ int main(int argc, char **argv)
     Signal(SIGINT,  sigint_handler);
     Signal(SIGTERM,  sigterm_handler);
     Signal(SIGPIPE,  sigpipe_handler);
+    Signal(SIGHUP,  sighup_handler);
     
-    /* argv[1] is the port to listen on */
-    run_server(argv[1]);
+    /* the first argument is the port to listen on */
+    run_server(argv[argi]);
     
     return 0;
 }
@@ -0,0 +1,225 @@
+/**
+ * This file tests purging the cache by key, prefix and
+ * shell pattern (cache_purge), which walks the crit-bit key
+ * index of each shard. Keys are paths made of segments
+ * sharing prefixes, some with pattern characters in them.
+ * Random purges are checked against a plain scan of the
+ * keys, under every eviction policy: the number of entries
+ * removed, and which keys are left.
+ *
+ * Usage: purgetest
+ *
+ *
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <fnmatch.h>
+#include "cache.h"
+#include "epoch.h"
+#include "check.h"
+
+#define HOSTS 4                 /* hosts of the keys */
+#define NSEGS 10                /* path segments */
+#define DEPTH 3                 /* most segments of a path */
+#define NKEYS (HOSTS * (NSEGS + NSEGS * NSEGS + NSEGS * NSEGS * NSEGS))
+#define MAX_KEY 64              /* room for a key or a pattern */
+#define HEAD 16                 /* per-key part of each entry */
+#define BODY 48                 /* body of each entry */
+#define ROUNDS 300              /* purges per policy */
+#define SEED 0x2545f4914f6cdd1dUL   /* seed of the generator */
+
+/*************************
+ * Start global variables
+ *************************/
+/* Path segments, some prefixes of others, some patterns */
+static char *segs[NSEGS] = {"a", "ab", "abc", "b", "img", "img2",
+                            "x.png", "x.jpg", "[1]", "?q=1"};
+static char keys[NKEYS][MAX_KEY];
+static int alive[NKEYS];        /* whether the key is in the cache */
+static unsigned long rnd = SEED;
+/*************************
+ * End global variables
+ *************************/
+
+/*
+ * Next number of a xorshift generator.
+ */
+static unsigned long next_rand(void) {
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    return rnd;
+}
+
+/*
+ * Make every key: each host, then each path of up to
+ * DEPTH segments.
+ */
+static void make_keys(void) {
+    int n = 0;
+    int h, i, j, k;
+    
+    for (h = 0; h < HOSTS; h++) {
+        for (i = 0; i < NSEGS; i++) {
+            sprintf(keys[n++], "h%d/%s", h, segs[i]);
+            for (j = 0; j < NSEGS; j++) {
+                sprintf(keys[n++], "h%d/%s/%s", h, segs[i], segs[j]);
+                for (k = 0; k < NSEGS; k++) {
+                    sprintf(keys[n++], "h%d/%s/%s/%s", h, segs[i],
+                            segs[j], segs[k]);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Put every key missing from the cache back in. One entry
+ * in five has the same body as the others that do.
+ */
+static void fill(cache_t *c) {
+    char *val;
+    int i;
+    
+    for (i = 0; i < NKEYS; i++) {
+        if (alive[i]) {
+            continue;
+        }
+        val = malloc(HEAD + BODY);
+        memset(val, 0, HEAD + BODY);
+        snprintf(val, HEAD, "%d", i);
+        snprintf(val + HEAD, BODY, "%d", i % 5 ? i : 0);
+        if (put(c, keys[i], val, HEAD + BODY, HEAD) < 0) {
+            free(val);
+        }
+        else {
+            alive[i] = 1;
+        }
+    }
+}
+
+/*
+ * Make a random purge of the keys into pattern, and return
+ * its mode. Prefixes and patterns start as a key cut
+ * anywhere, so they cut through segments and bytes.
+ */
+static int make_purge(char *pattern) {
+    char *key = keys[next_rand() % NKEYS];
+    size_t len = strlen(key);
+    size_t cut = next_rand() % (len + 1);
+    size_t from;
+    
+    switch (next_rand() % 4) {
+    case 0:
+        strcpy(pattern, key);
+        /* now and then a key never cached */
+        if (next_rand() % 4 == 0) {
+            strcat(pattern, "/none");
+        }
+        return PURGE_EXACT;
+    case 1:
+        sprintf(pattern, "%.*s", (int) cut, key);
+        return PURGE_PREFIX;
+    case 2:
+        /* cut*tail of the key */
+        from = cut + next_rand() % (len - cut + 1);
+        sprintf(pattern, "%.*s*%s", (int) cut, key, key + from);
+        return PURGE_GLOB;
+    default:
+        /* one byte of the key any, or in a class */
+        if (cut == len) {
+            cut = 0;
+        }
+        if (next_rand() % 2) {
+            sprintf(pattern, "%.*s?%s", (int) cut, key, key + cut + 1);
+        }
+        else {
+            sprintf(pattern, "%.*s[a-c1]%s", (int) cut, key,
+                    key + cut + 1);
+        }
+        return PURGE_GLOB;
+    }
+}
+
+/*
+ * Whether the purge of pattern in mode removes key.
+ */
+static int purges(char *pattern, int mode, char *key) {
+    switch (mode) {
+    case PURGE_EXACT:
+        return !strcmp(key, pattern);
+    case PURGE_PREFIX:
+        return !strncmp(key, pattern, strlen(pattern));
+    default:
+        return !fnmatch(pattern, key, 0);
+    }
+}
+
+/*
+ * Purge at random from a cache of the policy, checking
+ * each purge against a scan of the keys.
+ */
+static void test_policy(int policy) {
+    cache_t *c = init_cache(16 << 20, CACHE_SHARDS, policy);
+    char pattern[2 * MAX_KEY];
+    int mode, n, want, left;
+    int r, i;
+    
+    memset(alive, 0, sizeof(alive));
+    fill(c);
+    for (i = 0; i < NKEYS; i++) {
+        CHECK(alive[i]);
+    }
+    
+    for (r = 0; r < ROUNDS; r++) {
+        mode = make_purge(pattern);
+        want = 0;
+        for (i = 0; i < NKEYS; i++) {
+            if (alive[i] && purges(pattern, mode, keys[i])) {
+                alive[i] = 0;
+                want++;
+            }
+        }
+        n = cache_purge(c, pattern, mode);
+        if (n != want) {
+            fprintf(stderr, "policy %d: purging %s (mode %d) removed "
+                    "%d, not %d\n", policy, pattern, mode, n, want);
+        }
+        CHECK(n == want);
+    
+        left = 0;
+        for (i = 0; i < NKEYS; i++) {
+            left += cache_contains(c, keys[i], cache_hash(keys[i])) ==
+                    alive[i];
+        }
+        CHECK(left == NKEYS);
+    
+        /* purged keys go back in, into the index again */
+        if (r % 10 == 9) {
+            fill(c);
+        }
+    }
+    
+    /* the empty prefix takes everything */
+    want = 0;
+    for (i = 0; i < NKEYS; i++) {
+        want += alive[i];
+    }
+    CHECK(cache_purge(c, "", PURGE_PREFIX) == want);
+    CHECK(cache_purge(c, "*", PURGE_GLOB) == 0);
+    epoch_barrier();
+    CHECK(cache_size(c) == 0);
+    free_cache(c);
+}
+
+int main(void)
+{
+    int policy;
+    
+    make_keys();
+    for (policy = CACHE_LRU; policy <= CACHE_GDSF; policy++) {
+        test_policy(policy);
+    }
+    return check_done("purgetest");
+}
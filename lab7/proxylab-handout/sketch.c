@@ -0,0 +1,195 @@
+/**
+ * This file implements a frequency sketch.
+ * 
+ * It estimates how often a key hash was added lately, in a
+ * fixed amount of memory: a count-min sketch. Each key has
+ * a counter in each of SKETCH_DEPTH rows, picked by hashing
+ * it again per row; adding bumps the smallest of them, and
+ * the estimate is the smallest, which other keys may have
+ * bumped too but never bring down. Counters stop at 
+ * SKETCH_MAX, which is all that is needed to tell popular
+ * keys apart from the others.
+ * 
+ * There are SKETCH_SPREAD counters per row for each key
+ * expected, so that most counters count one key only.
+ * Every SKETCH_SAMPLE additions per key all counters are
+ * halved, so that keys popular long ago fade away.
+ * 
+ * Most keys are only ever seen once. The first addition of
+ * a key only sets its bits in a bloom filter, the doorkeeper,
+ * and the counters only count from the second one on, so
+ * those keys don't crowd them. The doorkeeper is cleared on
+ * aging; the estimate of a key in it is one more.
+ * 
+ * Counters are read and written with relaxed atomics, not
+ * locked: additions racing each other may be lost, which
+ * an estimate can live with.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "sketch.h"
+
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+/* Odd multipliers hashing a key again for each row */
+static const unsigned long seeds[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL,
+    0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL
+};
+
+/*
+ * Init a sketch for about keys keys.
+ */
+int init_sketch(sketch_t *s, unsigned long keys) {
+    s->width = 1;
+    while (s->width < keys * SKETCH_SPREAD) {
+        s->width *= 2;
+    }
+    s->sample = keys * SKETCH_SAMPLE;
+    s->doorbits = LONG_BITS;
+    while (s->doorbits < s->sample * SKETCH_DOOR) {
+        s->doorbits *= 2;
+    }
+    s->adds = 0;
+    s->counts = (unsigned char *) calloc(SKETCH_DEPTH, s->width);
+    s->door = (unsigned long *) calloc(s->doorbits / LONG_BITS, 
+                                       sizeof(unsigned long));
+    if (!s->counts || !s->door) {
+        perror("Init sketch - malloc");
+        free_sketch(s);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Free the counters of a sketch.
+ */
+void free_sketch(sketch_t *s) {
+    free(s->counts);
+    free(s->door);
+    s->counts = NULL;
+    s->door = NULL;
+}
+
+/*
+ * The counter of a key hash in row i.
+ */
+static inline unsigned char *counter(sketch_t *s, unsigned long h, int i) {
+    unsigned long x = h * seeds[i];
+    return &s->counts[i * s->width + ((x >> 32) & (s->width - 1))];
+}
+
+/*
+ * Doorkeeper bit i of a key hash, of two.
+ */
+static inline unsigned long door_bit(sketch_t *s, unsigned long h, int i) {
+    return (i ? h >> 32 : h * seeds[0] >> 32) & (s->doorbits - 1);
+}
+
+/*
+ * Whether a key hash is in the doorkeeper.
+ */
+static int door_has(sketch_t *s, unsigned long h) {
+    unsigned long b;
+    int i;
+    
+    for (i = 0; i < 2; i++) {
+        b = door_bit(s, h, i);
+        if (!(__atomic_load_n(&s->door[b / LONG_BITS], __ATOMIC_RELAXED) & 
+              1UL << b % LONG_BITS)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Put a key hash into the doorkeeper. Return 1 if it was
+ * in already.
+ */
+static int door_add(sketch_t *s, unsigned long h) {
+    unsigned long b, old;
+    int had = 1;
+    int i;
+    
+    for (i = 0; i < 2; i++) {
+        b = door_bit(s, h, i);
+        old = __atomic_fetch_or(&s->door[b / LONG_BITS], 1UL << b % LONG_BITS,
+                                __ATOMIC_RELAXED);
+        had &= (old >> b % LONG_BITS) & 1;
+    }
+    return had;
+}
+
+/*
+ * Halve all the counters and clear the doorkeeper.
+ */
+static void age(sketch_t *s) {
+    unsigned long i;
+    
+    for (i = 0; i < SKETCH_DEPTH * s->width; i++) {
+        __atomic_store_n(&s->counts[i], 
+                         __atomic_load_n(&s->counts[i], __ATOMIC_RELAXED) >> 1,
+                         __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < s->doorbits / LONG_BITS; i++) {
+        __atomic_store_n(&s->door[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * The smallest counter of a key hash.
+ */
+static int count_min(sketch_t *s, unsigned long h) {
+    int min = SKETCH_MAX;
+    int c;
+    int i;
+    
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        if ((c = __atomic_load_n(counter(s, h, i), __ATOMIC_RELAXED)) < min) {
+            min = c;
+        }
+    }
+    return min;
+}
+
+/*
+ * Estimate how often a key hash was added lately.
+ */
+int sketch_estimate(sketch_t *s, unsigned long h) {
+    return count_min(s, h) + door_has(s, h);
+}
+
+/*
+ * Count a key hash once more. Only the counters at the
+ * smallest value are bumped, the others already count
+ * more than the key did.
+ */
+void sketch_add(sketch_t *s, unsigned long h) {
+    unsigned long sample = s->sample;
+    int min = count_min(s, h);
+    unsigned char *c;
+    int i;
+    
+    /* the first time only the doorkeeper takes it */
+    if (door_add(s, h) && min < SKETCH_MAX) {
+        for (i = 0; i < SKETCH_DEPTH; i++) {
+            c = counter(s, h, i);
+            if (__atomic_load_n(c, __ATOMIC_RELAXED) == min) {
+                __atomic_store_n(c, min + 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    
+    /* halving the counters halves what they sum up to */
+    if (__atomic_add_fetch(&s->adds, 1, __ATOMIC_RELAXED) == sample) {
+        age(s);
+        __atomic_sub_fetch(&s->adds, sample / 2, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,33 @@
+/**
+ * Header file for sketch.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#define SKETCH_DEPTH 4          /* counters per key, one in each row */
+#define SKETCH_MAX 15           /* counters stop counting here */
+#define SKETCH_SPREAD 8         /* counters per row for each key */
+#define SKETCH_SAMPLE 10        /* additions per key before aging */
+#define SKETCH_DOOR 4           /* doorkeeper bits per addition of a sample */
+
+/* The frequency sketch struct (count-min, with a doorkeeper) */
+typedef struct {
+    unsigned char *counts;      /* SKETCH_DEPTH rows of width counters */
+    unsigned long width;        /* counters per row, a power of two */
+    unsigned long *door;        /* keys seen once since the last aging 
+                                   (bloom filter) */
+    unsigned long doorbits;     /* bits of the doorkeeper, a power of two */
+    unsigned long sample;       /* additions between agings */
+    unsigned long adds;         /* additions since the last aging */
+} sketch_t;
+
+int init_sketch(sketch_t *, unsigned long);
+void free_sketch(sketch_t *);
+void sketch_add(sketch_t *, unsigned long);
+int sketch_estimate(sketch_t *, unsigned long);
+
+#endif /* __SKETCH_H__ */
@@ -0,0 +1,276 @@
+/**
+ * This file implements the byte relay behind CONNECT tunnels.
+ * 
+ * Bytes never enter user space: each direction owns a pipe,
+ * and splice(2) moves data from the source socket into the
+ * pipe and from the pipe into the destination socket.
+ * Both sockets are non-blocking and multiplexed with poll(2)
+ * in the thread serving the client, so a tunnel costs one
+ * worker thread and two pipes.
+ * 
+ * A direction is shut down (write side of the destination)
+ * after its source hits EOF and its pipe is drained, so
+ * half-closed connections work. The tunnel ends when both
+ * directions are done, on any error, or when it has been
+ * idle for TUNNEL_IDLE_MS.
+ * 
+ * tunnel_splice moves a known number of bytes one way the
+ * same way, blocking, for relaying request bodies.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "tunnel.h"
+#include "debug.h"
+
+#define TUNNEL_CHUNK 65536      /* max bytes parked in a pipe */
+#define EV_IN (POLLIN | POLLHUP | POLLERR)      /* readable or broken */
+#define EV_OUT (POLLOUT | POLLHUP | POLLERR)    /* writable or broken */
+
+/* One direction of the tunnel */
+typedef struct {
+    int from;                   /* source socket */
+    int to;                     /* destination socket */
+    int pipe[2];                /* kernel buffer between the two */
+    size_t inpipe;              /* bytes sitting in the pipe */
+    int eof;                    /* source reached end of stream */
+    int done;                   /* destination has been shut down */
+} pump_t;
+
+/*
+ * Set O_NONBLOCK on a fd.
+ */
+static int set_nonblock(int fd) {
+    int flags;
+    
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Init a pump from one socket to another.
+ */
+static int init_pump(pump_t *p, int from, int to) {
+    p->from = from;
+    p->to = to;
+    p->inpipe = 0;
+    p->eof = 0;
+    p->done = 0;
+    return pipe2(p->pipe, O_NONBLOCK | O_CLOEXEC);
+}
+
+/*
+ * Events of interest of a pump on its two sockets.
+ */
+static void pump_events(pump_t *p, short *fromev, short *toev) {
+    if (!p->eof && p->inpipe < TUNNEL_CHUNK) {
+        *fromev |= POLLIN;
+    }
+    if (p->inpipe > 0) {
+        *toev |= POLLOUT;
+    }
+}
+
+/*
+ * Move whatever can be moved without blocking.
+ * Return -1 on errors.
+ */
+static int pump_step(pump_t *p, short fromrev, short torev) {
+    ssize_t n;
+    
+    /* source -> pipe */
+    if (!p->eof && p->inpipe < TUNNEL_CHUNK && fromrev) {
+        n = splice(p->from, NULL, p->pipe[1], NULL, TUNNEL_CHUNK - p->inpipe,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            p->inpipe += n;
+        }
+        else if (n == 0) {
+            p->eof = 1;
+        }
+        else if (errno != EAGAIN && errno != EINTR) {
+            perror("Tunnel - splice in");
+            return -1;
+        }
+    }
+    
+    /* pipe -> destination, also when the source just filled the pipe */
+    if (p->inpipe > 0 && (torev || fromrev)) {
+        n = splice(p->pipe[0], NULL, p->to, NULL, p->inpipe,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            p->inpipe -= n;
+        }
+        else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            perror("Tunnel - splice out");
+            return -1;
+        }
+    }
+    
+    /* pass the half close on */
+    if (p->eof && p->inpipe == 0 && !p->done) {
+        shutdown(p->to, SHUT_WR);
+        p->done = 1;
+    }
+    return 0;
+}
+
+/*
+ * Relay bytes between clientfd and serverfd in both
+ * directions until the tunnel ends.
+ * Neither fd is closed.
+ * Return 0 if both sides finished cleanly, -1 otherwise.
+ */
+int tunnel_relay(int clientfd, int serverfd) {
+    pump_t up;                  /* client -> server */
+    pump_t down;                /* server -> client */
+    struct pollfd pfds[2];
+    int rc = -1;
+    int n;
+    
+    if (set_nonblock(clientfd) < 0 || set_nonblock(serverfd) < 0) {
+        perror("Tunnel - nonblock");
+        return -1;
+    }
+    if (init_pump(&up, clientfd, serverfd) < 0) {
+        perror("Tunnel - pipe");
+        return -1;
+    }
+    if (init_pump(&down, serverfd, clientfd) < 0) {
+        perror("Tunnel - pipe");
+        close(up.pipe[0]);
+        close(up.pipe[1]);
+        return -1;
+    }
+    
+    while (!up.done || !down.done) {
+        pfds[0].events = 0;
+        pfds[1].events = 0;
+        pump_events(&up, &pfds[0].events, &pfds[1].events);
+        pump_events(&down, &pfds[1].events, &pfds[0].events);
+        /* a socket nobody waits on must not wake us with POLLHUP */
+        pfds[0].fd = pfds[0].events ? clientfd : -1;
+        pfds[1].fd = pfds[1].events ? serverfd : -1;
+        
+        if ((n = poll(pfds, 2, TUNNEL_IDLE_MS)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Tunnel - poll");
+            break;
+        }
+        if (n == 0) {
+            dbg_printf("Tunnel idle, closing\n");
+            break;
+        }
+        
+        if (pump_step(&up, pfds[0].revents & EV_IN,
+                      pfds[1].revents & EV_OUT) < 0 ||
+            pump_step(&down, pfds[1].revents & EV_IN,
+                      pfds[0].revents & EV_OUT) < 0) {
+            break;
+        }
+    }
+    if (up.done && down.done) {
+        rc = 0;
+    }
+    
+    close(up.pipe[0]);
+    close(up.pipe[1]);
+    close(down.pipe[0]);
+    close(down.pipe[1]);
+    return rc;
+}
+
+/*
+ * Copy n bytes from fromfd to tofd through user space.
+ * Return 0 on success, -1 on errors.
+ */
+static int copy_n(int fromfd, int tofd, long n) {
+    char buf[TUNNEL_CHUNK / 8];
+    ssize_t len;
+    ssize_t out;
+    ssize_t done;
+    
+    while (n > 0) {
+        len = read(fromfd, buf, 
+                   n < (long) sizeof(buf) ? n : (long) sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        /* cut short */
+        if (len <= 0) {
+            return -1;
+        }
+        for (done = 0; done < len; done += out) {
+            if ((out = write(tofd, buf + done, len - done)) < 0) {
+                if (errno == EINTR) {
+                    out = 0;
+                    continue;
+                }
+                return -1;
+            }
+        }
+        n -= len;
+    }
+    return 0;
+}
+
+/*
+ * Move n bytes from the blocking fromfd to tofd through
+ * a pipe, copying instead if splice can't be used.
+ * Return 0 on success, -1 on errors.
+ */
+int tunnel_splice(int fromfd, int tofd, long n) {
+    int pfd[2];
+    ssize_t in;
+    ssize_t out;
+    int moved = 0;              /* splice worked at least once */
+    int rc = 0;
+    
+    if (pipe(pfd) < 0) {
+        return copy_n(fromfd, tofd, n);
+    }
+    while (n > 0 && rc == 0) {
+        in = splice(fromfd, NULL, pfd[1], NULL, 
+                    n < TUNNEL_CHUNK ? n : TUNNEL_CHUNK, SPLICE_F_MOVE);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in < 0 && errno == EINVAL && !moved) {
+            rc = copy_n(fromfd, tofd, n);
+            break;
+        }
+        if (in <= 0) {
+            rc = -1;
+            break;
+        }
+        moved = 1;
+        n -= in;
+        while (in > 0) {
+            out = splice(pfd[0], NULL, tofd, NULL, in, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                rc = -1;
+                break;
+            }
+            in -= out;
+        }
+    }
+    close(pfd[0]);
+    close(pfd[1]);
+    return rc;
+}
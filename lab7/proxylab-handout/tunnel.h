@@ -0,0 +1,16 @@
+/**
+ * Header file for tunnel.c.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#define TUNNEL_IDLE_MS 300000   /* close tunnels idle for this long */
+
+int tunnel_relay(int, int);
+int tunnel_splice(int, int, long);
+
+#endif /* __TUNNEL_H__ */
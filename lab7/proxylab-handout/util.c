@@ -0,0 +1,40 @@
+/**
+ * This file implements helpers shared by the other modules.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+
+#include <string.h>
+#include <time.h>
+#include "util.h"
+
+/*
+ * Current time in milliseconds on a monotonic clock.
+ */
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*
+ * FNV-1a of the len bytes at p.
+ */
+unsigned fnv_hash(const void *p, size_t len) {
+    const unsigned char *s = (const unsigned char *) p;
+    unsigned h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ s[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * FNV-1a of a key, 0 for no key.
+ */
+unsigned hash_key(char *s) {
+    return s ? fnv_hash(s, strlen(s)) : 0;
+}
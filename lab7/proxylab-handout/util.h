@@ -0,0 +1,35 @@
+/**
+ * Header file for util.c.
+ * 
+ * The semaphore wrappers are named sem_p and sem_v so that
+ * they do not clash with the P and V of csapp.h.
+ * 
+ * 
+ * Liruoyang YU
+ * liruoyay
+ */
+#ifndef __UTIL_H__
+#define __UTIL_H__
+
+#include <stddef.h>
+#include <semaphore.h>
+
+/*
+ * P operation
+ */
+static inline int sem_p(sem_t *sem) {
+    return sem_wait(sem);
+}
+
+/*
+ * V operation
+ */
+static inline int sem_v(sem_t *sem) {
+    return sem_post(sem);
+}
+
+long now_ms(void);
+unsigned fnv_hash(const void *, size_t);
+unsigned hash_key(char *);
+
+#endif /* __UTIL_H__ */